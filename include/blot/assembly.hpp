@@ -9,10 +9,16 @@
  * compiler command with @c -c replaced by @c -S and @c -o @c - appended, so
  * that the assembly is written to stdout and captured.  A @c -g1 flag is
  * also added to ensure basic source-location directives are emitted.
+ *
+ * Files can be compiled as they are in an editor rather than on disk:
+ * clang is told to read them from elsewhere, other compilers are run in
+ * a @c sandbox that shows them.
  */
 
 #include <filesystem>
+#include <span>
 #include <stdexcept>
+#include <stop_token>
 #include <string>
 #include <vector>
 
@@ -54,6 +60,11 @@ struct compilation_error : std::runtime_error {
   std::string dribble;
 };
 
+/** @brief Thrown when a compilation is stopped before it's done. */
+struct compilation_cancelled : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
 /** @brief Assembly text and invocation from a successful compilation.
  *
  * @c assembly holds the raw assembly output as a string.  @c invocation
@@ -65,13 +76,44 @@ struct compilation_result {
   compiler_invocation invocation;
 };
 
+/** @brief Contents to compile in place of those of a file on disk.
+ *
+ * @c file is absolute, and needn't exist.  @c contents is what an
+ * editor has for it, unsaved.
+ */
+struct file_overlay {
+  fs::path file;
+  std::string contents;
+};
+
+class sandbox;
+
 /** @brief Compile source file to assembly.
  *
  * Runs the compiler described by @p cmd, replacing the @c -c flag with
  * @c -S and directing output to stdout.  The working directory is set to
  * @c cmd.directory.  Throws @c compilation_error if the compiler exits
  * with a non-zero status.
+ *
+ * Files in @p overlays, the main file or any it includes, are compiled
+ * with the contents given instead of those on disk, which is left
+ * alone.  Only clang can do that: it's handed an @c -ivfsoverlay file
+ * mapping each to a copy in a temporary directory, under @c /dev/shm,
+ * which is memory-backed, where there's one, while still naming them
+ * by their own paths in the output.  That file is gone once this
+ * returns, so the reported invocation leaves it out.  Throws
+ * @c std::runtime_error if the copies can't be written.  Other
+ * compilers are run in the sandbox @p sb, whose root all of @p overlays
+ * must be under.  Throws @c std::runtime_error if @p overlays isn't
+ * empty, the compiler isn't clang, and there's no @p sb, or it isn't
+ * available.
+ *
+ * Once @p stop is requested, the compiler is killed and
+ * @c compilation_cancelled thrown.  Compilers in a sandbox are left to
+ * finish, but their output is thrown away just the same.
  */
-compilation_result get_asm(const compile_command& cmd);
+compilation_result get_asm(
+    const compile_command& cmd, std::span<const file_overlay> overlays = {},
+    sandbox* sb = nullptr, const std::stop_token& stop = {});
 
 }  // namespace xpto::blot
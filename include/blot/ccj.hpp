@@ -12,14 +12,28 @@
  * given source or header file.
  *
  * @c infer() works by parsing each translation unit in the database
- * and walking its full inclusion tree.  Relative @c -I flags in the
+ * and walking its full inclusion tree, unless the project's
+ * @c include_index already knows the answer.  Relative @c -I flags in the
  * stored compiler commands are resolved against the @c directory field
  * of each database entry, matching the behaviour of the original
- * compiler invocation.
+ * compiler invocation.  Entries are examined concurrently by a pool of
+ * worker threads, see @c infer_options.
+ *
+ * How a translation unit is examined depends on the @c infer_backend:
+ * a plain preprocessor run that stops as soon as the file is found,
+ * clang's dependency scanner, which preprocesses sources minimized down
+ * to their directives and shares them between translation units, or
+ * the dependency files the build system already wrote.
  */
 
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <optional>
+#include <stop_token>
+#include <string_view>
+#include <vector>
 
 #include "blot/compile_command.hpp"
 
@@ -34,6 +48,64 @@ namespace fs = std::filesystem;
  */
 std::optional<fs::path> find_ccj();
 
+class project;
+
+/** @brief How @c infer() looks for a file in a translation unit. */
+enum class infer_backend {
+  /** Run the preprocessor proper, stopping at the first match. */
+  preprocess,
+  /** Use clang's dependency scanner on directive-minimized sources. */
+  dependency_scan,
+  /** Read the build's @c .ninja_deps log or @c -MD files, if fresh.
+   *
+   * The log is looked for in the entry's @c directory and matched
+   * against its @c -o argument.  Failing that, the dependency file named
+   * by @c -MF, or the object file's name with a @c .d extension, is
+   * read.  Dependency data older than the translation unit or any of
+   * the files it lists is ignored and the entry is preprocessed.
+   */
+  build_deps,
+};
+
+/** @brief Parse a backend name, as used on the command line.
+ *
+ * Names are @c "preprocess", @c "dependency-scan" and @c "build-deps".
+ * Returns an empty optional for anything else.
+ */
+std::optional<infer_backend> parse_infer_backend(std::string_view name);
+
+/** @brief Tuning knobs for @c infer().
+ *
+ * @c jobs is the number of worker threads that preprocess database
+ * entries concurrently.  Zero means one per hardware thread.  Whatever
+ * the value, the result is the same as that of a sequential scan.
+ *
+ * @c backend selects how each entry is examined.  All backends find the
+ * same includers for translation units that compile cleanly, as long as
+ * the build's dependency files are up to date.
+ *
+ * With @c rank, entries aren't tried in database order but likeliest
+ * first: the includer found last time for the same file, then entries
+ * whose source file has the same stem ("foo.hpp" and "foo.cpp"), then
+ * entries seen including other files of the same directory, then
+ * entries in nearby directories.  Ties keep database order.
+ *
+ * @c on_progress, if set, is told how many of the entries to scan have
+ * been examined so far, every percent or so and once at the end.  It's
+ * called from worker threads, possibly concurrently.  It isn't called
+ * at all when the include index answers without scanning.
+ *
+ * Once @c stop is requested, workers finish the entry at hand and the
+ * scan ends early with whatever was found so far, possibly nothing.
+ */
+struct infer_options {
+  unsigned jobs{};
+  infer_backend backend{infer_backend::preprocess};
+  bool rank{true};
+  std::function<void(size_t scanned, size_t total)> on_progress{};
+  std::stop_token stop{};
+};
+
 /** @brief Find compile command covering @p source_file.
  *
  * This function is intended primarily for header files, which do not
@@ -53,10 +125,66 @@ std::optional<fs::path> find_ccj();
  * current directory.
  *
  * Returns the @c compile_command for the first matching translation
- * unit, or an empty optional if no entry in the database includes @p
- * source_file.  Throws if the database cannot be read or parsed.
+ * unit in the order entries are tried, see @c infer_options::rank, or
+ * an empty optional if no entry in the database includes
+ * @p source_file.  Throws if the database cannot be
+ * read or parsed.
+ */
+std::optional<compile_command> infer(
+    const fs::path& compile_commands_path, const fs::path& source_file,
+    const infer_options& opts = {});
+
+/** @brief Find compile command covering @p source_file in @p proj.
+ *
+ * Same as the other overload, but reuses the already parsed database of
+ * @p proj, and consults its @c include_index before preprocessing
+ * anything: when the index knows of translation units including
+ * @p source_file, the first of them in the order entries would be tried
+ * is returned straight away.  The results of earlier calls on @p proj
+ * feed the ranking of later ones.
  */
 std::optional<compile_command> infer(
-    const fs::path& compile_commands_path, const fs::path& source_file);
+    project& proj, const fs::path& source_file,
+    const infer_options& opts = {});
+
+/** @brief A translation unit covering some file, and what compiling it
+ * is expected to cost.
+ */
+struct includer {
+  compile_command command;
+  /** @brief Bytes of source the translation unit reads.
+   *
+   * The total size of the files it includes, if the project's
+   * @c include_index knows them, otherwise just its main file's size.
+   */
+  uint64_t source_bytes{};
+  /** @brief How long it took to compile last time, if recorded with
+   * @c project::record_compile_time().
+   */
+  std::optional<std::chrono::milliseconds> compile_time{};
+  /** @brief Expected compile time.
+   *
+   * @c compile_time if known, otherwise @c source_bytes scaled by the
+   * rate observed on the other includers with a known compile time.
+   */
+  std::chrono::milliseconds estimated_cost{};
+};
+
+/** @brief Find up to @p max compile commands covering @p source_file,
+ * cheapest first.
+ *
+ * Like @c infer(), but doesn't settle for the first includer: when the
+ * project's @c include_index knows of includers, all of them are
+ * considered.  Otherwise scanning goes on a couple of entries past the
+ * first includer found, for others nearby, but stops there, or once
+ * @p max were found.
+ * The result is sorted by @c includer::estimated_cost, ties in the
+ * order @c infer() would try them, and has at most @p max elements.
+ * Its front is the translation unit to compile when annotating
+ * @p source_file quickly matters more than which one is used.
+ */
+std::vector<includer> infer_all(
+    project& proj, const fs::path& source_file, size_t max,
+    const infer_options& opts = {});
 
 }  // namespace xpto::blot
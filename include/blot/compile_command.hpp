@@ -11,6 +11,8 @@
 
 #include <filesystem>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace xpto::blot {
 
@@ -21,13 +23,25 @@ namespace fs = std::filesystem;
  * @c directory is the working directory in which the compiler should be
  * invoked.  @c command is the full compiler command string exactly as stored
  * in the database.  @c file is the primary source file being compiled.
+ * @c arguments is @c command already split into words, compiler first.  It
+ * may be left empty, in which case consumers split @c command themselves.
  *
- * When returned by @c infer(), all three fields are absolute paths.
+ * When returned by @c infer(), @c directory and @c file are absolute paths
+ * and @c arguments is filled in.
  */
 struct compile_command {
   fs::path directory;
   std::string command;
   fs::path file;
+  std::vector<std::string> arguments{};
 };
 
+/** @brief Split a compiler command string into words.
+ *
+ * Follows the POSIX shell-like quoting rules that @c compile_commands.json
+ * prescribes for its @c "command" field: whitespace separates words, and
+ * quotes and backslashes escape.
+ */
+std::vector<std::string> tokenize_command(std::string_view command);
+
 }  // namespace xpto::blot
@@ -0,0 +1,108 @@
+#pragma once
+
+/**
+ * @file include_index.hpp
+ * @brief Persistent reverse include graph of a compile commands database.
+ *
+ * An @c include_index records, for every translation unit in a
+ * @c compile_commands.json database, the full set of files it includes,
+ * directly or transitively.  Inverted, that set answers "which
+ * translation units include this header?" with a hash lookup, where
+ * @c infer() would otherwise have to preprocess translation units until
+ * it finds one.
+ *
+ * The index is built in the background and saved next to the database,
+ * so that later runs start warm.  Refreshing is incremental: only
+ * translation units whose command, source file, or included files
+ * changed modification time since they were last scanned are
+ * preprocessed again.
+ */
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+class project;
+
+/** @brief Header-to-includers index for one compile commands database.
+ *
+ * All member functions are safe to call concurrently.  Lookups never
+ * block on a refresh in progress; they see the state as of the last
+ * completed one.
+ */
+class include_index {
+ public:
+  /** @brief Create an empty index for the database of @p proj.
+   *
+   * Nothing is read or scanned until the first call to @c refresh() or
+   * @c refresh_async().  Normally only @c project itself does this, see
+   * @c project::index().
+   */
+  explicit include_index(project& proj);
+  ~include_index();
+
+  include_index(const include_index&) = delete;
+  include_index(include_index&&) = delete;
+  include_index& operator=(const include_index&) = delete;
+  include_index& operator=(include_index&&) = delete;
+
+  /** @brief File the index is persisted to, next to the database. */
+  [[nodiscard]] fs::path storage_path() const;
+
+  /** @brief Bring the index up to date and persist it.
+   *
+   * The first call loads any previously persisted index.  Then every
+   * database entry that is new or stale is preprocessed, and the result
+   * is written back to @c storage_path().  Throws if the database cannot
+   * be read or parsed.
+   */
+  void refresh();
+
+  /** @brief Like @c refresh(), but in a background thread.
+   *
+   * Returns immediately.  Does nothing if a refresh is already running
+   * or one finished only moments ago, so it is cheap to call on every
+   * lookup.  Errors are logged, not thrown.
+   */
+  void refresh_async();
+
+  /** @brief Translation units known to include @p file.
+   *
+   * @p file is matched like in @c infer(): relative paths are resolved
+   * against the current directory.  A translation unit counts as
+   * including itself.  Returns absolute paths of the translation units'
+   * main files, in database order, or an empty vector if none is known
+   * to include @p file, which may just mean it wasn't scanned yet.
+   */
+  [[nodiscard]] std::vector<fs::path> includers(const fs::path& file) const;
+
+  /** @brief Files the translation unit @p tu includes.
+   *
+   * Absolute paths, directly or transitively included, @p tu itself
+   * among them, in no particular order.  Empty if @p tu wasn't scanned
+   * yet.
+   */
+  [[nodiscard]] std::vector<fs::path> included_files(const fs::path& tu) const;
+
+  /** @brief True if what the index knows of @p tu still holds.
+   *
+   * That is, if @p tu was scanned and none of the files it includes,
+   * itself among them, changed modification time since.  Stats every
+   * one of those files.  Lookups don't check this by themselves, so
+   * that callers pay for it only for the translation units they use.
+   */
+  [[nodiscard]] bool fresh(const fs::path& tu) const;
+
+  /** @brief True once every database entry has been scanned. */
+  [[nodiscard]] bool complete() const;
+
+ private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+};
+
+}  // namespace xpto::blot
@@ -0,0 +1,161 @@
+#pragma once
+
+/**
+ * @file project.hpp
+ * @brief Shared, cached model of a @c compile_commands.json database.
+ *
+ * A @c project reads its database once and keeps the result in an
+ * immutable @c ccj_snapshot: an index of the entries by absolute source
+ * file path, built by a quick pass over the file's contents, from
+ * which entries are parsed, commands split into argument vectors, only
+ * when first asked for.  Loading thus stays cheap however big the
+ * database.  The snapshot is reloaded transparently whenever the
+ * database file's modification time changes.  Servers keep one
+ * @c project per database and share it between all their sessions.
+ */
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "blot/compile_command.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+class include_index;
+struct scan_cache;
+
+/** @brief Immutable contents of a compile commands database.
+ *
+ * Entries keep their order in the file.  Their @c directory and @c file
+ * fields are absolute, relative ones being resolved against the
+ * directory containing the database, and their @c arguments are always
+ * filled in, whether the entry used @c "command" or @c "arguments".
+ *
+ * The database file is read into memory whole, so the snapshot is
+ * unaffected by the file being rewritten, in place or not.  All member
+ * functions are safe to call concurrently.
+ */
+class ccj_snapshot {
+ public:
+  /** @brief Read @p compile_commands_path and index its entries.
+   *
+   * Only the @c "directory" and @c "file" fields are decoded here.
+   * Entries lacking either are skipped with a warning.  Throws if the
+   * file can't be read or isn't a JSON array.
+   */
+  explicit ccj_snapshot(const fs::path& compile_commands_path);
+  ~ccj_snapshot();
+
+  ccj_snapshot(const ccj_snapshot&) = delete;
+  ccj_snapshot(ccj_snapshot&&) = delete;
+  ccj_snapshot& operator=(const ccj_snapshot&) = delete;
+  ccj_snapshot& operator=(ccj_snapshot&&) = delete;
+
+  /** @brief Number of entries. */
+  [[nodiscard]] size_t size() const { return files_.size(); }
+
+  /** @brief Entry number @p i, in database order.
+   *
+   * Parsed on first access.  An entry whose command can't be parsed
+   * comes back with empty @c command and @c arguments, and a warning is
+   * logged.
+   */
+  [[nodiscard]] const compile_command& at(size_t i) const;
+
+  /** @brief Absolute source file of entry number @p i.
+   *
+   * Same as <tt>at(i).file</tt>, but never parses the entry.
+   */
+  [[nodiscard]] const fs::path& file(size_t i) const { return files_.at(i); }
+
+  /** @brief Index of the first entry compiling @p file, if any.
+   *
+   * @p file must be absolute and lexically normal.
+   */
+  [[nodiscard]] std::optional<size_t> find(const fs::path& file) const;
+
+  /** @brief Modification time of the database file when it was read. */
+  [[nodiscard]] fs::file_time_type mtime() const { return mtime_; }
+
+ private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+  fs::file_time_type mtime_;
+  std::vector<fs::path> files_;
+  std::vector<fs::path> directories_;
+  std::unordered_map<std::string_view, size_t> by_file_;  // into files_
+};
+
+/** @brief Long-lived model of the project behind one database.
+ *
+ * Owns the current @c ccj_snapshot, the project's @c include_index, and
+ * the caches shared by every scan of its translation units.
+ * All member functions are safe to call concurrently.
+ */
+class project {
+ public:
+  /** @brief Model the project described by @p compile_commands_path.
+   *
+   * Nothing is read until the first call to @c database().
+   */
+  explicit project(fs::path compile_commands_path);
+  ~project();
+
+  project(const project&) = delete;
+  project(project&&) = delete;
+  project& operator=(const project&) = delete;
+  project& operator=(project&&) = delete;
+
+  /** @brief Path to the database, as given to the constructor. */
+  [[nodiscard]] const fs::path& ccj_path() const { return ccj_path_; }
+
+  /** @brief Current snapshot of the database.
+   *
+   * Costs a single @c stat() when the file hasn't changed since the last
+   * call.  Otherwise re-reads it.  Throws if it can't be read or parsed.
+   * The returned snapshot stays valid however long it is held on to.
+   */
+  std::shared_ptr<const ccj_snapshot> database();
+
+  /** @brief The project's reverse include graph. */
+  include_index& index() { return *index_; }
+
+  /** @brief Internal state shared by scans of this project.
+   *
+   * Opaque outside of the library; used by @c infer() and
+   * @c include_index to avoid re-reading the same headers for every
+   * translation unit.
+   */
+  scan_cache& caches() { return *caches_; }
+
+  /** @brief Remember that compiling @p tu took @p elapsed.
+   *
+   * Feeds the cost estimates of @c infer_all().
+   */
+  void record_compile_time(
+      const fs::path& tu, std::chrono::milliseconds elapsed);
+
+  /** @brief How long compiling @p tu took last time, if recorded. */
+  [[nodiscard]] std::optional<std::chrono::milliseconds> compile_time(
+      const fs::path& tu) const;
+
+ private:
+  fs::path ccj_path_;
+  std::mutex mutex_;
+  std::shared_ptr<const ccj_snapshot> snapshot_;
+  std::unique_ptr<scan_cache> caches_;
+  std::unique_ptr<include_index> index_;
+  mutable std::mutex times_mutex_;
+  std::unordered_map<std::string, std::chrono::milliseconds> compile_times_;
+};
+
+}  // namespace xpto::blot
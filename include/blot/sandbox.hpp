@@ -0,0 +1,119 @@
+#pragma once
+
+/**
+ * @file sandbox.hpp
+ * @brief A private view of a project directory with unsaved files in it.
+ *
+ * A @c sandbox lets compilers that can't be told to read files from
+ * elsewhere, unlike clang, compile what an editor has in memory.  It
+ * runs them in a Linux user and mount namespace where an overlay
+ * filesystem, whose upper layer is a tmpfs, is mounted over the
+ * project directory itself.  Unsaved files are written into that
+ * layer, so compilers find them under their own paths, and nothing
+ * outside the namespace sees them.
+ *
+ * The namespace belongs to a helper process, @c spoof_exe, started
+ * once and kept: compiles are sent to it, and the files it shows are
+ * changed in place between them.  Only files no longer unsaved cost a
+ * remount.  Nothing is ever mounted or written outside the namespace,
+ * which goes away with the helper, so nothing is left behind should
+ * either crash.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "blot/assembly.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+/** @brief Exit status and output of a command run in a @c sandbox. */
+struct sandbox_result {
+  int exit_code{};
+  std::string out;
+  std::string err;
+};
+
+/** @brief Where @c spoof_exe is expected: next to the running program. */
+fs::path default_sandbox_helper();
+
+/** @brief Runs commands seeing unsaved files under one directory.
+ *
+ * Construction is cheap: the helper starts with the first @c run(), and
+ * again with the next if it dies.  Runs are serialized, since they all
+ * share one view of @c root().  All member functions are safe to call
+ * concurrently.
+ */
+class sandbox {
+ public:
+  /** @brief A sandbox for files under @p root, served by @p helper. */
+  explicit sandbox(fs::path root, fs::path helper = default_sandbox_helper());
+  ~sandbox();
+
+  sandbox(const sandbox&) = delete;
+  sandbox(sandbox&&) = delete;
+  sandbox& operator=(const sandbox&) = delete;
+  sandbox& operator=(sandbox&&) = delete;
+
+  /** @brief The directory unsaved files can be in. */
+  [[nodiscard]] const fs::path& root() const { return root_; }
+
+  /** @brief Whether the helper runs, or could be started now.
+   *
+   * False where user namespaces or overlay mounts aren't allowed to
+   * unprivileged users, or the helper can't be found.  Once false,
+   * stays so.
+   */
+  [[nodiscard]] bool available();
+
+  /** @brief Run @p program with @p args in @p directory.
+   *
+   * Files in @p overlays, which must all be under @c root(), are seen
+   * with the contents given, and those given to earlier runs but not
+   * this one as they are on disk.  @p program is found as
+   * @c get_asm() finds compilers.  Throws @c std::runtime_error if the
+   * helper can't be started or talked to, a file isn't under
+   * @c root(), or the helper can't write a file or start @p program.
+   * Only the first two cost the helper, restarted by the next run.
+   */
+  sandbox_result run(
+      std::span<const file_overlay> overlays, const std::string& program,
+      const std::vector<std::string>& args, const fs::path& directory);
+
+ private:
+  struct helper;
+  // Start the helper, if not running.  Under `mutex_`.
+  helper& start_();
+
+  const fs::path root_;
+  const fs::path helper_path_;
+
+  std::mutex mutex_;
+  std::unique_ptr<helper> helper_;
+  std::optional<std::string> broken_;  // why the helper can't start
+  // Files the helper shows unsaved: SHA-256s of their contents, since
+  // the sandbox may be shared by several clients.
+  std::map<fs::path, std::array<uint8_t, 32>> shown_;
+};
+
+/** @brief The helper's side: serve a @c sandbox over stdin and stdout.
+ *
+ * What @c spoof_exe runs.  Sets up the namespace and overlay for
+ * @p root, then answers requests until stdin closes.  Returns the exit
+ * status.
+ */
+int serve_sandbox(const fs::path& root);
+
+}  // namespace xpto::blot
@@ -66,7 +66,7 @@ grabbed_input_t grab_input(blot::file_options& fopts) {
       fopts.compile_commands_path = ccj_path;
       LOG_INFO("Detected {}", ccj_path);
     }
-    auto cmd = blot::infer(ccj_path, *fopts.src_file_name);
+    auto cmd = blot::infer(ccj_path, *fopts.src_file_name, fopts.infer);
     if (!cmd) throwf("Can't find an entry for {}", *fopts.src_file_name);
 
     LOG_INFO("Got this command '{}'", cmd->command);
@@ -101,9 +101,9 @@ int main_nojson(blot::file_options& fopts, blot::annotation_options& aopts) {
         [&](auto&& w) -> std::pair<fs::path, std::string> {
           using T = std::decay_t<decltype(w)>;
           if constexpr (std::is_same_v<T, simple_input>) {
-            return {fs::current_path(), w.assembly};
+            return {fs::current_path(), std::move(w.assembly)};
           } else {
-            return {w.invocation.directory, w.assembly};
+            return {w.invocation.directory, std::move(w.assembly)};
           }
         },
         grab_input(fopts));
@@ -144,15 +144,22 @@ int main(int argc, char* argv[]) {
       return -1;
     }
 
+    blot::prefetch_options prefetch{
+      .cpu_percent = fopts.prefetch_cpu_percent,
+      .memory = fopts.prefetch_memory_mib << 20};
+
     if (fopts.stdio_mode) {
       boost::asio::io_context ioc;
-      blot::run_stdio_server(ioc, ccj, project_root);
+      blot::run_stdio_server(
+          ioc, ccj, project_root, fopts.cache_budget_mib << 20, prefetch);
       ioc.run();
       return 0;
     }
 
     boost::asio::thread_pool pool{4};
-    int port = blot::run_web_server(pool.get_executor(), ccj, project_root, fopts.port);
+    int port = blot::run_web_server(
+        pool.get_executor(), ccj, project_root, fopts.port,
+        fopts.cache_budget_mib << 20, prefetch);
     fmt::println("blot --web: listening on http://localhost:{}", port);
     fmt::println("  project root : {}", project_root.string());
     fmt::println("  ccj          : {}", ccj.string());
@@ -177,12 +184,12 @@ int main(int argc, char* argv[]) {
         [&](auto&& w) {
           using T = std::decay_t<decltype(w)>;
           if constexpr (std::is_same_v<T, simple_input>) {
-            assembly = w.assembly;
+            assembly = std::move(w.assembly);
             json_result.erase("file_options");  // it would be confusing
             json_result["assembly_file"] =
                 w.from_stdin ? "<stdin>" : fopts.asm_file_name->c_str();
           } else {
-            assembly = w.assembly;
+            assembly = std::move(w.assembly);
             json_result["compiler_invocation"] = meta_to_json(w.invocation);
           }
         },
@@ -4,6 +4,7 @@
 #include <optional>
 
 #include "blot/blot.hpp"
+#include "blot/ccj.hpp"
 
 namespace fs = std::filesystem;
 
@@ -43,6 +44,19 @@ std::optional<int> parse_options(
       "--compile_commands,--ccj", fopts.compile_commands_path,
       "Path to compile_commands.json file")
       ->type_name("CCJ-PATH");
+  app.add_option_function<std::string>(
+         "--infer-backend",
+         [&](const std::string& name) {
+           fopts.infer.backend = *parse_infer_backend(name);
+         },
+         "How to find a header's includer: preprocess (default), "
+         "dependency-scan or build-deps.  Servers take it per blot/infer "
+         "request")
+      ->check([](const std::string& name) {
+        return parse_infer_backend(name) ? std::string{}
+                                         : "unknown backend " + name;
+      })
+      ->type_name("BACKEND");
   app.add_flag("--json", json_output, "Output results in JSON format")
       ->capture_default_str();
   app.add_flag("--web", fopts.web_mode, "Start HTTP server with browser UI")
@@ -53,6 +67,23 @@ std::optional<int> parse_options(
       ->capture_default_str();
   app.add_option("--port", fopts.port, "Port for --web mode (default 4242)")
       ->capture_default_str();
+  app.add_option(
+         "--cache-budget", fopts.cache_budget_mib,
+         "Memory for cached results of --web/--stdio sessions, in MiB")
+      ->capture_default_str()
+      ->type_name("MIB");
+  app.add_option(
+         "--prefetch-cpu", fopts.prefetch_cpu_percent,
+         "Share of a core --web/--stdio may spend precompiling files likely "
+         "to be asked for next, in percent; 0 disables it")
+      ->capture_default_str()
+      ->check(CLI::Range(0, 100))
+      ->type_name("PERCENT");
+  app.add_option(
+         "--prefetch-memory", fopts.prefetch_memory_mib,
+         "Stop precompiling while cached results take more than this, in MiB")
+      ->capture_default_str()
+      ->type_name("MIB");
   app.add_option(
       "--web-root", fopts.web_root,
       "Serve static files from DIR instead of embedded HTML (for development)")
@@ -4,6 +4,7 @@
 #include <span>
 
 #include "blot/blot.hpp"
+#include "blot/ccj.hpp"
 
 namespace fs = std::filesystem;
 
@@ -18,6 +19,10 @@ struct file_options {
   bool stdio_mode{};
   int port{4242};
   std::optional<fs::path> web_root{};
+  size_t cache_budget_mib{512};
+  int prefetch_cpu_percent{25};
+  size_t prefetch_memory_mib{128};
+  infer_options infer{};
 };
 
 std::optional<int> parse_options(
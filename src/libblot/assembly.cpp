@@ -13,10 +13,20 @@
 #include <boost/process/v2/start_dir.hpp>
 #include <boost/process/v2/stdio.hpp>
 #include <boost/system/detail/error_code.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stop_token>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
 #include <vector>
 
+#include "blot/sandbox.hpp"
 #include "logger.hpp"
 
 namespace xpto::blot {
@@ -33,7 +43,8 @@ auto args_to_string(std::string res, std::vector<std::string>& args) {
   return res;
 }
 
-std::string get_compiler_version(const std::string& compiler) {
+// What `compiler --version` prints.
+static std::string get_version_output(const std::string& compiler) {
   asio::io_context ctx;
   asio::readable_pipe rp_out{ctx};
   std::string output;
@@ -47,7 +58,10 @@ std::string get_compiler_version(const std::string& compiler) {
   boost::system::error_code ec;
   asio::read(rp_out, asio::dynamic_buffer(output), ec);
   proc.wait();
+  return output;
+}
 
+static std::string parse_compiler_version(const std::string& output) {
   // Parse version from output using RE2
   static const RE2 gcc_re(R"((?:gcc|GCC)\)?\s*(\d+\.\d+\.\d+))");
   static const RE2 clang_re(R"(clang.*?(\d+\.\d+\.\d+))");
@@ -61,20 +75,107 @@ std::string get_compiler_version(const std::string& compiler) {
   return "<unknown>";
 }
 
+// `s` as a double-quoted YAML string.
+static std::string yaml_quote(std::string_view s) {
+  std::string res{'"'};
+  for (char c : s) {
+    if (c == '"' || c == '\\') res += '\\';
+    res += c;
+  }
+  res += '"';
+  return res;
+}
+
+// Copies of unsaved files in a fresh directory, memory-backed where
+// there's /dev/shm, in the temporary directory otherwise, and a clang
+// VFS overlay mapping the originals to them, all removed when this
+// goes.  Files are grouped by directory, as the overlay format
+// wants.  External names aren't used, so that the compiler still
+// calls files by their own paths in .file directives.
+class vfs_overlay {
+ public:
+  explicit vfs_overlay(std::span<const file_overlay> overlays) {
+    std::error_code ec{};
+    fs::path base = fs::is_directory("/dev/shm", ec)
+                        ? fs::path{"/dev/shm"}
+                        : fs::temp_directory_path();
+    std::string tmpl = (base / "blot-vfs-XXXXXX").string();
+    if (!::mkdtemp(tmpl.data()))
+      throw std::system_error{errno, std::system_category(), "mkdtemp"};
+    dir_ = tmpl;
+
+    std::vector<std::pair<fs::path, std::string>> by_dir;
+    for (size_t i = 0; i < overlays.size(); ++i) {
+      const auto& o = overlays[i];
+      auto copy = dir_ / std::to_string(i);
+      write_(copy, o.contents);
+      auto entry = fmt::format(
+          R"({{"name": {}, "type": "file", "external-contents": {}}})",
+          yaml_quote(o.file.filename().string()), yaml_quote(copy.string()));
+      auto parent = o.file.parent_path();
+      auto it = std::ranges::find(by_dir, parent, [](auto& d) {
+        return d.first;
+      });
+      if (it == by_dir.end())
+        by_dir.emplace_back(parent, std::move(entry));
+      else
+        it->second += ", " + entry;
+    }
+    std::string yaml =
+        R"({"version": 0, "case-sensitive": "true", )"
+        R"("use-external-names": "false", "roots": [)";
+    for (size_t i = 0; i < by_dir.size(); ++i) {
+      if (i) yaml += ", ";
+      yaml += fmt::format(
+          R"({{"name": {}, "type": "directory", "contents": [{}]}})",
+          yaml_quote(by_dir[i].first.string()), by_dir[i].second);
+    }
+    yaml += "]}\n";
+    write_(yaml_path(), yaml);
+  }
+  vfs_overlay(const vfs_overlay&) = delete;
+  vfs_overlay(vfs_overlay&&) = delete;
+  vfs_overlay& operator=(const vfs_overlay&) = delete;
+  vfs_overlay& operator=(vfs_overlay&&) = delete;
+  ~vfs_overlay() {
+    std::error_code ec{};
+    fs::remove_all(dir_, ec);
+  }
+
+  [[nodiscard]] fs::path yaml_path() const { return dir_ / "overlay.yaml"; }
+
+ private:
+  // Lest clang compile a truncated copy should the directory be full.
+  static void write_(const fs::path& file, std::string_view contents) {
+    std::ofstream f{file, std::ios::binary};
+    f << contents;
+    f.close();
+    if (!f)
+      throw std::runtime_error{
+        fmt::format("Can't write unsaved file copy {}", file.string())};
+  }
+
+  fs::path dir_;
+};
+
 // Run the compiler with modified command to generate assembly
-compilation_result get_asm(const compile_command& cmd) {
+compilation_result get_asm(
+    const compile_command& cmd, std::span<const file_overlay> overlays,
+    sandbox* sb, const std::stop_token& stop) {
   const auto& directory = cmd.directory;
-  const auto& command = cmd.command;
-  // Modify the command to generate assembly with debugging info
-  // Parse the original command to extract the compiler and its arguments
-  std::istringstream iss(command);
-  std::string compiler;
-  iss >> compiler;
+  // Modify the command to generate assembly with debugging info.
+  // Split the original command into the compiler and its arguments,
+  // unless whoever made `cmd` already did.
+  std::vector<std::string> original_args = cmd.arguments.empty()
+                                               ? tokenize_command(cmd.command)
+                                               : cmd.arguments;
+  if (original_args.empty())
+    throw std::runtime_error{"Empty compilation command"};
+  std::string compiler = std::move(original_args.front());
+  original_args.erase(original_args.begin());
 
-  std::vector<std::string> original_args;
-  for (std::string arg{}; iss >> arg;) original_args.push_back(arg);
-
-  std::string compiler_version = get_compiler_version(compiler);
+  auto version_output = get_version_output(compiler);
+  std::string compiler_version = parse_compiler_version(version_output);
 
   std::vector<std::string> args;
   bool had_dash_c = false;
@@ -103,30 +204,69 @@ compilation_result get_asm(const compile_command& cmd) {
   args.push_back("-o");
   args.push_back("-");
 
+  // The overlay's YAML is gone by the time we return, so its flag goes
+  // only to the compiler, never into the invocation we report.
+  std::optional<vfs_overlay> vfs{};
+  auto run_args = args;
+  bool sandboxed{};
+  if (!overlays.empty()) {
+    if (version_output.find("clang") != std::string::npos) {
+      vfs.emplace(overlays);
+      run_args.push_back("-ivfsoverlay");
+      run_args.push_back(vfs->yaml_path().string());
+    } else if (sb) {
+      sandboxed = true;
+    } else {
+      throw std::runtime_error{fmt::format(
+          "{} can't compile unsaved files without a sandbox", compiler)};
+    }
+  }
+
   LOG_INFO(
-      "Running compiler {}:\n{}", compiler, args_to_string(compiler, args));
+      "Running compiler {}{}:\n{}", compiler, sandboxed ? " sandboxed" : "",
+      args_to_string(compiler, run_args));
   LOG_DEBUG("Workdir {}:", directory);
 
-  // process(asio::any_io_executor, filesystem::path, range<string> args,
-  // AdditionalInitializers...)
-  asio::io_context ctx;
-  asio::readable_pipe rp_out{ctx};
-  asio::readable_pipe rp_err{ctx};
   std::string output{};
   std::string error_output{};
+  int exit_code{};
+  if (sandboxed) {
+    if (stop.stop_requested())
+      throw compilation_cancelled{fmt::format("{} cancelled", compiler)};
+    auto res = sb->run(overlays, compiler, run_args, directory);
+    exit_code = res.exit_code;
+    output = std::move(res.out);
+    error_output = std::move(res.err);
+  } else {
+    // process(asio::any_io_executor, filesystem::path, range<string> args,
+    // AdditionalInitializers...)
+    asio::io_context ctx;
+    asio::readable_pipe rp_out{ctx};
+    asio::readable_pipe rp_err{ctx};
 
-  p2::process proc{
-    ctx, compiler, args,
-    p2::process_stdio{.in = nullptr, .out = rp_out, .err = rp_err},
-    p2::process_start_dir{directory}};
+    p2::process proc{
+      ctx, compiler, run_args,
+      p2::process_stdio{.in = nullptr, .out = rp_out, .err = rp_err},
+      p2::process_start_dir{directory}};
 
-  boost::system::error_code ec_out, ec_err;
-  asio::read(rp_out, asio::dynamic_buffer(output), ec_out);
-  asio::read(rp_err, asio::dynamic_buffer(error_output), ec_err);
-  assert(!ec_out || (ec_out == asio::error::eof));
-  assert(!ec_err || (ec_err == asio::error::eof));
+    boost::system::error_code ec_out, ec_err;
+    {
+      // Killed, its output ends.  Not once waited for: its pid could
+      // be someone else's by then.
+      std::stop_callback kill{stop, [&proc] {
+                                boost::system::error_code ec{};
+                                proc.terminate(ec);
+                              }};
+      asio::read(rp_out, asio::dynamic_buffer(output), ec_out);
+      asio::read(rp_err, asio::dynamic_buffer(error_output), ec_err);
+    }
+    assert(!ec_out || (ec_out == asio::error::eof));
+    assert(!ec_err || (ec_err == asio::error::eof));
+    exit_code = proc.wait();
+  }
+  if (stop.stop_requested())
+    throw compilation_cancelled{fmt::format("{} cancelled", compiler)};
 
-  auto exit_code = proc.wait();
   if (exit_code != 0) {
     fmt::print(stderr, "{}", error_output);
     throw compilation_error{
@@ -136,7 +276,7 @@ compilation_result get_asm(const compile_command& cmd) {
   }
 
   return {
-    .assembly = output,
+    .assembly = std::move(output),
     .invocation = {compiler, args, directory, compiler_version}};
 }
 
@@ -6,23 +6,47 @@
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
 #include <clang/Lex/PPCallbacks.h>
 #include <clang/Lex/Preprocessor.h>
-#include <clang/Tooling/JSONCompilationDatabase.h>
+#include <clang/Tooling/DependencyScanning/DependencyScanningService.h>
+#include <clang/Tooling/DependencyScanning/DependencyScanningTool.h>
 #include <clang/Tooling/Tooling.h>
 #include <fmt/std.h>
+#include <llvm/Support/Error.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <shared_mutex>
+#include <stop_token>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include "auto.hpp"
+#include "blot/include_index.hpp"
+#include "blot/project.hpp"
+#include "depfile.hpp"
 #include "logger.hpp"
-#include "utils.hpp"
+#include "scan_cache.hpp"
 
 namespace xpto::blot {
 
 namespace fs = std::filesystem;
+namespace deps = clang::tooling::dependencies;
 
 std::optional<fs::path> find_ccj() {
   auto probe = fs::current_path() / "compile_commands.json";
@@ -30,8 +54,72 @@ std::optional<fs::path> find_ccj() {
   return std::nullopt;
 }
 
+std::optional<infer_backend> parse_infer_backend(std::string_view name) {
+  if (name == "preprocess") return infer_backend::preprocess;
+  if (name == "dependency-scan") return infer_backend::dependency_scan;
+  if (name == "build-deps") return infer_backend::build_deps;
+  return std::nullopt;
+}
+
 namespace {
 
+using dead_set_t = std::unordered_set<std::string>;
+
+// Entries scanned past the first match, when more includers are
+// wanted: a chance to find a cheaper one nearby, without preprocessing
+// the whole database for headers with fewer includers than wanted.
+constexpr size_t k_scan_past_match = 2;
+
+// State shared by every worker of a single infer() scan.  Workers
+// claim positions in the scan order in ascending order from `next`.
+// The scan wants the first `wanted` matches in that order, but none
+// more than `k_scan_past_match` positions past the first: `cutoff` is
+// the last position worth scanning, once there's a match.
+struct scan_state {
+  static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+  explicit scan_state(size_t wanted) : wanted{wanted} {}
+
+  const size_t wanted;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> cutoff{npos};
+
+  std::mutex found_mutex;
+  std::vector<size_t> found;  // sorted
+
+  std::shared_mutex dead_mutex;
+  dead_set_t dead_files;
+
+  // Whether to skip user headers known to be dead for this needle, see
+  // `pruning_memo`.
+  bool prune{};
+
+  // True if enough earlier positions than `index` already matched, in
+  // which case scanning `index` can't change the outcome.
+  [[nodiscard]] bool superseded(size_t index) const {
+    return cutoff.load(std::memory_order_relaxed) < index;
+  }
+
+  // Workers may have claimed positions before `cutoff` dropped below
+  // them: what they find there doesn't count, as in a sequential scan.
+  void report_match(size_t index) {
+    std::lock_guard lk{found_mutex};
+    if (index > cutoff) return;
+    found.insert(std::ranges::upper_bound(found, index), index);
+    if (found.size() > wanted) found.pop_back();
+    size_t last = found.front() + k_scan_past_match;
+    if (found.size() == wanted) last = std::min(last, found.back());
+    if (last < cutoff) cutoff = last;
+    while (found.back() > cutoff) found.pop_back();
+  }
+
+  // Make every worker stop at the next opportunity.
+  void abort() {
+    std::lock_guard lk{found_mutex};
+    cutoff = 0;
+  }
+};
+
 class find_action : public clang::PreprocessOnlyAction {
   struct finder : clang::PPCallbacks {
     find_action* action;
@@ -49,28 +137,233 @@ class find_action : public clang::PreprocessOnlyAction {
       LOG_TRACE(
           "        saw includee '{}' ({})", path,
           kind == clang::SrcMgr::C_User ? "user" : "system");
+      if (kind == clang::SrcMgr::C_User)
+        action->user_dirs_.insert(path.parent_path().string());
       if (path == action->needle_) {
         action->match_ = true;
         return;
       }
       // Remember any headers seen so further TUs can skip
       // re-processing them entirely.  Restrict this to system
-      // headers.
+      // headers: a user header might still lead to the needle.
       if (kind != clang::SrcMgr::C_User)
-        action->dead_files_.insert(path.string());
+        action->new_dead_files_.push_back(path.string());
+    }
+
+    // What a file entered, but not yet left, took from the rest of the
+    // TU, or left it, besides includes.  If neither, and it doesn't lead
+    // to the needle, it never will in a TU with the same flags.
+    struct frame {
+      clang::FileID file;
+      unsigned seq;  // order in which it was entered
+      bool tainted{};  // tested macros defined before it was entered
+      std::unordered_set<std::string> undefined;  // tested, undefined
+      std::unordered_set<std::string> defined;  // (un)defined in user files
+    };
+    std::vector<frame> stack;
+    std::unordered_map<unsigned, unsigned> seq_of;  // by FileID hash
+    unsigned next_seq{};
+
+    [[nodiscard]] bool pruning() const {
+      return action->memo_ && !action->match_ && !stack.empty();
+    }
+    clang::Preprocessor& pp() const {
+      return action->getCompilerInstance().getPreprocessor();
+    }
+
+    // A conditional directive looked at `name`, defined as `md`.  Files
+    // entered since `md` was defined, and not left yet, depend on what
+    // came before them, which another TU could do otherwise.
+    void depends_on(llvm::StringRef name, const clang::MacroDefinition& md) {
+      if (!pruning()) return;
+      auto* mi = md.getMacroInfo();
+      if (!mi) {
+        stack.back().undefined.insert(name.str());
+        return;
+      }
+      auto& sm = pp().getSourceManager();
+      auto loc = mi->getDefinitionLoc();
+      // Builtin or given with -D: the same for all TUs the memo is for.
+      if (mi->isBuiltinMacro() || loc.isInvalid() ||
+          sm.isWrittenInBuiltinFile(loc) || sm.isWrittenInCommandLineFile(loc))
+        return;
+      auto file = sm.getFileID(sm.getExpansionLoc(loc));
+      auto it = seq_of.find(file.getHashValue());
+      unsigned seq = it == seq_of.end() ? 0 : it->second;
+      for (auto f = stack.rbegin(); f != stack.rend() && f->seq > seq; ++f)
+        f->tainted = true;
+    }
+
+    void defines(const clang::Token& name) {
+      if (!pruning()) return;
+      auto& sm = pp().getSourceManager();
+      auto loc = name.getLocation();
+      // System headers are assumed not to matter, as for `dead_files`.
+      if (sm.isWrittenInBuiltinFile(loc) ||
+          sm.isWrittenInCommandLineFile(loc) ||
+          sm.getFileCharacteristic(loc) != clang::SrcMgr::C_User)
+        return;
+      stack.back().defined.insert(name.getIdentifierInfo()->getName().str());
+    }
+
+    // Macros an #if or #elif looked at.  Those it expanded are reported
+    // by `MacroExpands()` too, but undefined ones by nothing else.
+    void depends_on(clang::SourceRange condition) {
+      if (!pruning()) return;
+      auto& pp = this->pp();
+      auto& sm = pp.getSourceManager();
+      const auto& lang = pp.getLangOpts();
+      auto text = clang::Lexer::getSourceText(
+          clang::CharSourceRange::getCharRange(condition), sm, lang);
+      clang::Lexer lex{
+        condition.getBegin(), lang, text.begin(), text.begin(), text.end()};
+      std::vector<clang::Token> toks;
+      clang::Token tok;
+      while (!lex.LexFromRawLexer(tok)) toks.push_back(tok);
+      if (tok.isNot(clang::tok::eof)) toks.push_back(tok);
+
+      for (size_t i = 0; i < toks.size(); ++i) {
+        if (toks[i].isNot(clang::tok::raw_identifier)) continue;
+        auto* ii = pp.getIdentifierInfo(toks[i].getRawIdentifier());
+        if (ii->isKeyword(lang)) continue;
+        if (ii->getName() == "defined") {
+          // Reported by `Defined()`: skip its operand.
+          while (i + 1 < toks.size() &&
+                 toks[i + 1].isNot(clang::tok::raw_identifier))
+            ++i;
+          ++i;
+          continue;
+        }
+        auto md = pp.getMacroDefinition(ii);
+        depends_on(ii->getName(), md);
+        // Operands of __has_include() and the like aren't macros.
+        auto* mi = md.getMacroInfo();
+        if (mi && mi->isBuiltinMacro() && i + 1 < toks.size() &&
+            toks[i + 1].is(clang::tok::l_paren)) {
+          int depth = 0;
+          for (++i; i < toks.size(); ++i) {
+            if (toks[i].is(clang::tok::l_paren)) ++depth;
+            if (toks[i].is(clang::tok::r_paren) && --depth == 0) break;
+          }
+        }
+      }
+    }
+
+    void If(
+        clang::SourceLocation, clang::SourceRange condition,
+        ConditionValueKind) override {
+      depends_on(condition);
+    }
+    void Elif(
+        clang::SourceLocation, clang::SourceRange condition,
+        ConditionValueKind value, clang::SourceLocation) override {
+      // Not evaluated if an earlier branch was taken, which depends
+      // on the same things wherever the earlier condition does.
+      if (value != CVK_NotEvaluated) depends_on(condition);
+    }
+    void Ifdef(
+        clang::SourceLocation, const clang::Token& name,
+        const clang::MacroDefinition& md) override {
+      depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    void Ifndef(
+        clang::SourceLocation, const clang::Token& name,
+        const clang::MacroDefinition& md) override {
+      depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    using clang::PPCallbacks::Elifdef;
+    void Elifdef(
+        clang::SourceLocation, const clang::Token& name,
+        const clang::MacroDefinition& md) override {
+      depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    using clang::PPCallbacks::Elifndef;
+    void Elifndef(
+        clang::SourceLocation, const clang::Token& name,
+        const clang::MacroDefinition& md) override {
+      depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    void Defined(
+        const clang::Token& name, const clang::MacroDefinition& md,
+        clang::SourceRange) override {
+      depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    void MacroExpands(
+        const clang::Token& name, const clang::MacroDefinition& md,
+        clang::SourceRange, const clang::MacroArgs*) override {
+      if (pp().isParsingIfOrElifDirective())
+        depends_on(name.getIdentifierInfo()->getName(), md);
+    }
+    void MacroDefined(
+        const clang::Token& name, const clang::MacroDirective*) override {
+      defines(name);
+    }
+    void MacroUndefined(
+        const clang::Token& name, const clang::MacroDefinition&,
+        const clang::MacroDirective*) override {
+      defines(name);
+    }
+
+    void FileChanged(
+        clang::SourceLocation loc, FileChangeReason reason,
+        clang::SrcMgr::CharacteristicKind, clang::FileID prev) override {
+      if (!action->memo_ || action->match_) return;
+      auto& sm = pp().getSourceManager();
+      if (reason == EnterFile) {
+        auto file = sm.getFileID(loc);
+        seq_of.emplace(file.getHashValue(), next_seq);
+        stack.push_back({.file = file, .seq = next_seq++});
+        return;
+      }
+      if (reason != ExitFile || !prev.isValid()) return;
+      while (!stack.empty() && stack.back().file != prev) stack.pop_back();
+      if (stack.empty()) return;
+      auto left = std::move(stack.back());
+      stack.pop_back();
+
+      // Its include guard, tested undefined and then defined, is the
+      // exception: a TU defining it beforehand would skip it anyway.
+      auto file = sm.getFileEntryRefForID(prev);
+      if (file) {
+        auto& info = pp().getHeaderSearchInfo().getFileInfo(*file);
+        if (const auto* guard = info.getControllingMacro(nullptr)) {
+          left.undefined.erase(guard->getName().str());
+          left.defined.erase(guard->getName().str());
+        }
+      }
+      // A user header we're leaving was explored in full without
+      // finding the needle, or we'd have stopped lexing.  If what it
+      // did didn't hang on what came before, and nothing after can
+      // hang on what it did, it's dead too.
+      bool clean = file && !left.tainted && left.undefined.empty() &&
+                   left.defined.empty() &&
+                   sm.getFileCharacteristic(sm.getLocForStartOfFile(prev)) ==
+                       clang::SrcMgr::C_User;
+      if (clean) {
+        fs::path raw{std::string{file->getName()}};
+        action->new_clean_headers_.push_back(
+            (action->working_dir_ / raw).lexically_normal().string());
+      }
+      if (!stack.empty()) {
+        stack.back().undefined.merge(left.undefined);
+        stack.back().defined.merge(left.defined);
+      }
     }
   };
 
  public:
-  using dead_set_t = std::unordered_set<std::string>;
-
   find_action(
-      const fs::path& needle, const fs::path& working_dir, bool& match,
-      dead_set_t& dead_files)
+      const fs::path& needle, const compile_command& cmd, size_t index,
+      bool& match, scan_state& state, infer_history& history,
+      std::shared_ptr<pruning_memo> memo)
       : needle_{needle},
-        working_dir_{working_dir},
+        working_dir_{cmd.directory},
+        tu_{cmd.file.string()},
+        index_{index},
         match_{match},
-        dead_files_{dead_files} {}
+        state_{state},
+        history_{history},
+        memo_{std::move(memo)} {}
 
   void ExecuteAction() override {
     auto& ci = getCompilerInstance();
@@ -82,86 +375,469 @@ class find_action : public clang::PreprocessOnlyAction {
 
     // Pre-mark all known-dead system headers as pragma-once so the
     // preprocessor skips them (and their transitive includes) entirely.
-    LOG_TRACE("Marking {} \"dead\" files pragma-once", dead_files_.size());
-    for (const auto& path : dead_files_) {
-      if (auto fe = fm.getOptionalFileRef(path))
-        hs.getFileInfo(*fe).isPragmaOnce = true;
+    {
+      std::shared_lock lk{state_.dead_mutex};
+      LOG_TRACE(
+          "Marking {} \"dead\" files pragma-once", state_.dead_files.size());
+      for (const auto& path : state_.dead_files) {
+        if (auto fe = fm.getOptionalFileRef(path))
+          hs.getFileInfo(*fe).isPragmaOnce = true;
+      }
+    }
+    // Likewise for user headers already explored for this needle, in
+    // this scan or an earlier one, by TUs with the same flags.
+    if (memo_) {
+      std::shared_lock lk{memo_->mutex};
+      LOG_TRACE(
+          "Marking {} clean user headers pragma-once", memo_->clean.size());
+      for (const auto& path : memo_->clean) {
+        if (auto fe = fm.getOptionalFileRef(path))
+          hs.getFileInfo(*fe).isPragmaOnce = true;
+      }
     }
 
     // Do more or less the default lexing action, but exit early if a
-    // match is found.  This will call the callback.
+    // match is found, here or by another worker on an earlier entry.
+    // This will call the callback.
     pp.EnterMainSourceFile();
     clang::Token tok{};
     // NOLINTNEXTLINE(*-do-while)
     do {
       pp.Lex(tok);
-    } while (!match_ && tok.isNot(clang::tok::eof));
+    } while (!match_ && tok.isNot(clang::tok::eof) &&
+             !state_.superseded(index_));
+  }
+
+  void EndSourceFileAction() override {
+    // What this TU includes helps rank candidates for later scans.
+    history_.record_includes(tu_, user_dirs_);
+
+    if (memo_ && !new_clean_headers_.empty()) {
+      std::unique_lock lk{memo_->mutex};
+      for (auto& path : new_clean_headers_)
+        memo_->clean.insert(std::move(path));
+      new_clean_headers_.clear();
+    }
+
+    // Publish newly found dead headers in one go, rather than taking
+    // the exclusive lock once per inclusion directive.
+    if (new_dead_files_.empty()) return;
+    std::unique_lock lk{state_.dead_mutex};
+    for (auto& path : new_dead_files_)
+      state_.dead_files.insert(std::move(path));
+    new_dead_files_.clear();
   }
 
  private:
   const fs::path& needle_;
   const fs::path& working_dir_;
+  std::string tu_;
+  size_t index_;
   bool& match_;
-  dead_set_t& dead_files_;
+  scan_state& state_;
+  infer_history& history_;
+  std::shared_ptr<pruning_memo> memo_;  // null if not pruning
+  std::vector<std::string> new_dead_files_;
+  std::vector<std::string> new_clean_headers_;
+  std::unordered_set<std::string> user_dirs_;
 };
 
+// Preprocess `cmd`, the entry at position `index` in the scan order,
+// looking for `needle`.  Returns true if it includes `needle`.  File
+// managers aren't thread-safe, so each invocation gets its own, but
+// they all sit on top of the project's shared `caching_fs`.
+bool scan_one(
+    const compile_command& cmd, size_t index, const fs::path& needle,
+    scan_state& state, scan_cache& caches) {
+  LOG_DEBUG("OK: Examining entry for '{}'", cmd.file);
+
+  bool match = false;
+  clang::IgnoringDiagConsumer silent{};
+  llvm::IntrusiveRefCntPtr<clang::FileManager> fm{
+    new clang::FileManager{
+      clang::FileSystemOptions{cmd.directory.string()}, caches.fs}};
+  std::shared_ptr<pruning_memo> memo{};
+  if (state.prune) memo = caches.pruning_memo_for(needle.string(), cmd);
+  clang::tooling::ToolInvocation inv{
+    cmd.arguments,
+    std::make_unique<find_action>(
+        needle, cmd, index, match, state, caches.history, std::move(memo)),
+    fm.get()};
+  inv.setDiagnosticConsumer(&silent);
+  inv.run();
+  return match;
+}
+
+// Ask clang's dependency scanner for every file `cmd` includes, adding
+// them to `seen`.  Returns true if `needle` is among them.  Unlike
+// `scan_one()` this can't stop at the needle, but the scanner only
+// lexes directives, and keeps minimized files around for the next TU.
+bool scan_one_deps(
+    const compile_command& cmd, const fs::path& needle,
+    deps::DependencyScanningTool& tool, std::vector<std::string>& seen) {
+  LOG_DEBUG("OK: Dependency-scanning entry for '{}'", cmd.file);
+
+  auto out = tool.getDependencyFile(cmd.arguments, cmd.directory.string());
+  if (!out) {
+    LOG_DEBUG(
+        "Dependency scan of '{}' failed: {}", cmd.file,
+        llvm::toString(out.takeError()));
+    return false;
+  }
+  bool match = false;
+  for (const auto& raw : make_prerequisites(*out)) {
+    auto path = (cmd.directory / raw).lexically_normal();
+    LOG_TRACE("        saw dependency '{}'", path);
+    if (path == needle) match = true;
+    seen.push_back(path.string());
+  }
+  return match;
+}
+
+// Value of option `flag` in `args`, whether separate ("-o x") or
+// joined ("-ox").
+std::optional<std::string> option_value(
+    const std::vector<std::string>& args, std::string_view flag) {
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i] == flag && i + 1 < args.size()) return args[i + 1];
+    if (args[i].size() > flag.size() && args[i].starts_with(flag))
+      return args[i].substr(flag.size());
+  }
+  return std::nullopt;
+}
+
+int64_t ns_since_epoch(llvm::sys::TimePoint<> t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+// Answer from the build system's own dependency data for `cmd`: the
+// entry's `.ninja_deps` log or its `-MD` file.  Returns nullopt if
+// there's none, or it is older than the TU or any file it lists, in
+// which case the caller should preprocess instead.
+std::optional<bool> lookup_build_deps(
+    const compile_command& cmd, const fs::path& needle, scan_cache& caches) {
+  auto& vfs = *caches.fs;
+  auto mtime_of = [&](const std::string& path) -> std::optional<int64_t> {
+    auto st = vfs.status(path);
+    if (!st) return std::nullopt;
+    return ns_since_epoch(st->getLastModificationTime());
+  };
+  auto resolve = [&](const std::string& p) {
+    return (cmd.directory / p).lexically_normal().string();
+  };
+  auto output = option_value(cmd.arguments, "-o");
+
+  std::vector<std::string> deps;
+  int64_t recorded{};
+  if (auto log = caches.ninja_log(cmd.directory); log && output) {
+    if (auto it = log->by_output.find(resolve(*output));
+        it != log->by_output.end()) {
+      recorded = it->second.mtime;
+      for (auto id : it->second.deps) deps.push_back(log->nodes[id]);
+    }
+  }
+  if (deps.empty()) {
+    // -MF names the file, otherwise -MD puts it next to the object.
+    auto depfile = option_value(cmd.arguments, "-MF");
+    if (!depfile && output) depfile = fs::path{*output}.replace_extension(".d");
+    if (!depfile) return std::nullopt;
+    auto path = resolve(*depfile);
+    auto mtime = mtime_of(path);
+    if (!mtime) return std::nullopt;
+    std::ifstream f{path};
+    for (auto& d : make_prerequisites(
+             std::string{std::istreambuf_iterator<char>{f}, {}}))
+      deps.push_back(resolve(d));
+    recorded = *mtime;
+  }
+  if (deps.empty()) return std::nullopt;
+
+  deps.push_back(cmd.file.string());
+  bool match = false;
+  for (const auto& d : deps) {
+    auto mtime = mtime_of(d);
+    if (!mtime || *mtime > recorded) {
+      LOG_DEBUG("Build dependencies of '{}' are stale ('{}')", cmd.file, d);
+      return std::nullopt;
+    }
+    match = match || d == needle.string();
+  }
+  LOG_DEBUG("OK: Used build dependencies of '{}'", cmd.file);
+  return match;
+}
+
+// How alike directories `a` and `b` are: the more leading components
+// they share and the fewer they don't, the higher.
+int proximity(const fs::path& a, const fs::path& b) {
+  auto ai = a.begin();
+  auto bi = b.begin();
+  int common = 0;
+  while (ai != a.end() && bi != b.end() && *ai == *bi) {
+    ++ai;
+    ++bi;
+    ++common;
+  }
+  auto rest = std::distance(ai, a.end()) + std::distance(bi, b.end());
+  return (4 * common) - static_cast<int>(rest);
+}
+
+// Order in which to try entries of `db` for `needle`: likeliest
+// includers first, ties in database order.  Signals, strongest first:
+// the TU that included `needle` last time, a TU named like it
+// ("foo.hpp" and "foo.cpp"), a TU seen including a header from the
+// same directory, and how close the TU is to it in the tree.
+std::vector<size_t> rank_candidates(
+    const ccj_snapshot& db, const fs::path& needle,
+    const infer_history& history) {
+  auto hints = history.hints_for(needle.string());
+  auto dir = needle.parent_path();
+  auto stem = needle.stem();
+
+  std::vector<std::pair<int, size_t>> scored;
+  scored.reserve(db.size());
+  for (size_t i = 0; i < db.size(); ++i) {
+    const auto& file = db.file(i);
+    auto tu = file.string();
+    int score = proximity(file.parent_path(), dir);
+    if (hints.sibling_includers.contains(tu)) score += 100;
+    if (file.stem() == stem) score += 200;
+    if (hints.last_includer == tu) score += 1000;
+    scored.emplace_back(-score, i);
+  }
+  std::ranges::sort(scored);
+
+  std::vector<size_t> order;
+  order.reserve(scored.size());
+  for (const auto& [_, i] : scored) order.push_back(i);
+  return order;
+}
+
+// Entries of `db` including `needle`, in the order they're tried: all
+// those the include index knows of and still holds true for, if any
+// (just the first, if `wanted` is 1), otherwise up to `wanted`
+// found by scanning, stopping shortly after the first.  Records the
+// first one in the history.
+std::vector<size_t> find_includers(
+    project& proj, const ccj_snapshot& db, const fs::path& needle,
+    size_t wanted, const infer_options& opts) {
+  auto& caches = proj.caches();
+  std::vector<size_t> order;
+  if (opts.rank) {
+    order = rank_candidates(db, needle, caches.history);
+  } else {
+    order.resize(db.size());
+    std::iota(order.begin(), order.end(), size_t{0});
+  }
+  auto succeed = [&](std::vector<size_t> res) {
+    if (!res.empty())
+      caches.history.record_match(
+          needle.string(), db.file(res.front()).string());
+    return res;
+  };
+
+  auto& index = proj.index();
+  if (auto includers = index.includers(needle); !includers.empty()) {
+    std::unordered_set<std::string> known;
+    for (const auto& tu : includers) known.insert(tu.string());
+    // The index only catches up with edits at its next refresh, so a
+    // TU changed since may not include the needle anymore.  Take its
+    // word only for those that didn't change, checking just the first
+    // if that's all that's wanted.
+    std::vector<size_t> res;
+    bool stale{};
+    for (auto i : order) {
+      if (!known.contains(db.file(i).string())) continue;
+      if (!index.fresh(db.file(i))) {
+        LOG_DEBUG("Include index is stale for '{}'", db.file(i));
+        stale = true;
+        continue;
+      }
+      res.push_back(i);
+      if (wanted == 1) break;
+    }
+    if (stale) index.refresh_async();
+    if (!res.empty()) {
+      LOG_INFO(
+          "SUCCESS: Include index says '{}' includes '{}'",
+          db.file(res.front()), needle);
+      return succeed(std::move(res));
+    }
+  }
+  LOG_DEBUG(
+      "Include index knows no fresh includer of '{}', scanning", needle);
+
+  unsigned jobs =
+      opts.jobs ? opts.jobs : std::max(1U, std::thread::hardware_concurrency());
+  jobs = static_cast<unsigned>(
+      std::min<size_t>(jobs, std::max<size_t>(db.size(), 1)));
+  LOG_DEBUG("Scanning {} entries with {} workers", db.size(), jobs);
+
+  // Entries are handed out in `order`, so as soon as a worker claims a
+  // position past the last wanted match so far, it and every other
+  // worker can stop: nothing they'd scan next could make the cut.
+  // Workers still busy with earlier positions carry on, which keeps the
+  // result identical to a sequential scan.
+  caches.fs->next_generation();
+  std::shared_ptr<deps::DependencyScanningService> service;
+  if (opts.backend == infer_backend::dependency_scan)
+    service = caches.dependency_service();
+
+  scan_state state{wanted};
+  state.prune = opts.backend != infer_backend::dependency_scan;
+  std::stop_callback on_stop{opts.stop, [&] { state.abort(); }};
+  std::atomic<size_t> scanned{0};
+  const size_t progress_step = std::max<size_t>(order.size() / 100, 1);
+  auto note_scanned = [&] {
+    size_t n = ++scanned;
+    if (opts.on_progress && (n % progress_step == 0 || n == order.size()))
+      opts.on_progress(n, order.size());
+  };
+  std::mutex error_mutex;
+  std::exception_ptr error{};
+  {
+    std::vector<std::jthread> workers;
+    workers.reserve(jobs);
+    for (unsigned w = 0; w < jobs; ++w) {
+      workers.emplace_back([&] {
+        // Dependency scanning tools aren't thread-safe, but share the
+        // service's cache of minimized files.
+        std::optional<deps::DependencyScanningTool> tool;
+        if (service) tool.emplace(*service);
+        std::vector<std::string> seen;
+        for (;;) {
+          size_t pos = state.next.fetch_add(1);
+          if (pos >= order.size() || state.superseded(pos)) break;
+          AUTO(note_scanned());
+          try {
+            const auto& cmd = db.at(order[pos]);
+            if (cmd.arguments.empty()) continue;  // malformed
+            std::optional<bool> known;
+            if (tool)
+              known = scan_one_deps(cmd, needle, *tool, seen);
+            else if (opts.backend == infer_backend::build_deps)
+              known = lookup_build_deps(cmd, needle, caches);
+            bool match =
+                known ? *known : scan_one(cmd, pos, needle, state, caches);
+            if (match) state.report_match(pos);
+          } catch (...) {
+            std::lock_guard lk{error_mutex};
+            if (!error) error = std::current_exception();
+            state.abort();
+            return;
+          }
+        }
+        if (!seen.empty()) caches.note_dependencies(seen);
+      });
+    }
+  }
+  if (error) std::rethrow_exception(error);
+  if (opts.stop.stop_requested())
+    LOG_INFO("Scan for includers of '{}' stopped early", needle);
+
+  auto counters = caches.fs->stats();
+  LOG_DEBUG(
+      "File cache: {} hits, {} misses so far", counters.hits, counters.misses);
+  if (!state.found.empty())
+    LOG_DEBUG(
+        "Includer found at position {} of {} in scan order",
+        state.found.front(), order.size());
+
+  std::vector<size_t> res;
+  for (auto pos : state.found) res.push_back(order[pos]);
+  return succeed(std::move(res));
+}
+
+// Rough compile time to expect from a TU reading `bytes` of source,
+// when there's nothing better to go by.
+constexpr double k_default_ms_per_byte = 1e-3;
+
 }  // namespace
 
 std::optional<compile_command> infer(
-    const fs::path& compile_commands_path, const fs::path& source_file) {
+    project& proj, const fs::path& source_file, const infer_options& opts) {
   LOG_INFO(
-      "Searching TU's including '{}' in '{}'", source_file,
-      compile_commands_path);
+      "Searching TU's including '{}' in '{}'", source_file, proj.ccj_path());
+
+  auto db = proj.database();
+  fs::path needle = fs::absolute(source_file).lexically_normal();
+
+  // Translation units are looked up directly.  PPCallbacks wouldn't
+  // fire for them anyway.
+  if (auto i = db->find(needle)) {
+    LOG_INFO("SUCCESS: '{}' has its own entry", source_file);
+    return db->at(*i);
+  }
+
+  auto found = find_includers(proj, *db, needle, 1, opts);
+  if (found.empty()) return std::nullopt;
 
-  std::string err;
-  auto db = clang::tooling::JSONCompilationDatabase::loadFromFile(
-      fs::absolute(compile_commands_path).string(), err,
-      clang::tooling::JSONCommandLineSyntax::AutoDetect);
-  if (!db) utils::throwf("Can't load {}: {}", compile_commands_path, err);
+  const auto& cmd = db->at(found.front());
+  LOG_INFO("SUCCESS: Found '{}', TU includer of '{}'", cmd.file, source_file);
+  LOG_INFO("SUCCESS: Using compilation command '{}'", cmd.command);
+  return cmd;
+}
+
+std::vector<includer> infer_all(
+    project& proj, const fs::path& source_file, size_t max,
+    const infer_options& opts) {
+  LOG_INFO(
+      "Searching up to {} TU's including '{}' in '{}'", max, source_file,
+      proj.ccj_path());
 
+  auto db = proj.database();
   fs::path needle = fs::absolute(source_file).lexically_normal();
+  if (max == 0) return {};
+  if (auto i = db->find(needle)) return {includer{.command = db->at(*i)}};
 
-  clang::IgnoringDiagConsumer silent{};
-  find_action::dead_set_t dead_files{};
-  for (auto& cmd : db->getAllCompileCommands()) {
-    LOG_DEBUG("OK: Examining entry for '{}'", cmd.Filename);
-
-    fs::path working_dir = fs::absolute(cmd.Directory).lexically_normal();
-    fs::path tu_file =
-        (working_dir / fs::path{cmd.Filename}).lexically_normal();
-
-    // PPCallbacks::InclusionDirective doesn't fire for the TU itself, so
-    // handle that case directly before invoking the preprocessor.
-    bool match = (tu_file == needle);
-
-    if (!match) {
-      llvm::IntrusiveRefCntPtr<clang::FileManager> fm{
-        new clang::FileManager{clang::FileSystemOptions{cmd.Directory}}};
-      clang::tooling::ToolInvocation inv{
-        cmd.CommandLine,
-        std::make_unique<find_action>(needle, working_dir, match, dead_files),
-        fm.get()};
-      inv.setDiagnosticConsumer(&silent);
-      inv.run();
-    }
-
-    if (match) {
-      fs::path file = fs::absolute(fs::path{cmd.Directory} / cmd.Filename)
-                          .lexically_normal();
-      std::string command;
-      for (const auto& arg : cmd.CommandLine) {
-        if (!command.empty()) command += ' ';
-        command += arg;
-      }
-      LOG_INFO(
-          "SUCCESS: Found '{}', TU includer of '{}'", cmd.Filename,
-          source_file);
-      LOG_INFO("SUCCESS: Using compilation command '{}'", command);
-      return compile_command{
-        .directory = working_dir, .command = command, .file = file};
-    }
+  auto& vfs = *proj.caches().fs;
+  auto size_of = [&](const fs::path& file) -> uint64_t {
+    auto st = vfs.status(file.string());
+    return st ? st->getSize() : 0;
+  };
+
+  std::vector<includer> res;
+  for (auto i : find_includers(proj, *db, needle, max, opts)) {
+    includer inc{.command = db->at(i)};
+    auto files = proj.index().included_files(inc.command.file);
+    if (files.empty()) files.push_back(inc.command.file);
+    for (const auto& f : files) inc.source_bytes += size_of(f);
+    inc.compile_time = proj.compile_time(inc.command.file);
+    res.push_back(std::move(inc));
   }
-  return std::nullopt;
+
+  // Calibrate bytes to milliseconds on the TUs that have both.
+  double ms = 0;
+  double bytes = 0;
+  for (const auto& inc : res) {
+    if (!inc.compile_time || inc.source_bytes == 0) continue;
+    ms += static_cast<double>(inc.compile_time->count());
+    bytes += static_cast<double>(inc.source_bytes);
+  }
+  double ms_per_byte = bytes > 0 ? ms / bytes : k_default_ms_per_byte;
+  for (auto& inc : res) {
+    inc.estimated_cost =
+        inc.compile_time ? *inc.compile_time
+                         : std::chrono::milliseconds{static_cast<long long>(
+                               static_cast<double>(inc.source_bytes) *
+                               ms_per_byte)};
+  }
+  std::ranges::stable_sort(res, {}, &includer::estimated_cost);
+  if (res.size() > max) res.resize(max);
+
+  for (const auto& inc : res)
+    LOG_DEBUG(
+        "Includer '{}': {} bytes, ~{} ms", inc.command.file, inc.source_bytes,
+        inc.estimated_cost.count());
+  return res;
+}
+
+std::optional<compile_command> infer(
+    const fs::path& compile_commands_path, const fs::path& source_file,
+    const infer_options& opts) {
+  project proj{compile_commands_path};
+  return infer(proj, source_file, opts);
 }
 
 }  // namespace xpto::blot
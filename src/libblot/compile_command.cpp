@@ -0,0 +1,23 @@
+#include "blot/compile_command.hpp"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/StringSaver.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace xpto::blot {
+
+std::vector<std::string> tokenize_command(std::string_view command) {
+  llvm::BumpPtrAllocator alloc;
+  llvm::StringSaver saver{alloc};
+  llvm::SmallVector<const char*, 64> argv;
+  llvm::cl::TokenizeGNUCommandLine(
+      llvm::StringRef{command.data(), command.size()}, saver, argv);
+  return {argv.begin(), argv.end()};
+}
+
+}  // namespace xpto::blot
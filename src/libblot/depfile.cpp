@@ -0,0 +1,130 @@
+#include "depfile.hpp"
+
+#include <fmt/std.h>
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "logger.hpp"
+
+namespace xpto::blot {
+
+std::vector<std::string> make_prerequisites(std::string_view text) {
+  std::vector<std::string> res;
+  std::string tok;
+  bool in_prerequisites = false;
+
+  auto flush = [&] {
+    if (tok.empty()) return;
+    if (in_prerequisites) {
+      res.push_back(std::move(tok));
+    } else if (tok.back() == ':') {
+      // "target:" or a lone ":", the rest of the rule is prerequisites.
+      in_prerequisites = true;
+    }
+    tok.clear();
+  };
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    char next = i + 1 < text.size() ? text[i + 1] : '\0';
+    if (c == '\\' && next == '\n') {
+      flush();
+      ++i;
+    } else if (c == '\\' && next == '\r' && i + 2 < text.size() &&
+               text[i + 2] == '\n') {
+      flush();
+      i += 2;
+    } else if (c == '\\' && (next == ' ' || next == '#')) {
+      tok += next;
+      ++i;
+    } else if (c == '$' && next == '$') {
+      tok += '$';
+      ++i;
+    } else if (c == '\n') {
+      flush();
+      in_prerequisites = false;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      flush();
+    } else {
+      tok += c;
+    }
+  }
+  flush();
+  return res;
+}
+
+std::shared_ptr<const ninja_deps> read_ninja_deps(const fs::path& path) {
+  std::ifstream f{path, std::ios::binary};
+  if (!f) return nullptr;
+  std::string data{std::istreambuf_iterator<char>{f}, {}};
+
+  // See ninja's deps_log.cc.  After the signature and version, a
+  // sequence of records, each prefixed by a 32-bit size whose high bit
+  // tells deps records from path records.  Everything is native
+  // endian, which we assume is ours.
+  static constexpr std::string_view k_signature = "# ninjadeps\n";
+  static constexpr uint32_t k_version = 4;
+  if (!std::string_view{data}.starts_with(k_signature)) {
+    LOG_DEBUG("{} isn't a ninja deps log", path);
+    return nullptr;
+  }
+  size_t pos = k_signature.size();
+  auto read_u32 = [&](size_t at) {
+    uint32_t v{};
+    std::memcpy(&v, data.data() + at, sizeof v);
+    return v;
+  };
+  if (pos + 4 > data.size() || read_u32(pos) != k_version) {
+    LOG_DEBUG("{} has an unsupported ninja deps log version", path);
+    return nullptr;
+  }
+  pos += 4;
+
+  auto res = std::make_shared<ninja_deps>();
+  auto base = path.parent_path();
+  std::unordered_map<uint32_t, ninja_deps::record> by_id;
+  while (pos + 4 <= data.size()) {
+    uint32_t head = read_u32(pos);
+    bool is_deps = (head & 0x80000000U) != 0;
+    uint32_t size = head & 0x7FFFFFFFU;
+    pos += 4;
+    if (size % 4 != 0 || pos + size > data.size()) break;
+
+    if (is_deps) {
+      if (size < 12) break;
+      uint32_t out = read_u32(pos);
+      uint64_t lo = read_u32(pos + 4);
+      uint64_t hi = read_u32(pos + 8);
+      ninja_deps::record rec{static_cast<int64_t>(hi << 32 | lo), {}};
+      bool valid = out < res->nodes.size();
+      for (size_t at = pos + 12; at < pos + size; at += 4) {
+        rec.deps.push_back(read_u32(at));
+        valid = valid && rec.deps.back() < res->nodes.size();
+      }
+      if (!valid) break;
+      // Later records supersede earlier ones for the same output.
+      by_id.insert_or_assign(out, std::move(rec));
+    } else {
+      if (size < 4) break;
+      std::string_view name{data.data() + pos, size - 4};
+      while (name.ends_with('\0')) name.remove_suffix(1);
+      // The checksum is the one's complement of the node's id.
+      auto id = static_cast<uint32_t>(res->nodes.size());
+      if (read_u32(pos + size - 4) != ~id) break;
+      res->nodes.push_back((base / name).lexically_normal().string());
+    }
+    pos += size;
+  }
+  if (pos != data.size())
+    LOG_DEBUG("Ignoring corrupt tail of {} at offset {}", path, pos);
+
+  for (auto& [id, rec] : by_id)
+    res->by_output.emplace(res->nodes[id], std::move(rec));
+  LOG_DEBUG(
+      "Read dependencies of {} outputs from {}", res->by_output.size(), path);
+  return res;
+}
+
+}  // namespace xpto::blot
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+// Prerequisites of every rule in Make-syntax dependency output, like
+// what `-MD`/`-MF` or clang's dependency scanner produce.  Targets are
+// dropped.  Undoes Make escaping: backslash-newline continuations,
+// "\ " and "\#", and "$$".  Paths are returned as written, possibly
+// relative to the compiler's working directory.
+std::vector<std::string> make_prerequisites(std::string_view text);
+
+// Contents of a ninja `.ninja_deps` log: the headers each output
+// depended on when it was last built.
+struct ninja_deps {
+  struct record {
+    int64_t mtime;  // of the output when recorded, ns since the epoch
+    std::vector<uint32_t> deps;  // indices into `nodes`
+  };
+  std::vector<std::string> nodes;  // absolute, lexically normal paths
+  std::unordered_map<std::string, record> by_output;  // keyed like `nodes`
+};
+
+// Read the ninja deps log at `path`, resolving its relative paths
+// against the directory it's in.  Only format version 4 (ninja 1.10
+// and later) is understood.  Returns null if the log is missing or in
+// another format.  A truncated or corrupt tail is ignored, as ninja
+// itself does.
+std::shared_ptr<const ninja_deps> read_ninja_deps(const fs::path& path);
+
+}  // namespace xpto::blot
@@ -0,0 +1,420 @@
+#include "blot/include_index.hpp"
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/FileSystemOptions.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Tooling/Tooling.h>
+#include <fmt/std.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/json.hpp>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "blot/project.hpp"
+#include "logger.hpp"
+#include "scan_cache.hpp"
+#include "utils.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+namespace json = boost::json;
+
+namespace {
+
+using clock_t = std::chrono::steady_clock;
+using file_id = uint32_t;
+
+// Bump whenever the on-disk layout changes; older files are ignored.
+constexpr int64_t k_format_version = 1;
+
+// Don't start a background refresh sooner than this after the last.
+constexpr auto k_min_refresh_interval = std::chrono::seconds{5};
+
+// Modification time as a plain integer, or -1 if `path` can't be stat'ed.
+int64_t mtime_of(const std::string& path) {
+  std::error_code ec;
+  auto t = fs::last_write_time(path, ec);
+  return ec ? -1 : static_cast<int64_t>(t.time_since_epoch().count());
+}
+
+// Preprocess a whole TU, recording every file it includes.
+class collect_action : public clang::PreprocessOnlyAction {
+  struct collector : clang::PPCallbacks {
+    collect_action* action;
+    collector(collect_action* a) : action{a} {}
+
+    void InclusionDirective(
+        clang::SourceLocation, const clang::Token&, llvm::StringRef, bool,
+        clang::CharSourceRange, clang::OptionalFileEntryRef file,
+        llvm::StringRef, llvm::StringRef, const clang::Module*, bool,
+        clang::SrcMgr::CharacteristicKind) override {
+      if (!file) return;
+      fs::path raw{std::string{file->getName()}};
+      action->seen_.insert(
+          (action->working_dir_ / raw).lexically_normal().string());
+    }
+  };
+
+ public:
+  collect_action(
+      const fs::path& working_dir, std::unordered_set<std::string>& seen)
+      : working_dir_{working_dir}, seen_{seen} {}
+
+  void ExecuteAction() override {
+    getCompilerInstance().getPreprocessor().addPPCallbacks(
+        std::make_unique<collector>(this));
+    clang::PreprocessOnlyAction::ExecuteAction();
+  }
+
+ private:
+  const fs::path& working_dir_;
+  std::unordered_set<std::string>& seen_;
+};
+
+struct scan_job {
+  const compile_command* cmd;
+  std::string tu;
+  std::string command;
+};
+
+struct scan_result {
+  std::string tu;
+  std::string command;
+  std::vector<std::string> includes;
+};
+
+scan_result scan_tu(
+    const scan_job& job, llvm::IntrusiveRefCntPtr<caching_fs> vfs) {
+  LOG_DEBUG("include index: scanning '{}'", job.tu);
+  const fs::path& working_dir = job.cmd->directory;
+  std::unordered_set<std::string> seen{job.tu};
+
+  clang::IgnoringDiagConsumer silent{};
+  llvm::IntrusiveRefCntPtr<clang::FileManager> fm{new clang::FileManager{
+    clang::FileSystemOptions{job.cmd->directory.string()}, std::move(vfs)}};
+  clang::tooling::ToolInvocation inv{
+    job.cmd->arguments, std::make_unique<collect_action>(working_dir, seen),
+    fm.get()};
+  inv.setDiagnosticConsumer(&silent);
+  inv.run();
+
+  return {job.tu, job.command, {seen.begin(), seen.end()}};
+}
+
+}  // namespace
+
+struct include_index::impl {
+  struct tu_record {
+    std::string command;
+    std::vector<file_id> includes;
+  };
+
+  project& proj;
+
+  // Graph proper, guarded by `mutex`.
+  mutable std::shared_mutex mutex;
+  std::vector<std::string> files;
+  std::vector<int64_t> mtimes;
+  std::unordered_map<std::string, file_id> ids;
+  std::unordered_map<std::string, tu_record> tus;
+  std::unordered_map<std::string, size_t> position;  // TU -> database order
+  std::unordered_map<file_id, std::vector<std::string>> reverse;
+  bool loaded{};
+  bool complete{};
+
+  // Refreshes are serialized, and at most one runs in the background.
+  std::mutex refresh_mutex;
+  std::atomic<bool> busy{false};
+  std::atomic<clock_t::rep> last_refresh{0};
+  std::jthread worker;
+
+  explicit impl(project& p) : proj{p} {}
+
+  [[nodiscard]] fs::path storage_path() const {
+    return fs::absolute(proj.ccj_path()).parent_path() /
+           ".blot-include-index.json";
+  }
+
+  // Rebuild `reverse` from `tus`.  Caller holds `mutex` exclusively.
+  void rebuild_reverse() {
+    reverse.clear();
+    for (const auto& [tu, rec] : tus)
+      for (auto id : rec.includes) reverse[id].push_back(tu);
+  }
+
+  void load() {
+    std::ifstream f{storage_path()};
+    if (!f) return;
+    std::error_code ec;
+    auto val = json::parse(
+        std::string{std::istreambuf_iterator<char>{f}, {}}, ec);
+    auto* obj = ec ? nullptr : val.if_object();
+    auto* version = obj ? obj->if_contains("version") : nullptr;
+    if (!version || !version->is_int64() ||
+        version->get_int64() != k_format_version) {
+      LOG_WARN("Ignoring unusable include index {}", storage_path());
+      return;
+    }
+    try {
+      for (const auto& entry : obj->at("files").as_array()) {
+        const auto& pair = entry.as_array();
+        ids.emplace(std::string{pair.at(0).as_string()}, files.size());
+        files.emplace_back(pair.at(0).as_string());
+        mtimes.push_back(pair.at(1).as_int64());
+      }
+      for (const auto& entry : obj->at("tus").as_array()) {
+        const auto& tu = entry.as_object();
+        tu_record rec{.command = std::string{tu.at("command").as_string()}};
+        for (const auto& id : tu.at("includes").as_array()) {
+          if (id.as_int64() < 0 ||
+              std::cmp_greater_equal(id.as_int64(), files.size()))
+            utils::throwf("file id {} out of range", id.as_int64());
+          rec.includes.push_back(static_cast<file_id>(id.as_int64()));
+        }
+        tus.emplace(std::string{tu.at("file").as_string()}, std::move(rec));
+      }
+    } catch (std::exception& e) {
+      LOG_WARN(
+          "Ignoring corrupt include index {}: {}", storage_path(), e.what());
+      files.clear();
+      mtimes.clear();
+      ids.clear();
+      tus.clear();
+      return;
+    }
+    rebuild_reverse();
+    LOG_INFO(
+        "Loaded include index with {} TUs from {}", tus.size(),
+        storage_path());
+  }
+
+  // Caller holds `mutex`, shared at least.
+  void save() const {
+    json::array jfiles;
+    jfiles.reserve(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+      jfiles.push_back(json::array{files[i], mtimes[i]});
+    json::array jtus;
+    jtus.reserve(tus.size());
+    for (const auto& [tu, rec] : tus) {
+      json::object jtu;
+      jtu["file"] = tu;
+      jtu["command"] = rec.command;
+      jtu["includes"] = json::array(rec.includes.begin(), rec.includes.end());
+      jtus.push_back(std::move(jtu));
+    }
+    json::object obj;
+    obj["version"] = k_format_version;
+    obj["files"] = std::move(jfiles);
+    obj["tus"] = std::move(jtus);
+
+    // Write aside and rename, so readers never see a partial file.
+    auto dest = storage_path();
+    auto tmp = fs::path{dest} += ".tmp";
+    {
+      std::ofstream f{tmp};
+      f << json::serialize(obj);
+      if (!f) {
+        LOG_WARN("Can't write include index {}", tmp);
+        return;
+      }
+    }
+    std::error_code ec;
+    fs::rename(tmp, dest, ec);
+    if (ec) LOG_WARN("Can't write include index {}: {}", dest, ec.message());
+  }
+
+  void refresh(const std::stop_token& stop) {
+    std::lock_guard refresh_lk{refresh_mutex};
+    {
+      std::unique_lock lk{mutex};
+      if (!loaded) {
+        load();
+        loaded = true;
+      }
+    }
+
+    auto db = proj.database();
+
+    // Stat every known file once, then find what needs rescanning.
+    std::vector<int64_t> now;
+    std::vector<scan_job> jobs;
+    std::unordered_map<std::string, size_t> new_position;
+    {
+      std::shared_lock lk{mutex};
+      now.reserve(files.size());
+      for (const auto& f : files) now.push_back(mtime_of(f));
+      for (size_t i = 0; i < db->size(); ++i) {
+        const auto& cmd = db->at(i);
+        auto tu = cmd.file.string();
+        if (cmd.arguments.empty()) continue;  // malformed
+        new_position.emplace(tu, new_position.size());
+        const auto& command = cmd.command;
+        auto it = tus.find(tu);
+        bool stale = it == tus.end() || it->second.command != command ||
+                     std::ranges::any_of(it->second.includes, [&](file_id id) {
+                       return now[id] != mtimes[id];
+                     });
+        if (stale) jobs.push_back({&cmd, std::move(tu), command});
+      }
+    }
+    LOG_INFO(
+        "Include index: {} of {} TUs need scanning", jobs.size(), db->size());
+
+    // Scan in parallel, like infer() does, sharing its file cache.
+    auto& caches = proj.caches();
+    if (!jobs.empty()) caches.fs->next_generation();
+    std::vector<scan_result> results;
+    std::mutex results_mutex;
+    std::atomic<size_t> next{0};
+    {
+      unsigned n = std::max(1U, std::thread::hardware_concurrency());
+      std::vector<std::jthread> workers;
+      for (unsigned w = 0; w < n && w < jobs.size(); ++w) {
+        workers.emplace_back([&] {
+          while (!stop.stop_requested()) {
+            size_t i = next.fetch_add(1);
+            if (i >= jobs.size()) return;
+            auto res = scan_tu(jobs[i], caches.fs);
+            std::lock_guard lk{results_mutex};
+            results.push_back(std::move(res));
+          }
+        });
+      }
+    }
+
+    // Fold the results in, compacting the file table as we go.
+    std::unique_lock lk{mutex};
+    std::vector<std::string> new_files;
+    std::vector<int64_t> new_mtimes;
+    std::unordered_map<std::string, file_id> new_ids;
+    auto intern = [&](const std::string& path, int64_t mtime) {
+      auto [it, fresh] = new_ids.emplace(path, new_files.size());
+      if (fresh) {
+        new_files.push_back(path);
+        new_mtimes.push_back(mtime);
+      }
+      return it->second;
+    };
+    std::unordered_map<std::string, tu_record> new_tus;
+    for (auto& res : results) {
+      tu_record rec{.command = std::move(res.command)};
+      for (const auto& inc : res.includes) {
+        auto old = ids.find(inc);
+        rec.includes.push_back(intern(
+            inc, old != ids.end() ? now[old->second] : mtime_of(inc)));
+      }
+      new_tus.emplace(std::move(res.tu), std::move(rec));
+    }
+    // Keep up-to-date records of TUs still in the database.  Stale ones
+    // whose rescan was interrupted are dropped, to be redone next time.
+    std::unordered_set<std::string> rescanned;
+    for (const auto& job : jobs) rescanned.insert(job.tu);
+    for (auto& [tu, rec] : tus) {
+      if (!new_position.contains(tu) || rescanned.contains(tu)) continue;
+      tu_record kept{.command = std::move(rec.command)};
+      for (auto id : rec.includes)
+        kept.includes.push_back(intern(files[id], now[id]));
+      new_tus.emplace(tu, std::move(kept));
+    }
+
+    files = std::move(new_files);
+    mtimes = std::move(new_mtimes);
+    ids = std::move(new_ids);
+    tus = std::move(new_tus);
+    position = std::move(new_position);
+    complete = tus.size() == position.size();
+    rebuild_reverse();
+    if (!jobs.empty()) save();
+    last_refresh = clock_t::now().time_since_epoch().count();
+    LOG_INFO("Include index: {} TUs, {} files", tus.size(), files.size());
+  }
+};
+
+include_index::include_index(project& proj)
+    : impl_{std::make_unique<impl>(proj)} {}
+
+include_index::~include_index() = default;
+
+fs::path include_index::storage_path() const { return impl_->storage_path(); }
+
+void include_index::refresh() { impl_->refresh(std::stop_token{}); }
+
+void include_index::refresh_async() {
+  auto since = clock_t::now() - clock_t::time_point{clock_t::duration{
+                                    impl_->last_refresh.load()}};
+  if (since < k_min_refresh_interval) return;
+  if (impl_->busy.exchange(true)) return;
+  // Assigning joins the previous, already finished, worker.
+  impl_->worker = std::jthread{[this](const std::stop_token& stop) {
+    try {
+      impl_->refresh(stop);
+    } catch (std::exception& e) {
+      LOG_WARN("Include index refresh failed: {}", e.what());
+    }
+    impl_->busy = false;
+  }};
+}
+
+std::vector<fs::path> include_index::includers(const fs::path& file) const {
+  auto needle = fs::absolute(file).lexically_normal().string();
+  std::shared_lock lk{impl_->mutex};
+  auto id = impl_->ids.find(needle);
+  if (id == impl_->ids.end()) return {};
+  auto it = impl_->reverse.find(id->second);
+  if (it == impl_->reverse.end()) return {};
+
+  auto tus = it->second;
+  auto pos = [&](const std::string& tu) {
+    auto p = impl_->position.find(tu);
+    return p == impl_->position.end() ? impl_->position.size() : p->second;
+  };
+  std::ranges::sort(tus, {}, pos);
+  return {tus.begin(), tus.end()};
+}
+
+std::vector<fs::path> include_index::included_files(const fs::path& tu) const {
+  auto key = fs::absolute(tu).lexically_normal().string();
+  std::shared_lock lk{impl_->mutex};
+  auto it = impl_->tus.find(key);
+  if (it == impl_->tus.end()) return {};
+  std::vector<fs::path> res;
+  res.reserve(it->second.includes.size());
+  for (auto id : it->second.includes) res.emplace_back(impl_->files[id]);
+  return res;
+}
+
+bool include_index::fresh(const fs::path& tu) const {
+  auto key = fs::absolute(tu).lexically_normal().string();
+  std::shared_lock lk{impl_->mutex};
+  auto it = impl_->tus.find(key);
+  if (it == impl_->tus.end()) return false;
+  return std::ranges::all_of(it->second.includes, [&](file_id id) {
+    return mtime_of(impl_->files[id]) == impl_->mtimes[id];
+  });
+}
+
+bool include_index::complete() const {
+  std::shared_lock lk{impl_->mutex};
+  return impl_->complete;
+}
+
+}  // namespace xpto::blot
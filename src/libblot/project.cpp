@@ -0,0 +1,316 @@
+#include "blot/project.hpp"
+
+#include <fmt/std.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <array>
+#include <boost/json.hpp>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "blot/include_index.hpp"
+#include "logger.hpp"
+#include "scan_cache.hpp"
+#include "utils.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+namespace json = boost::json;
+
+namespace {
+
+// Drop a leading compiler cache wrapper, like clang's own database
+// loader does, so that the compiler proper comes first.
+void unwrap_launcher(std::vector<std::string>& args) {
+  static constexpr std::array k_launchers{
+    std::string_view{"ccache"}, std::string_view{"sccache"},
+    std::string_view{"distcc"}};
+  if (args.size() < 2 || args[1].starts_with('-')) return;
+  auto name = fs::path{args[0]}.filename().string();
+  if (std::ranges::find(k_launchers, name) != k_launchers.end())
+    args.erase(args.begin());
+}
+
+fs::path absolute_dir(const fs::path& base, const std::string& dir) {
+  auto res = (base / dir).lexically_normal();
+  // "/a/b/." normalizes to "/a/b/"; drop the trailing separator.
+  if (!res.has_filename() && res.has_parent_path()) res = res.parent_path();
+  return res;
+}
+
+// Quick, allocation-free pass over a JSON document that is expected to
+// be an array of objects, yielding each object's extent and the raw
+// (still quoted and escaped) values of a few of its string members.
+// Doesn't validate anything it doesn't need to: malformed entries are
+// caught when parsed for real.
+class ccj_skimmer {
+ public:
+  explicit ccj_skimmer(std::string_view text) : text_{text} {}
+
+  struct entry {
+    size_t begin;
+    size_t end;
+    std::string_view directory;
+    std::string_view file;
+  };
+
+  // Enter the top-level array.  False if the document isn't one.
+  bool start() {
+    skip_ws();
+    if (pos_ >= text_.size() || text_[pos_] != '[') return false;
+    ++pos_;
+    return true;
+  }
+
+  // Next top-level object, or nullopt at the end.  Throws if the
+  // document isn't shaped as expected.
+  std::optional<entry> next() {
+    skip_ws();
+    if (pos_ < text_.size() && text_[pos_] == ',') ++pos_;
+    skip_ws();
+    if (pos_ >= text_.size()) utils::throwf("unterminated array");
+    if (text_[pos_] == ']') return std::nullopt;
+    if (text_[pos_] != '{')
+      utils::throwf("expected an object at offset {}", pos_);
+
+    entry e{pos_, 0, {}, {}};
+    ++pos_;
+    for (;;) {
+      skip_ws();
+      if (pos_ >= text_.size()) utils::throwf("unterminated object");
+      char c = text_[pos_];
+      if (c == '}') break;
+      if (c == ',') {
+        ++pos_;
+        continue;
+      }
+      auto key = string();
+      skip_ws();
+      if (pos_ >= text_.size() || text_[pos_] != ':')
+        utils::throwf("expected ':' at offset {}", pos_);
+      ++pos_;
+      skip_ws();
+      auto vbegin = pos_;
+      value();
+      auto raw = text_.substr(vbegin, pos_ - vbegin);
+      if (key == "\"directory\"") e.directory = raw;
+      if (key == "\"file\"") e.file = raw;
+    }
+    e.end = ++pos_;
+    return e;
+  }
+
+ private:
+  void skip_ws() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\n' || text_[pos_] == '\t' ||
+            text_[pos_] == '\r'))
+      ++pos_;
+  }
+
+  // A string, returned quotes and all.
+  std::string_view string() {
+    if (pos_ >= text_.size() || text_[pos_] != '"')
+      utils::throwf("expected a string at offset {}", pos_);
+    auto begin = pos_++;
+    for (;;) {
+      auto q = text_.find_first_of("\"\\", pos_);
+      if (q == std::string_view::npos) utils::throwf("unterminated string");
+      if (text_[q] == '"') {
+        pos_ = q + 1;
+        return text_.substr(begin, pos_ - begin);
+      }
+      pos_ = q + 2;  // skip the escaped character
+    }
+  }
+
+  // Any value, skipped over.
+  void value() {
+    if (pos_ >= text_.size()) utils::throwf("unexpected end");
+    if (text_[pos_] == '"') {
+      string();
+      return;
+    }
+    if (text_[pos_] != '{' && text_[pos_] != '[') {
+      // Number, true, false or null.
+      while (pos_ < text_.size() && text_[pos_] != ',' && text_[pos_] != '}' &&
+             text_[pos_] != ']')
+        ++pos_;
+      while (pos_ > 0 && (text_[pos_ - 1] == ' ' || text_[pos_ - 1] == '\n' ||
+                          text_[pos_ - 1] == '\t' || text_[pos_ - 1] == '\r'))
+        --pos_;
+      return;
+    }
+    int depth = 0;
+    while (pos_ < text_.size()) {
+      char c = text_[pos_];
+      if (c == '"') {
+        string();
+        continue;
+      }
+      ++pos_;
+      if (c == '{' || c == '[') ++depth;
+      if ((c == '}' || c == ']') && --depth == 0) return;
+    }
+    utils::throwf("unexpected end");
+  }
+
+  std::string_view text_;
+  size_t pos_{};
+};
+
+// Decode a raw JSON string value as found by the skimmer.
+std::string unquote(std::string_view raw) {
+  if (raw.size() < 2 || raw.front() != '"') return {};
+  if (raw.find('\\') == std::string_view::npos)
+    return std::string{raw.substr(1, raw.size() - 2)};
+  auto val = json::parse(raw);
+  return std::string{val.as_string()};
+}
+
+}  // namespace
+
+struct ccj_snapshot::impl {
+  struct slot {
+    std::once_flag once;
+    std::unique_ptr<compile_command> cmd;
+  };
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  std::vector<std::pair<size_t, size_t>> spans;  // of each entry's object
+  std::unique_ptr<slot[]> slots;
+  fs::path path;
+};
+
+ccj_snapshot::ccj_snapshot(const fs::path& compile_commands_path)
+    : impl_{std::make_unique<impl>()} {
+  auto path = fs::absolute(compile_commands_path);
+  mtime_ = fs::last_write_time(path);
+  impl_->path = path;
+
+  // Read, not mapped: entries are parsed from it long after, and
+  // tools like `bear` rewrite the file in place, truncating a mapping.
+  auto buf = llvm::MemoryBuffer::getFile(
+      path.string(), /*IsText=*/false, /*RequiresNullTerminator=*/false,
+      /*IsVolatile=*/true);
+  if (!buf) utils::throwf("Can't read {}: {}", path, buf.getError().message());
+  impl_->buffer = std::move(*buf);
+  std::string_view text{
+    impl_->buffer->getBufferStart(), impl_->buffer->getBufferSize()};
+
+  ccj_skimmer skim{text};
+  if (!skim.start()) utils::throwf("{} isn't a JSON array", path);
+  auto base = path.parent_path();
+  size_t seen = 0;
+  try {
+    while (auto e = skim.next()) {
+      ++seen;
+      if (e->directory.empty() || e->file.empty()) {
+        LOG_WARN(
+            "Skipping entry #{} of {}: no \"directory\" or \"file\"",
+            seen - 1, path);
+        continue;
+      }
+      auto dir = absolute_dir(base, unquote(e->directory));
+      files_.push_back((dir / unquote(e->file)).lexically_normal());
+      directories_.push_back(std::move(dir));
+      impl_->spans.emplace_back(e->begin, e->end);
+    }
+  } catch (std::exception& e) {
+    utils::throwf("Can't parse {}: {}", path, e.what());
+  }
+
+  impl_->slots = std::make_unique<impl::slot[]>(files_.size());
+  by_file_.reserve(files_.size());
+  // Views into files_, which doesn't change from here on.
+  for (size_t i = 0; i < files_.size(); ++i)
+    by_file_.emplace(files_[i].native(), i);
+  LOG_INFO("Indexed {} entries of {}", files_.size(), path);
+}
+
+ccj_snapshot::~ccj_snapshot() = default;
+
+const compile_command& ccj_snapshot::at(size_t i) const {
+  if (i >= files_.size())
+    utils::throwf<std::out_of_range>("No entry #{} in {}", i, impl_->path);
+  auto& slot = impl_->slots[i];
+  std::call_once(slot.once, [&] {
+    auto cmd = std::make_unique<compile_command>();
+    cmd->directory = directories_[i];
+    cmd->file = files_[i];
+    auto [begin, end] = impl_->spans[i];
+    try {
+      auto val = json::parse(std::string_view{
+        impl_->buffer->getBufferStart() + begin, end - begin});
+      const auto& obj = val.as_object();
+      if (auto* args = obj.if_contains("arguments")) {
+        for (const auto& a : args->as_array()) {
+          cmd->arguments.emplace_back(a.as_string());
+          if (!cmd->command.empty()) cmd->command += ' ';
+          cmd->command += cmd->arguments.back();
+        }
+      } else {
+        cmd->command = std::string{obj.at("command").as_string()};
+        cmd->arguments = tokenize_command(cmd->command);
+      }
+      unwrap_launcher(cmd->arguments);
+    } catch (std::exception& e) {
+      LOG_WARN("Malformed entry #{} of {}: {}", i, impl_->path, e.what());
+      cmd->command.clear();
+      cmd->arguments.clear();
+    }
+    slot.cmd = std::move(cmd);
+  });
+  return *slot.cmd;
+}
+
+std::optional<size_t> ccj_snapshot::find(const fs::path& file) const {
+  if (auto it = by_file_.find(file.native()); it != by_file_.end())
+    return it->second;
+  return std::nullopt;
+}
+
+project::project(fs::path compile_commands_path)
+    : ccj_path_{std::move(compile_commands_path)},
+      caches_{std::make_unique<scan_cache>()},
+      index_{std::make_unique<include_index>(*this)} {}
+
+project::~project() = default;
+
+std::shared_ptr<const ccj_snapshot> project::database() {
+  std::error_code ec;
+  auto mtime = fs::last_write_time(ccj_path_, ec);
+  std::lock_guard lk{mutex_};
+  if (!snapshot_ || ec || snapshot_->mtime() != mtime) {
+    if (snapshot_) LOG_INFO("{} changed, reloading", ccj_path_);
+    snapshot_ = std::make_shared<const ccj_snapshot>(ccj_path_);
+  }
+  return snapshot_;
+}
+
+void project::record_compile_time(
+    const fs::path& tu, std::chrono::milliseconds elapsed) {
+  auto key = fs::absolute(tu).lexically_normal().string();
+  std::lock_guard lk{times_mutex_};
+  compile_times_.insert_or_assign(std::move(key), elapsed);
+}
+
+std::optional<std::chrono::milliseconds> project::compile_time(
+    const fs::path& tu) const {
+  auto key = fs::absolute(tu).lexically_normal().string();
+  std::lock_guard lk{times_mutex_};
+  if (auto it = compile_times_.find(key); it != compile_times_.end())
+    return it->second;
+  return std::nullopt;
+}
+
+}  // namespace xpto::blot
@@ -0,0 +1,434 @@
+#include "blot/sandbox.hpp"
+
+#include <fmt/format.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/SHA256.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#endif
+
+#define BOOST_PROCESS_USE_STD_FS 1
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/completion_condition.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/readable_pipe.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/process/v2/process.hpp>
+#include <boost/process/v2/start_dir.hpp>
+#include <boost/process/v2/stdio.hpp>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+
+#include "logger.hpp"
+
+namespace xpto::blot {
+
+namespace p2 = boost::process::v2;
+namespace asio = boost::asio;
+
+// Requests to the helper, and its replies, are sequences of fields,
+// each its length in decimal, a newline, and that many bytes:
+//
+//   reset                          -> ok | error MSG
+//   write FILE CONTENTS            -> ok | error MSG
+//   run DIR PROGRAM N ARG1..ARGN   -> exit CODE OUT ERR | error MSG
+//
+// Once set up, it says ready, or error MSG and exits.
+
+static void put_field(std::string& out, std::string_view s) {
+  out += std::to_string(s.size());
+  out += '\n';
+  out += s;
+}
+
+static bool is_within(const fs::path& p, const fs::path& root) {
+  auto rel = p.lexically_normal().lexically_relative(root);
+  return p.is_absolute() && !rel.empty() && *rel.begin() != "..";
+}
+
+fs::path default_sandbox_helper() {
+  std::error_code ec{};
+  auto self = fs::read_symlink("/proc/self/exe", ec);
+  return (ec ? fs::current_path() : self.parent_path()) / "spoof_exe";
+}
+
+struct sandbox::helper {
+  // It said no, but is still there, and still in step with us.
+  struct refused : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  helper(const fs::path& exe, const fs::path& root) {
+    asio::local::stream_protocol::socket theirs{ctx};
+    asio::local::connect_pair(sock, theirs);
+    // Not for the helper, nor anything else started, to keep open.
+    ::fcntl(sock.native_handle(), F_SETFD, FD_CLOEXEC);
+    proc.emplace(
+        ctx, exe, std::vector<std::string>{"--serve", root.string()},
+        p2::process_stdio{
+          .in = theirs.native_handle(), .out = theirs.native_handle()});
+  }
+  helper(const helper&) = delete;
+  helper(helper&&) = delete;
+  helper& operator=(const helper&) = delete;
+  helper& operator=(helper&&) = delete;
+  ~helper() {
+    // It exits when its input closes.
+    boost::system::error_code ec{};
+    sock.close(ec);
+    if (proc) proc->wait(ec);
+  }
+
+  void send(const std::vector<std::string_view>& fields) {
+    std::string msg;
+    for (auto f : fields) put_field(msg, f);
+    asio::write(sock, asio::buffer(msg));
+  }
+
+  std::string receive() {
+    auto nl = asio::read_until(sock, asio::dynamic_buffer(buf), '\n');
+    auto n = std::stoul(buf.substr(0, nl - 1));
+    buf.erase(0, nl);
+    if (buf.size() < n)
+      asio::read(
+          sock, asio::dynamic_buffer(buf),
+          asio::transfer_exactly(n - buf.size()));
+    auto field = buf.substr(0, n);
+    buf.erase(0, n);
+    return field;
+  }
+
+  void expect_ok(std::string_view what) {
+    auto reply = receive();
+    if (reply == "ok") return;
+    if (reply == "error")
+      throw refused{fmt::format("sandbox: can't {}: {}", what, receive())};
+    throw std::runtime_error{
+      fmt::format("sandbox: unexpected reply to {}", what)};
+  }
+
+  asio::io_context ctx;
+  asio::local::stream_protocol::socket sock{ctx};
+  std::optional<p2::process> proc;
+  std::string buf;  // read, not yet received
+};
+
+sandbox::sandbox(fs::path root, fs::path helper)
+: root_{fs::absolute(root)}, helper_path_{std::move(helper)} {}
+
+sandbox::~sandbox() = default;
+
+sandbox::helper& sandbox::start_() {
+  if (helper_) return *helper_;
+  if (broken_) throw std::runtime_error{*broken_};
+  try {
+    std::error_code ec{};
+    if (!fs::exists(helper_path_, ec))
+      throw std::runtime_error{
+        fmt::format("no helper at {}", helper_path_.string())};
+    auto h = std::make_unique<helper>(helper_path_, root_);
+    auto greeting = h->receive();
+    if (greeting == "error") throw std::runtime_error{h->receive()};
+    if (greeting != "ready")
+      throw std::runtime_error{"helper said something unexpected"};
+    helper_ = std::move(h);
+  } catch (std::exception& e) {
+    broken_ = fmt::format("Can't sandbox {}: {}", root_.string(), e.what());
+    LOG_WARN("{}", *broken_);
+    throw std::runtime_error{*broken_};
+  }
+  LOG_INFO("sandbox: started for {}", root_.string());
+  return *helper_;
+}
+
+bool sandbox::available() {
+  std::lock_guard lk{mutex_};
+  try {
+    start_();
+    return true;
+  } catch (std::exception&) {
+    return false;
+  }
+}
+
+sandbox_result sandbox::run(
+    std::span<const file_overlay> overlays, const std::string& program,
+    const std::vector<std::string>& args, const fs::path& directory) {
+  for (const auto& o : overlays) {
+    if (!is_within(o.file, root_))
+      throw std::runtime_error{fmt::format(
+          "Can't sandbox {}: not under {}", o.file.string(),
+          root_.string())};
+  }
+
+  std::lock_guard lk{mutex_};
+  auto& h = start_();
+  try {
+    // Files unsaved no longer: back to what's on disk.
+    bool stale = std::ranges::any_of(shown_, [&](const auto& s) {
+      return std::ranges::find(overlays, s.first, &file_overlay::file) ==
+             overlays.end();
+    });
+    if (stale) {
+      LOG_DEBUG("sandbox: remounting {}", root_.string());
+      shown_.clear();
+      h.send({"reset"});
+      try {
+        h.expect_ok("reset");
+      } catch (helper::refused& e) {
+        // It's exited, having said so.
+        throw std::runtime_error{e.what()};
+      }
+    }
+    for (const auto& o : overlays) {
+      auto digest =
+          llvm::SHA256::hash(llvm::arrayRefFromStringRef(o.contents));
+      auto it = shown_.find(o.file);
+      if (it != shown_.end() && it->second == digest) continue;
+      // Until it's said ok, what's there is anyone's guess: a digest
+      // nothing has, so it's written again, or reset away if not.
+      shown_[o.file] = {};
+      h.send({"write", o.file.string(), o.contents});
+      h.expect_ok(fmt::format("write {}", o.file.string()));
+      shown_[o.file] = digest;
+    }
+
+    // The helper's working directory isn't ours.
+    auto dir = fs::absolute(directory).string();
+    auto nargs = std::to_string(args.size());
+    std::vector<std::string_view> req{"run", dir, program, nargs};
+    req.insert(req.end(), args.begin(), args.end());
+    h.send(req);
+    auto reply = h.receive();
+    if (reply == "error")
+      throw helper::refused{
+        fmt::format("sandbox: can't run {}: {}", program, h.receive())};
+    if (reply != "exit")
+      throw std::runtime_error{"sandbox: unexpected reply to run"};
+    sandbox_result res{};
+    res.exit_code = std::stoi(h.receive());
+    res.out = h.receive();
+    res.err = h.receive();
+    return res;
+  } catch (helper::refused&) {
+    throw;
+  } catch (...) {
+    // Whatever state it's in, start afresh next time.
+    helper_.reset();
+    shown_.clear();
+    throw;
+  }
+}
+
+#ifdef __linux__
+
+static void check(int rc, const char* what) {
+  if (rc != 0) throw std::system_error{errno, std::system_category(), what};
+}
+
+static void write_proc_file(const char* file, const std::string& contents) {
+  std::ofstream f{file};
+  f << contents << std::flush;
+  if (!f) throw std::runtime_error{fmt::format("can't write {}", file)};
+}
+
+// A directory to mount the tmpfs holding the overlay's upper layer on,
+// inside the namespace only.  One compilers don't care about, so that
+// nothing need be created outside it.
+static fs::path scratch_for(const fs::path& root) {
+  static constexpr std::array k_candidates{"/dev/shm", "/run", "/mnt"};
+  for (const auto* c : k_candidates) {
+    std::error_code ec{};
+    if (fs::is_directory(c, ec) && !is_within(root, c) && root != c)
+      return c;
+  }
+  throw std::runtime_error{"no directory to mount a tmpfs on"};
+}
+
+static void enter_namespace() {
+  auto uid = ::getuid();
+  auto gid = ::getgid();
+  check(::unshare(CLONE_NEWUSER | CLONE_NEWNS), "unshare");
+  write_proc_file("/proc/self/uid_map", fmt::format("0 {} 1\n", uid));
+  write_proc_file("/proc/self/setgroups", "deny\n");
+  write_proc_file("/proc/self/gid_map", fmt::format("0 {} 1\n", gid));
+  // Nothing mounted from here on is seen outside.
+  check(
+      ::mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr),
+      "make mounts private");
+}
+
+// Overlay `root` with itself and an empty tmpfs layer on `scratch`.
+static void mount_view(const fs::path& root, const fs::path& scratch) {
+  if (root.string().find_first_of(",:\\") != std::string::npos)
+    throw std::runtime_error{"can't overlay a path with ',', ':' or '\\'"};
+  check(
+      ::mount("tmpfs", scratch.c_str(), "tmpfs", 0, "mode=0700"),
+      "mount tmpfs");
+  fs::create_directory(scratch / "upper");
+  fs::create_directory(scratch / "work");
+  auto opts = fmt::format(
+      "lowerdir={},upperdir={},workdir={}", root.string(),
+      (scratch / "upper").string(), (scratch / "work").string());
+  // Extended attributes of the user namespace, where the kernel has
+  // them, as those of the trusted one can't be set.
+  auto with_user_xattrs = opts + ",userxattr";
+  if (::mount(
+          "overlay", root.c_str(), "overlay", 0, with_user_xattrs.c_str()) ==
+      0)
+    return;
+  check(
+      ::mount("overlay", root.c_str(), "overlay", 0, opts.c_str()),
+      "mount overlay");
+}
+
+static void unmount_view(const fs::path& root, const fs::path& scratch) {
+  check(::umount2(root.c_str(), MNT_DETACH), "unmount overlay");
+  check(::umount2(scratch.c_str(), MNT_DETACH), "unmount tmpfs");
+}
+
+static void write_unsaved(
+    const fs::path& root, const fs::path& file, const std::string& contents) {
+  if (!is_within(file, root))
+    throw std::runtime_error{fmt::format("{} isn't in view", file.string())};
+  // Into the upper layer, whatever the directories on disk.
+  fs::create_directories(file.parent_path());
+  std::ofstream f{file, std::ios::binary | std::ios::trunc};
+  f << contents << std::flush;
+  if (!f)
+    throw std::runtime_error{fmt::format("can't write {}", file.string())};
+}
+
+static sandbox_result run_command(
+    const fs::path& directory, const std::string& program,
+    const std::vector<std::string>& args) {
+  asio::io_context ctx;
+  asio::readable_pipe rp_out{ctx};
+  asio::readable_pipe rp_err{ctx};
+  sandbox_result res{};
+
+  p2::process proc{
+    ctx, program, args,
+    p2::process_stdio{.in = nullptr, .out = rp_out, .err = rp_err},
+    p2::process_start_dir{directory}};
+
+  boost::system::error_code ec_out, ec_err;
+  asio::read(rp_out, asio::dynamic_buffer(res.out), ec_out);
+  asio::read(rp_err, asio::dynamic_buffer(res.err), ec_err);
+  res.exit_code = proc.wait();
+  return res;
+}
+
+static std::optional<std::string> get_field(std::istream& in) {
+  size_t n{};
+  if (!(in >> n) || in.get() != '\n') return std::nullopt;
+  std::string s(n, '\0');
+  if (!in.read(s.data(), static_cast<std::streamsize>(n))) return std::nullopt;
+  return s;
+}
+
+static void reply(const std::vector<std::string_view>& fields) {
+  std::string msg;
+  for (auto f : fields) put_field(msg, f);
+  std::cout << msg << std::flush;
+}
+
+int serve_sandbox(const fs::path& root) {
+  std::ios::sync_with_stdio(false);
+  fs::path scratch;
+  try {
+    scratch = scratch_for(root);
+    enter_namespace();
+    mount_view(root, scratch);
+    // Not to keep anything under `root` busy.
+    check(::chdir("/"), "chdir");
+  } catch (std::exception& e) {
+    reply({"error", e.what()});
+    return 1;
+  }
+  reply({"ready"});
+
+  // Requests are read whole before acting on any, so that a failure
+  // doesn't leave the rest of one to be taken for the next.
+  auto need = [](std::optional<std::string> f) {
+    if (!f) throw std::runtime_error{"truncated request"};
+    return std::move(*f);
+  };
+  try {
+    while (auto what = get_field(std::cin)) {
+      if (*what == "reset") {
+        try {
+          unmount_view(root, scratch);
+          mount_view(root, scratch);
+          reply({"ok"});
+        } catch (std::exception& e) {
+          // Whatever's mounted now can't be trusted.
+          reply({"error", e.what()});
+          return 1;
+        }
+      } else if (*what == "write") {
+        auto file = need(get_field(std::cin));
+        auto contents = need(get_field(std::cin));
+        try {
+          write_unsaved(root, file, contents);
+          reply({"ok"});
+        } catch (std::exception& e) {
+          reply({"error", e.what()});
+        }
+      } else if (*what == "run") {
+        auto dir = need(get_field(std::cin));
+        auto program = need(get_field(std::cin));
+        auto n = std::stoul(need(get_field(std::cin)));
+        std::vector<std::string> args;
+        for (size_t i = 0; i < n; ++i)
+          args.push_back(need(get_field(std::cin)));
+        try {
+          auto res = run_command(dir, program, args);
+          auto code = std::to_string(res.exit_code);
+          reply({"exit", code, res.out, res.err});
+        } catch (std::exception& e) {
+          reply({"error", e.what()});
+        }
+      } else {
+        throw std::runtime_error{fmt::format("unknown request {}", *what)};
+      }
+    }
+  } catch (std::exception& e) {
+    fmt::print(stderr, "spoof: {}\n", e.what());
+    return 1;
+  }
+  return 0;
+}
+
+#else
+
+int serve_sandbox(const fs::path& root) {
+  (void)root;
+  std::string msg;
+  put_field(msg, "error");
+  put_field(msg, "sandboxes need Linux");
+  std::cout << msg << std::flush;
+  return 1;
+}
+
+#endif
+
+}  // namespace xpto::blot
@@ -0,0 +1,273 @@
+#include "scan_cache.hpp"
+
+#include <clang/Tooling/DependencyScanning/DependencyScanningService.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "logger.hpp"
+
+namespace xpto::blot {
+
+namespace {
+
+// Non-owning view of a cached buffer that keeps it alive.
+class shared_buffer : public llvm::MemoryBuffer {
+ public:
+  shared_buffer(
+      std::shared_ptr<const llvm::MemoryBuffer> owner, std::string name,
+      bool requires_null_terminator)
+      : owner_{std::move(owner)}, name_{std::move(name)} {
+    init(
+        owner_->getBufferStart(), owner_->getBufferEnd(),
+        requires_null_terminator);
+  }
+
+  [[nodiscard]] BufferKind getBufferKind() const override {
+    return MemoryBuffer_Malloc;
+  }
+  [[nodiscard]] llvm::StringRef getBufferIdentifier() const override {
+    return name_;
+  }
+
+ private:
+  std::shared_ptr<const llvm::MemoryBuffer> owner_;
+  std::string name_;
+};
+
+class cached_file : public llvm::vfs::File {
+ public:
+  cached_file(
+      llvm::vfs::Status status,
+      std::shared_ptr<const llvm::MemoryBuffer> contents)
+      : status_{std::move(status)}, contents_{std::move(contents)} {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status() override { return status_; }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+      const llvm::Twine& name, int64_t, bool requires_null_terminator,
+      bool) override {
+    return std::unique_ptr<llvm::MemoryBuffer>{std::make_unique<shared_buffer>(
+        contents_, name.str(), requires_null_terminator)};
+  }
+
+  std::error_code close() override { return {}; }
+
+ private:
+  llvm::vfs::Status status_;
+  std::shared_ptr<const llvm::MemoryBuffer> contents_;
+};
+
+// A physical filesystem of our own, so that nobody's notion of the
+// working directory leaks into the process-wide one.
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> physical_fs() {
+  return llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>{
+    llvm::vfs::createPhysicalFileSystem().release()};
+}
+
+}  // namespace
+
+caching_fs::caching_fs() : llvm::vfs::ProxyFileSystem{physical_fs()} {}
+
+caching_fs::entry caching_fs::lookup(const std::string& key) {
+  auto gen = generation_.load();
+  {
+    std::shared_lock lk{mutex_};
+    if (auto it = entries_.find(key);
+        it != entries_.end() && it->second.generation == gen) {
+      ++hits_;
+      return it->second;
+    }
+  }
+  ++misses_;
+  auto st = ProxyFileSystem::status(key);
+
+  std::unique_lock lk{mutex_};
+  auto& e = entries_[key];
+  bool known = e.generation != 0;
+  bool same = known && e.status.has_value() == static_cast<bool>(st) &&
+              (!st || (e.status->getLastModificationTime() ==
+                           st->getLastModificationTime() &&
+                       e.status->getSize() == st->getSize()));
+  if (!same) {
+    if (known) ++changes_;
+    e.contents.reset();
+  }
+  e.status = st ? std::optional{*st} : std::nullopt;
+  e.generation = gen;
+  return e;
+}
+
+llvm::ErrorOr<llvm::vfs::Status> caching_fs::status(const llvm::Twine& path) {
+  llvm::SmallString<256> storage;
+  auto ref = path.toStringRef(storage);
+  // Relative paths depend on the working directory; don't cache them.
+  if (!llvm::sys::path::is_absolute(ref)) return ProxyFileSystem::status(path);
+
+  auto e = lookup(ref.str());
+  if (!e.status)
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  return llvm::vfs::Status::copyWithNewName(*e.status, ref);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> caching_fs::openFileForRead(
+    const llvm::Twine& path) {
+  llvm::SmallString<256> storage;
+  auto ref = path.toStringRef(storage);
+  if (!llvm::sys::path::is_absolute(ref))
+    return ProxyFileSystem::openFileForRead(path);
+
+  auto key = ref.str();
+  auto e = lookup(key);
+  if (!e.status)
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  if (e.status->isDirectory()) return ProxyFileSystem::openFileForRead(path);
+
+  if (!e.contents) {
+    auto f = ProxyFileSystem::openFileForRead(path);
+    if (!f) return f.getError();
+    // Volatile, so the contents get copied rather than mmap'ed and
+    // can't change under our feet.
+    auto buf = (*f)->getBuffer(key, -1, true, true);
+    if (!buf) return buf.getError();
+    std::shared_ptr<const llvm::MemoryBuffer> contents{std::move(*buf)};
+
+    std::unique_lock lk{mutex_};
+    auto& slot = entries_[key].contents;
+    if (!slot) slot = contents;
+    e.contents = slot;
+  }
+  return std::make_unique<cached_file>(
+      llvm::vfs::Status::copyWithNewName(*e.status, ref), e.contents);
+}
+
+void infer_history::record_match(
+    const std::string& header, const std::string& tu) {
+  auto dir = fs::path{header}.parent_path().string();
+  std::unique_lock lk{mutex_};
+  last_includer_.insert_or_assign(header, tu);
+  dir_includers_[dir].insert(tu);
+}
+
+void infer_history::record_includes(
+    const std::string& tu, const std::unordered_set<std::string>& dirs) {
+  if (dirs.empty()) return;
+  std::unique_lock lk{mutex_};
+  for (const auto& dir : dirs) dir_includers_[dir].insert(tu);
+}
+
+infer_history::hints infer_history::hints_for(const std::string& header) const {
+  auto dir = fs::path{header}.parent_path().string();
+  hints res;
+  std::shared_lock lk{mutex_};
+  if (auto it = last_includer_.find(header); it != last_includer_.end())
+    res.last_includer = it->second;
+  if (auto it = dir_includers_.find(dir); it != dir_includers_.end())
+    res.sibling_includers = it->second;
+  return res;
+}
+
+namespace deps = clang::tooling::dependencies;
+
+scan_cache::scan_cache() = default;
+scan_cache::~scan_cache() = default;
+
+std::shared_ptr<deps::DependencyScanningService>
+scan_cache::dependency_service() {
+  std::lock_guard lk{dep_mutex_};
+  if (dep_service_) {
+    auto before = fs->changes();
+    for (const auto& f : dep_files_) (void)fs->status(f);
+    if (fs->changes() != before) {
+      LOG_DEBUG("Dependencies changed, dropping dependency scanner cache");
+      dep_service_.reset();
+      dep_files_.clear();
+    }
+  }
+  if (!dep_service_) {
+    dep_service_ = std::make_shared<deps::DependencyScanningService>(
+        deps::ScanningMode::DependencyDirectivesScan,
+        deps::ScanningOutputFormat::Make);
+  }
+  return dep_service_;
+}
+
+void scan_cache::note_dependencies(const std::vector<std::string>& files) {
+  std::lock_guard lk{dep_mutex_};
+  for (const auto& f : files) {
+    // Stat new ones right away, so that later changes are noticed.
+    if (dep_files_.insert(f).second) (void)fs->status(f);
+  }
+}
+
+// What of `cmd` decides what its TU's headers include: its arguments,
+// but for the input file and where outputs go.
+static std::string preprocessor_flags(const compile_command& cmd) {
+  static constexpr std::array<std::string_view, 4> k_outputs{
+    "-o", "-MF", "-MT", "-MQ"};
+  std::string flags;
+  const auto& args = cmd.arguments;
+  for (size_t i = 0; i < args.size(); ++i) {
+    const auto& a = args[i];
+    if (std::ranges::find(k_outputs, a) != k_outputs.end()) {
+      ++i;
+      continue;
+    }
+    if (std::ranges::any_of(k_outputs, [&](std::string_view o) {
+          return a.starts_with(o);
+        }))
+      continue;
+    if (i > 0 && (cmd.directory / a).lexically_normal() == cmd.file) continue;
+    flags += a;
+    flags += '\0';
+  }
+  return flags;
+}
+
+std::shared_ptr<pruning_memo> scan_cache::pruning_memo_for(
+    const std::string& needle, const compile_command& cmd) {
+  std::lock_guard lk{memo_mutex_};
+  auto [it, fresh] =
+      memos_.try_emplace(needle + '\0' + preprocessor_flags(cmd));
+  if (fresh) {
+    it->second = std::make_shared<pruning_memo>();
+    it->second->validated_at = fs->changes();
+    return it->second;
+  }
+  auto& memo = *it->second;
+  std::unique_lock memo_lk{memo.mutex};
+  for (const auto& f : memo.clean) (void)fs->status(f);
+  if (auto now = fs->changes(); now != memo.validated_at) {
+    LOG_DEBUG("Files changed, forgetting pruned headers for '{}'", needle);
+    memo.clean.clear();
+    memo.validated_at = now;
+  }
+  return it->second;
+}
+
+std::shared_ptr<const ninja_deps> scan_cache::ninja_log(
+    const fs::path& build_dir) {
+  auto path = (build_dir / ".ninja_deps").string();
+  auto st = fs->status(path);
+  std::lock_guard lk{ninja_mutex_};
+  if (!st) {
+    ninja_logs_.erase(path);
+    return nullptr;
+  }
+  auto [it, fresh] = ninja_logs_.try_emplace(path);
+  auto& e = it->second;
+  if (fresh || e.mtime != st->getLastModificationTime()) {
+    e.log = read_ninja_deps(path);
+    e.mtime = st->getLastModificationTime();
+  }
+  return e.log;
+}
+
+}  // namespace xpto::blot
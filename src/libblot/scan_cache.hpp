@@ -0,0 +1,171 @@
+#pragma once
+
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "blot/compile_command.hpp"
+#include "depfile.hpp"
+
+namespace clang::tooling::dependencies {
+class DependencyScanningService;
+}
+
+namespace xpto::blot {
+
+// A thread-safe caching layer over the real filesystem, shared by
+// every ToolInvocation that infer() and include_index run over one
+// project.  `status()` results, including misses from header search
+// probing, and file contents are kept in memory, so that N TUs
+// including the same header stat and read it once, not N times.
+//
+// Freshness is per "generation": `next_generation()` is called at the
+// start of each scan, and an entry is re-stat'ed at most once per
+// generation.  Contents are kept as long as size and mtime don't
+// change.
+class caching_fs : public llvm::vfs::ProxyFileSystem {
+ public:
+  caching_fs();
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine& path) override;
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(
+      const llvm::Twine& path) override;
+
+  // Start a new generation: entries get revalidated on next access.
+  void next_generation() { ++generation_; }
+
+  // Bumped every time revalidation finds a file changed, appeared or
+  // disappeared.  Lets callers drop anything derived from contents.
+  [[nodiscard]] uint64_t changes() const { return changes_.load(); }
+
+  struct counters {
+    uint64_t hits;
+    uint64_t misses;
+  };
+  [[nodiscard]] counters stats() const {
+    return {hits_.load(), misses_.load()};
+  }
+
+ private:
+  struct entry {
+    std::optional<llvm::vfs::Status> status;  // nullopt if missing
+    std::shared_ptr<const llvm::MemoryBuffer> contents;
+    uint64_t generation{};
+  };
+
+  // Look `key` up, (re)validating it if needed.  Returns a copy.
+  entry lookup(const std::string& key);
+
+  std::shared_mutex mutex_;
+  std::unordered_map<std::string, entry> entries_;
+  std::atomic<uint64_t> generation_{1};
+  std::atomic<uint64_t> changes_{0};
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+// What earlier infer() scans learned about the project, used to rank
+// candidate TUs for the next one.  Thread-safe.
+class infer_history {
+ public:
+  // `tu` was found to include `header`.
+  void record_match(const std::string& header, const std::string& tu);
+
+  // `tu` was seen including user headers living in `dirs`.
+  void record_includes(
+      const std::string& tu, const std::unordered_set<std::string>& dirs);
+
+  struct hints {
+    std::optional<std::string> last_includer;
+    // TUs seen including some header from the same directory.
+    std::unordered_set<std::string> sibling_includers;
+  };
+  [[nodiscard]] hints hints_for(const std::string& header) const;
+
+ private:
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string, std::string> last_includer_;
+  std::unordered_map<std::string, std::unordered_set<std::string>>
+      dir_includers_;
+};
+
+// User headers whose whole include closure is known not to contain
+// some file infer() looked for, when preprocessed with some flags:
+// another TU's `-D`s could take a path through them this one didn't.
+// Only headers whose conditionals test no macro defined, or left
+// undefined, by what came before them, and which define no macros but
+// their include guard, get in: TUs skip them entirely.  Workers read
+// and extend `clean` concurrently, under `mutex`.
+struct pruning_memo {
+  std::shared_mutex mutex;
+  std::unordered_set<std::string> clean;
+  uint64_t validated_at{};  // caching_fs::changes() when last validated
+};
+
+// Per-project state kept across infer() and include_index scans, see
+// project::caches().
+struct scan_cache {
+  scan_cache();
+  ~scan_cache();
+
+  scan_cache(const scan_cache&) = delete;
+  scan_cache(scan_cache&&) = delete;
+  scan_cache& operator=(const scan_cache&) = delete;
+  scan_cache& operator=(scan_cache&&) = delete;
+
+  llvm::IntrusiveRefCntPtr<caching_fs> fs{new caching_fs{}};
+  infer_history history;
+
+  // Service of the `dependency_scan` infer backend.  It keeps the
+  // minimized sources it reads forever, so before handing it out, the
+  // files it reported as dependencies are re-stat'ed through `fs`, and
+  // it is replaced with a fresh one if any changed.  Callers should
+  // have bumped `fs`'s generation.
+  std::shared_ptr<clang::tooling::dependencies::DependencyScanningService>
+  dependency_service();
+
+  // Record files the dependency service has read.
+  void note_dependencies(const std::vector<std::string>& files);
+
+  // The pruning memo for `needle` in TUs preprocessed like `cmd`: with
+  // the same compiler and arguments, but for the input and outputs.
+  // Its headers are re-stat'ed through `fs` first, and it is emptied
+  // if that, or anything else since it was last validated, found a
+  // file changed: edits can add includes.  Callers should have bumped
+  // `fs`'s generation.
+  std::shared_ptr<pruning_memo> pruning_memo_for(
+      const std::string& needle, const compile_command& cmd);
+
+  // Parsed `.ninja_deps` log of `build_dir`, or null if there's none.
+  // Re-read when its mtime, as seen by `fs`, changes.
+  std::shared_ptr<const ninja_deps> ninja_log(const fs::path& build_dir);
+
+ private:
+  std::mutex dep_mutex_;
+  std::shared_ptr<clang::tooling::dependencies::DependencyScanningService>
+      dep_service_;
+  std::unordered_set<std::string> dep_files_;
+
+  std::mutex memo_mutex_;
+  std::unordered_map<std::string, std::shared_ptr<pruning_memo>> memos_;
+
+  struct ninja_log_entry {
+    llvm::sys::TimePoint<> mtime;
+    std::shared_ptr<const ninja_deps> log;
+  };
+  std::mutex ninja_mutex_;
+  std::unordered_map<std::string, ninja_log_entry> ninja_logs_;
+};
+
+}  // namespace xpto::blot
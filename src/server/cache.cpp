@@ -0,0 +1,403 @@
+#include "cache.hpp"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/SHA256.h>
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "logger.hpp"
+
+namespace xpto::blot {
+
+std::string digest(std::string_view bytes) {
+  return llvm::toHex(
+      llvm::SHA256::hash(llvm::arrayRefFromStringRef(bytes)),
+      /*LowerCase=*/true);
+}
+
+/// Footprints
+
+static size_t footprint(const std::string& s) {
+  // Short strings live inside the object itself.
+  return s.capacity() > std::string{}.capacity() ? s.capacity() + 1 : 0;
+}
+
+static size_t footprint(const std::vector<std::string>& v) {
+  size_t n = v.capacity() * sizeof(std::string);
+  for (const auto& s : v) n += footprint(s);
+  return n;
+}
+
+size_t footprint(const compile_command& cmd) {
+  return sizeof(cmd) + footprint(cmd.directory.native()) +
+         footprint(cmd.command) + footprint(cmd.file.native()) +
+         footprint(cmd.arguments);
+}
+
+size_t footprint(const compilation_result& res) {
+  const auto& inv = res.invocation;
+  return sizeof(res) + footprint(res.assembly) + footprint(inv.compiler) +
+         footprint(inv.args) + footprint(inv.directory.native()) +
+         footprint(inv.compiler_version);
+}
+
+size_t footprint(const json::value& val) {
+  size_t n = sizeof(json::value);
+  switch (val.kind()) {
+    case json::kind::string:
+      n += val.get_string().capacity();
+      break;
+    case json::kind::array: {
+      const auto& arr = val.get_array();
+      n += (arr.capacity() - arr.size()) * sizeof(json::value);
+      for (const auto& v : arr) n += footprint(v);
+      break;
+    }
+    case json::kind::object:
+      n += footprint(val.get_object());
+      break;
+    default:
+      break;
+  }
+  return n;
+}
+
+size_t footprint(const json::object& obj) {
+  size_t n = (obj.capacity() - obj.size()) * sizeof(json::key_value_pair);
+  for (const auto& kv : obj) {
+    n += sizeof(json::key_value_pair) - sizeof(json::value) +
+         kv.key().size() + footprint(kv.value());
+  }
+  return n;
+}
+
+/// result_cache
+
+// Bookkeeping of an entry beyond its values: the entry itself, its node
+// in the shard's table, and the indexes' share.
+constexpr size_t k_entry_overhead = 128;
+
+size_t result_cache::entry::bytes() const {
+  size_t n = k_entry_overhead + inference.bytes + assembly.bytes;
+  for (const auto& [key, annotation] : annotations) n += annotation.bytes;
+  return n;
+}
+
+result_cache::result_cache(size_t budget) : budget_{budget} {}
+
+result_cache::shard& result_cache::shard_of(token_t tok) {
+  return shards_[static_cast<uint64_t>(tok) % k_shards];
+}
+
+result_cache::key_shard& result_cache::key_shard_of(
+    key_index& index, const std::string& key) {
+  return index[std::hash<std::string>{}(key) % k_shards];
+}
+
+template <typename T>
+static constexpr size_t kind_index() {
+  if constexpr (std::is_same_v<T, compile_command>)
+    return static_cast<size_t>(result_kind::inference);
+  else if constexpr (std::is_same_v<T, compilation_result>)
+    return static_cast<size_t>(result_kind::assembly);
+  else
+    return static_cast<size_t>(result_kind::annotation);
+}
+
+template <typename T, typename F>
+result_cache::ptr<T> result_cache::get(token_t tok, F&& find) {
+  auto& s = shard_of(tok);
+  std::shared_lock lk{s.mutex};
+  auto it = s.entries.find(tok);
+  const slot<T>* f = it == s.entries.end() ? nullptr : find(it->second);
+  if (!f || !f->value) {
+    s.misses[kind_index<T>()].fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  s.hits[kind_index<T>()].fetch_add(1, std::memory_order_relaxed);
+  auto& e = it->second;
+  auto stamp = clock_.load(std::memory_order_relaxed) + 1;
+  if (e.last_used.load(std::memory_order_relaxed) < stamp)
+    e.last_used.store(stamp, std::memory_order_relaxed);
+  return f->value;
+}
+
+template <typename T, typename F>
+void result_cache::put(
+    token_t tok, F&& slot_in, ptr<T> value, size_t bytes, std::string* key,
+    std::string* asm_digest) {
+  auto& s = shard_of(tok);
+  ptr<T> old{};  // released outside the lock
+  {
+    std::unique_lock lk{s.mutex};
+    auto [it, fresh] = s.entries.try_emplace(tok);
+    auto& e = it->second;
+    slot<T>& f = slot_in(e);
+    if (fresh) bytes_ += k_entry_overhead;
+    bytes_ += bytes;
+    bytes_ -= f.bytes;
+    old = std::exchange(f.value, std::move(value));
+    f.bytes = bytes;
+    if (key) std::swap(*key, e.assembly_key);
+    if (asm_digest) std::swap(*asm_digest, e.assembly_digest);
+    e.last_used.store(clock_ += 2, std::memory_order_relaxed);
+  }
+  if (bytes_.load() > budget_) evict_over_budget(tok);
+}
+
+void result_cache::evict_over_budget(token_t keep) {
+  // Whoever holds the lock is evicting already, and will go on until
+  // under budget, counting what we just stored.
+  std::unique_lock lk{evict_mutex_, std::try_to_lock};
+  if (!lk) return;
+
+  struct candidate {
+    bool held;
+    uint64_t last_used;
+    token_t tok;
+  };
+  std::vector<candidate> candidates;
+  for (auto& s : shards_) {
+    std::shared_lock slk{s.mutex};
+    for (const auto& [tok, e] : s.entries) {
+      if (tok != keep)
+        candidates.push_back(
+            {s.holds.contains(tok), e.last_used.load(), tok});
+    }
+  }
+  std::ranges::sort(candidates, {}, [](const candidate& c) {
+    return std::pair{c.held, c.last_used};
+  });
+
+  for (const auto& c : candidates) {
+    if (bytes_.load() <= budget_) break;
+    std::string key;
+    std::vector<std::string> annotation_keys;
+    std::array<bool, k_result_kinds> held_kind{};
+    size_t bytes{};
+    {
+      auto& s = shard_of(c.tok);
+      std::unique_lock slk{s.mutex};
+      auto it = s.entries.find(c.tok);
+      // Gone, or used since: spare it this time.
+      if (it == s.entries.end() || it->second.last_used.load() != c.last_used)
+        continue;
+      auto& e = it->second;
+      key = std::move(e.assembly_key);
+      for (const auto& [k, annotation] : e.annotations)
+        annotation_keys.push_back(k);
+      bytes = e.bytes();
+      held_kind = {
+        e.inference.value != nullptr, e.assembly.value != nullptr,
+        !e.annotations.empty()};
+      s.entries.erase(it);
+    }
+    LOG_DEBUG("cache: evicted token={} ({} bytes)", c.tok, bytes);
+    bytes_ -= bytes;
+    ++evictions_;
+    for (size_t k = 0; k < k_result_kinds; ++k)
+      if (held_kind[k]) ++kind_evictions_[k];
+    if (!key.empty()) forget_key(assembly_keys_, key, c.tok);
+    for (const auto& k : annotation_keys)
+      forget_key(annotation_keys_, k, c.tok);
+  }
+}
+
+std::optional<token_t> result_cache::find_key(
+    key_index& index, const std::string& key) {
+  auto& ks = key_shard_of(index, key);
+  std::shared_lock lk{ks.mutex};
+  if (auto it = ks.tokens.find(key); it != ks.tokens.end()) return it->second;
+  return std::nullopt;
+}
+
+void result_cache::index_key(key_index& index, std::string key, token_t tok) {
+  auto& ks = key_shard_of(index, key);
+  std::unique_lock lk{ks.mutex};
+  ks.tokens.insert_or_assign(std::move(key), tok);
+}
+
+void result_cache::forget_key(
+    key_index& index, const std::string& key, token_t tok) {
+  auto& ks = key_shard_of(index, key);
+  std::unique_lock lk{ks.mutex};
+  if (auto it = ks.tokens.find(key); it != ks.tokens.end() && it->second == tok)
+    ks.tokens.erase(it);
+}
+
+result_cache::ptr<compile_command> result_cache::inference(token_t tok) {
+  return get<compile_command>(tok, [](entry& e) { return &e.inference; });
+}
+
+result_cache::ptr<compilation_result> result_cache::assembly(
+    token_t tok, std::string* asm_digest) {
+  return get<compilation_result>(tok, [asm_digest](entry& e) {
+    if (asm_digest) *asm_digest = e.assembly_digest;
+    return &e.assembly;
+  });
+}
+
+std::optional<std::pair<token_t, result_cache::ptr<compilation_result>>>
+result_cache::assembly_for(const std::string& key) {
+  auto tok = find_key(assembly_keys_, key);
+  if (!tok) {
+    shard_of(0)
+        .misses[kind_index<compilation_result>()]
+        .fetch_add(1, std::memory_order_relaxed);
+    return std::nullopt;
+  }
+  auto res = assembly(*tok);
+  if (!res) {
+    // Evicted, possibly before it was indexed.
+    forget_key(assembly_keys_, key, *tok);
+    return std::nullopt;
+  }
+  return std::pair{*tok, std::move(res)};
+}
+
+std::optional<std::pair<token_t, result_cache::ptr<std::string>>>
+result_cache::annotation_for(const std::string& key) {
+  auto tok = find_key(annotation_keys_, key);
+  if (!tok) {
+    shard_of(0)
+        .misses[kind_index<std::string>()]
+        .fetch_add(1, std::memory_order_relaxed);
+    return std::nullopt;
+  }
+  auto res = get<std::string>(
+      *tok, [&key](entry& e) -> const slot<std::string>* {
+        auto it = e.annotations.find(key);
+        return it == e.annotations.end() ? nullptr : &it->second;
+      });
+  if (!res) {
+    forget_key(annotation_keys_, key, *tok);
+    return std::nullopt;
+  }
+  return std::pair{*tok, std::move(res)};
+}
+
+void result_cache::put_inference(token_t tok, compile_command cmd) {
+  auto bytes = footprint(cmd);
+  put(tok, [](entry& e) -> auto& { return e.inference; },
+      std::make_shared<const compile_command>(std::move(cmd)), bytes);
+}
+
+void result_cache::put_assembly(
+    token_t tok, std::string key, compilation_result res) {
+  put_assembly(
+      tok, std::move(key),
+      std::make_shared<const compilation_result>(std::move(res)));
+}
+
+void result_cache::put_assembly(
+    token_t tok, std::string key, ptr<compilation_result> res) {
+  // Once, here, rather than on every annotation of it.
+  auto asm_digest = digest(res->assembly);
+  auto bytes = footprint(*res) + footprint(key) + footprint(asm_digest);
+  auto old_key = key;
+  put(tok, [](entry& e) -> auto& { return e.assembly; }, std::move(res),
+      bytes, &old_key, &asm_digest);
+  if (!old_key.empty() && old_key != key)
+    forget_key(assembly_keys_, old_key, tok);
+  // Indexed only now that there's something to find.
+  index_key(assembly_keys_, std::move(key), tok);
+}
+
+void result_cache::put_annotation(
+    token_t tok, std::string key, std::string annotated) {
+  put_annotation(
+      tok, std::move(key),
+      std::make_shared<const std::string>(std::move(annotated)));
+}
+
+void result_cache::put_annotation(
+    token_t tok, std::string key, ptr<std::string> annotated) {
+  auto bytes = sizeof(std::string) + footprint(*annotated) + footprint(key);
+  put(tok,
+      [&key](entry& e) -> auto& { return e.annotations[key]; },
+      std::move(annotated), bytes);
+  index_key(annotation_keys_, std::move(key), tok);
+}
+
+bool result_cache::invalidate(token_t tok) {
+  std::string key;
+  std::vector<std::string> annotation_keys;
+  size_t bytes{};
+  ptr<compilation_result> old{};  // released outside the lock
+  {
+    auto& s = shard_of(tok);
+    std::unique_lock lk{s.mutex};
+    auto it = s.entries.find(tok);
+    if (it == s.entries.end()) return false;
+    auto& e = it->second;
+    if (!e.assembly.value && e.annotations.empty()) return false;
+    key = std::exchange(e.assembly_key, {});
+    e.assembly_digest.clear();
+    for (const auto& [k, annotation] : e.annotations)
+      annotation_keys.push_back(k);
+    if (!e.inference.value) {
+      // Nothing left worth keeping.
+      bytes = e.bytes();
+      old = std::move(e.assembly.value);
+      s.entries.erase(it);
+    } else {
+      bytes = e.bytes() - k_entry_overhead - e.inference.bytes;
+      old = std::exchange(e.assembly, {}).value;
+      e.annotations.clear();
+    }
+  }
+  LOG_DEBUG("cache: invalidated token={} ({} bytes)", tok, bytes);
+  bytes_ -= bytes;
+  if (!key.empty()) forget_key(assembly_keys_, key, tok);
+  for (const auto& k : annotation_keys) forget_key(annotation_keys_, k, tok);
+  return true;
+}
+
+void result_cache::retain(token_t tok) {
+  auto& s = shard_of(tok);
+  std::unique_lock lk{s.mutex};
+  ++s.holds[tok];
+}
+
+void result_cache::release(token_t tok) {
+  auto& s = shard_of(tok);
+  std::unique_lock lk{s.mutex};
+  if (auto it = s.holds.find(tok); it != s.holds.end() && --it->second == 0)
+    s.holds.erase(it);
+}
+
+result_cache::counters result_cache::stats() const {
+  counters c{
+    .hits = 0,
+    .misses = 0,
+    .evictions = evictions_.load(),
+    .bytes = bytes_.load(),
+    .budget = budget_,
+    .entries = 0,
+    .held = 0,
+    .by_kind = {}};
+  for (size_t k = 0; k < k_result_kinds; ++k)
+    c.by_kind[k].evictions = kind_evictions_[k].load();
+  for (const auto& s : shards_) {
+    for (size_t k = 0; k < k_result_kinds; ++k) {
+      auto hits = s.hits[k].load();
+      auto misses = s.misses[k].load();
+      c.by_kind[k].hits += hits;
+      c.by_kind[k].misses += misses;
+      c.hits += hits;
+      c.misses += misses;
+    }
+    std::shared_lock lk{s.mutex};
+    c.entries += s.entries.size();
+    c.held += s.holds.size();
+  }
+  return c;
+}
+
+}  // namespace xpto::blot
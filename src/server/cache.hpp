@@ -0,0 +1,197 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <boost/json.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "blot/assembly.hpp"
+#include "blot/compile_command.hpp"
+
+namespace xpto::blot {
+
+namespace json = boost::json;
+
+using token_t = int64_t;
+
+// Memory budget of a result cache unless told otherwise: 512 MiB.
+constexpr size_t k_default_cache_budget = size_t{512} << 20;
+
+// Hex SHA-256 of `bytes`.  Keys of results shared by all clients hash
+// what clients send, so a weaker hash would let one plant results for
+// another by crafting a collision.
+std::string digest(std::string_view bytes);
+
+// Approximate heap footprint of cached values, in bytes.
+size_t footprint(const compile_command& cmd);
+size_t footprint(const compilation_result& res);
+size_t footprint(const json::value& val);
+size_t footprint(const json::object& obj);
+
+// The results a cache keeps for a token, counted apart in its stats.
+enum class result_kind : uint8_t { inference, assembly, annotation };
+constexpr size_t k_result_kinds = 3;
+
+// What sessions remember of the inferences, assemblies and
+// annotations they produced, by token, within a memory budget.
+//
+// A token's results are chained: annotating a token reads its assembly,
+// which was compiled from its inference, which also says which source
+// file to annotate for.  So the three are kept or evicted together, as
+// one entry, least recently used first.  Assemblies are also found by
+// the command that produced them, and annotations only by what they
+// annotated and how (a token's assembly may be annotated several ways,
+// and the same assembly text may come with several tokens).  Those
+// indexes follow their entries.  Annotations are kept serialized, as
+// they're only ever sent.
+//
+// A store never evicts the entry it stored to, even if larger than
+// the whole budget, so a request can use what the previous one
+// produced.  Tokens someone holds, see `retain()`, go only once those
+// nobody holds are gone.
+//
+// Thread-safe, and built for many concurrent readers: entries are
+// spread over shards, each behind a shared_mutex that lookups only take
+// shared.  Values are immutable and handed out as shared pointers, so
+// hits copy nothing, and stay valid if evicted meanwhile.  Recency is a
+// per-entry timestamp, so it can be bumped without exclusive access;
+// stores that take the cache over budget evict the stalest entries.
+class result_cache {
+ public:
+  template <typename T>
+  using ptr = std::shared_ptr<const T>;
+
+  explicit result_cache(size_t budget = k_default_cache_budget);
+
+  ptr<compile_command> inference(token_t tok);
+  // Sets `*asm_digest`, if given and found, to the `digest()` of the
+  // assembly text, as taken when stored.
+  ptr<compilation_result> assembly(
+      token_t tok, std::string* asm_digest = nullptr);
+  // Token whose assembly `key` produced, and that assembly.
+  std::optional<std::pair<token_t, ptr<compilation_result>>> assembly_for(
+      const std::string& key);
+  // Annotation stored under `key`, and the token it was stored for.
+  std::optional<std::pair<token_t, ptr<std::string>>> annotation_for(
+      const std::string& key);
+
+  void put_inference(token_t tok, compile_command cmd);
+  void put_assembly(token_t tok, std::string key, compilation_result res);
+  void put_assembly(
+      token_t tok, std::string key, ptr<compilation_result> res);
+  void put_annotation(token_t tok, std::string key, std::string annotated);
+  void put_annotation(token_t tok, std::string key, ptr<std::string> annotated);
+
+  // Drop `tok`'s assembly and annotations, as built from files that
+  // changed since.  Its inference stays, so the token can be compiled
+  // again.  False if there was nothing to drop.
+  bool invalidate(token_t tok);
+
+  // Ask for `tok`'s entry to be evicted late, until as many
+  // `release()`s.  Can precede the entry's first store.
+  void retain(token_t tok);
+  void release(token_t tok);
+
+  struct kind_counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;  // of entries holding one
+  };
+  struct counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes;
+    size_t budget;
+    size_t entries;
+    size_t held;  // tokens retained
+    // The above, by `result_kind`.
+    std::array<kind_counters, k_result_kinds> by_kind;
+  };
+  [[nodiscard]] counters stats() const;
+
+ private:
+  static constexpr size_t k_shards = 16;
+
+  template <typename T>
+  struct slot {
+    ptr<T> value;
+    size_t bytes{};
+  };
+
+  struct entry {
+    slot<compile_command> inference;
+    slot<compilation_result> assembly;  // `bytes` counts the keys too
+    std::string assembly_key;
+    std::string assembly_digest;
+    // By key; `bytes` count the keys too.
+    std::unordered_map<std::string, slot<std::string>> annotations;
+    // Logical time of last use, see `clock_`.
+    std::atomic<uint64_t> last_used{};
+
+    [[nodiscard]] size_t bytes() const;
+  };
+
+  struct alignas(64) shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<token_t, entry> entries;
+    std::unordered_map<token_t, uint32_t> holds;
+    // By `result_kind`.
+    std::array<std::atomic<uint64_t>, k_result_kinds> hits{};
+    std::array<std::atomic<uint64_t>, k_result_kinds> misses{};
+  };
+
+  struct alignas(64) key_shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string, token_t> tokens;
+  };
+
+  using key_index = std::array<key_shard, k_shards>;
+
+  shard& shard_of(token_t tok);
+  static key_shard& key_shard_of(key_index& index, const std::string& key);
+
+  // The value in the slot `find(entry&)` points to in `tok`'s entry, if
+  // any, counting a hit or a miss.
+  template <typename T, typename F>
+  ptr<T> get(token_t tok, F&& find);
+  // Set the slot `slot_in(entry&)` returns in `tok`'s entry to `value`,
+  // creating the entry if needed, then evict down to budget.  If `key`
+  // isn't null, it's swapped with the entry's `assembly_key`, and
+  // `asm_digest` with its `assembly_digest`.
+  template <typename T, typename F>
+  void put(
+      token_t tok, F&& slot_in, ptr<T> value, size_t bytes,
+      std::string* key = nullptr, std::string* asm_digest = nullptr);
+  void evict_over_budget(token_t keep);
+  static std::optional<token_t> find_key(
+      key_index& index, const std::string& key);
+  static void index_key(key_index& index, std::string key, token_t tok);
+  static void forget_key(
+      key_index& index, const std::string& key, token_t tok);
+
+  const size_t budget_;
+  std::array<shard, k_shards> shards_;
+  key_index assembly_keys_;
+  key_index annotation_keys_;
+  std::mutex evict_mutex_;  // one evictor at a time
+
+  // Advanced by 2 on each store, which stamps its entry with the new
+  // value.  Lookups stamp with the odd value just past it, so that they
+  // only write to an entry the first time it's used after a store.
+  std::atomic<uint64_t> clock_{0};
+  std::atomic<size_t> bytes_{0};
+  std::atomic<uint64_t> evictions_{0};
+  std::array<std::atomic<uint64_t>, k_result_kinds> kind_evictions_{};
+};
+
+}  // namespace xpto::blot
@@ -0,0 +1,177 @@
+#include "metrics.hpp"
+
+#include <fmt/format.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+#include "store.hpp"
+
+namespace xpto::blot {
+
+void latency_histogram::observe(std::chrono::steady_clock::duration d) {
+  auto seconds = std::chrono::duration<double>(d).count();
+  auto i = std::ranges::lower_bound(k_bounds, seconds) - k_bounds.begin();
+  counts_.at(static_cast<size_t>(i)).fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(
+      static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()),
+      std::memory_order_relaxed);
+}
+
+latency_histogram::snapshot latency_histogram::read() const {
+  snapshot s{};
+  uint64_t total{};
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    total += counts_[i].load(std::memory_order_relaxed);
+    s.buckets[i] = total;
+  }
+  s.sum = static_cast<double>(sum_ns_.load(std::memory_order_relaxed)) / 1e9;
+  return s;
+}
+
+int server_metrics::add_session(const std::atomic<uint64_t>& sent) {
+  std::lock_guard lk{sessions_mutex_};
+  auto id = ++next_session_;
+  sessions_.emplace(id, &sent);
+  return id;
+}
+
+void server_metrics::remove_session(int id) {
+  std::lock_guard lk{sessions_mutex_};
+  sessions_.erase(id);
+}
+
+// Bytes of memory resident, if the system says.
+static std::optional<size_t> resident_bytes() {
+#ifdef __linux__
+  std::ifstream statm{"/proc/self/statm"};
+  size_t pages{};
+  size_t resident{};
+  if (statm >> pages >> resident)
+    return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+  return std::nullopt;
+}
+
+static void header(
+    std::string& out, std::string_view name, std::string_view type,
+    std::string_view help) {
+  fmt::format_to(
+      std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help,
+      name, type);
+}
+
+template <typename T>
+static void gauge(
+    std::string& out, std::string_view name, std::string_view help,
+    T value) {
+  header(out, name, "gauge", help);
+  fmt::format_to(std::back_inserter(out), "{} {}\n", name, value);
+}
+
+std::string render_metrics(session_store& store) {
+  std::string out;
+  auto it = std::back_inserter(out);
+
+  static constexpr std::array<std::string_view, k_phases> k_phase_names{
+    "infer", "grab_asm", "annotate"};
+  header(
+      out, "blot_phase_duration_seconds", "histogram",
+      "Time requests took to get a phase's result, found cached or not.");
+  for (size_t p = 0; p < k_phases; ++p) {
+    for (size_t cached = 0; cached < 2; ++cached) {
+      auto labels = fmt::format(
+          R"(phase="{}",cached="{}")", k_phase_names.at(p),
+          cached ? "true" : "false");
+      auto s = store.metrics.latency.at(p).at(cached).read();
+      for (size_t i = 0; i < latency_histogram::k_bounds.size(); ++i)
+        fmt::format_to(
+            it, "blot_phase_duration_seconds_bucket{{{},le=\"{}\"}} {}\n",
+            labels, latency_histogram::k_bounds.at(i), s.buckets.at(i));
+      fmt::format_to(
+          it, "blot_phase_duration_seconds_bucket{{{},le=\"+Inf\"}} {}\n",
+          labels, s.buckets.back());
+      fmt::format_to(
+          it, "blot_phase_duration_seconds_sum{{{}}} {}\n", labels, s.sum);
+      fmt::format_to(
+          it, "blot_phase_duration_seconds_count{{{}}} {}\n", labels,
+          s.buckets.back());
+    }
+  }
+
+  // Inferences, assemblies and annotations are cached together, by
+  // token, but looked up apart.
+  static constexpr std::array<std::string_view, k_result_kinds> k_kind_names{
+    "inference", "assembly", "annotation"};
+  auto st = store.cache.stats();
+  for (auto [name, help, member] : {
+         std::tuple{
+           "blot_cache_hits_total", "Lookups that found a cached result.",
+           &result_cache::kind_counters::hits},
+         std::tuple{
+           "blot_cache_misses_total", "Lookups that found nothing cached.",
+           &result_cache::kind_counters::misses},
+         std::tuple{
+           "blot_cache_evictions_total",
+           "Cached results evicted to stay within budget.",
+           &result_cache::kind_counters::evictions}}) {
+    header(out, name, "counter", help);
+    for (size_t k = 0; k < k_result_kinds; ++k)
+      fmt::format_to(
+          it, "{}{{cache=\"{}\"}} {}\n", name, k_kind_names.at(k),
+          st.by_kind.at(k).*member);
+  }
+  gauge(
+      out, "blot_cache_bytes", "Approximate size of cached results.",
+      st.bytes);
+  gauge(
+      out, "blot_cache_budget_bytes", "Memory budget of the cache.",
+      st.budget);
+  gauge(out, "blot_cache_entries", "Tokens with cached results.", st.entries);
+
+  gauge(
+      out, "blot_compiles_running", "Compilers running now.",
+      store.metrics.compiles_running.load());
+  gauge(
+      out, "blot_compile_queue_depth",
+      "Requests waiting for compilations others are running.",
+      store.asm_flights.waiting());
+  gauge(
+      out, "blot_prefetch_queue_depth", "Files waiting to be prefetched.",
+      store.prefetch.stats().queued);
+
+  gauge(out, "blot_sessions", "Sessions connected.", store.sessions.load());
+  header(
+      out, "blot_session_sent_bytes_total", "counter",
+      "Bytes sent to each session connected.");
+  {
+    std::lock_guard lk{store.metrics.sessions_mutex_};
+    for (const auto& [id, sent] : store.metrics.sessions_)
+      fmt::format_to(
+          it, "blot_session_sent_bytes_total{{session=\"{}\"}} {}\n", id,
+          sent->load());
+  }
+
+  if (auto rss = resident_bytes())
+    gauge(
+        out, "process_resident_memory_bytes", "Resident memory size.", *rss);
+  return out;
+}
+
+}  // namespace xpto::blot
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace xpto::blot {
+
+struct session_store;
+
+// The phases of a request for assembly, timed apart.
+enum class phase : uint8_t { infer, grab_asm, annotate };
+constexpr size_t k_phases = 3;
+
+// Counts of durations under each of fixed bounds, and their sum, as a
+// Prometheus histogram wants them.  Lock-free.
+class latency_histogram {
+ public:
+  // Upper bounds of the buckets, in seconds, but for the last: +Inf.
+  static constexpr std::array<double, 14> k_bounds{
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+    0.25,  0.5,    1,     2.5,  5,     10,   30};
+
+  void observe(std::chrono::steady_clock::duration d);
+
+  struct snapshot {
+    // Cumulative, by bound, then all of them.
+    std::array<uint64_t, k_bounds.size() + 1> buckets;
+    double sum;  // in seconds
+  };
+  [[nodiscard]] snapshot read() const;
+
+ private:
+  std::array<std::atomic<uint64_t>, k_bounds.size() + 1> counts_{};
+  std::atomic<uint64_t> sum_ns_{0};
+};
+
+// What a server measures of itself, besides what its parts count
+// already.  See `render_metrics()`.
+struct server_metrics {
+  // How long requests took to get each phase's result, by phase, and
+  // whether it was found cached.  Results computed for another
+  // request, and waited for, count as computed.
+  std::array<std::array<latency_histogram, 2>, k_phases> latency;
+  void observe(
+      phase p, bool cached, std::chrono::steady_clock::duration d) {
+    latency.at(static_cast<size_t>(p))[cached ? 1 : 0].observe(d);
+  }
+
+  // Compilers running now, for sessions or prefetching.
+  std::atomic<int> compiles_running{0};
+
+  // Report `sent`, bytes sent to a session, until `remove_session()`
+  // with the id returned.
+  int add_session(const std::atomic<uint64_t>& sent);
+  void remove_session(int id);
+
+ private:
+  friend std::string render_metrics(session_store& store);
+  std::mutex sessions_mutex_;
+  int next_session_{};
+  std::map<int, const std::atomic<uint64_t>*> sessions_;
+};
+
+// Everything measured about `store`, and the process's resident
+// memory, in the Prometheus text exposition format.
+std::string render_metrics(session_store& store);
+
+}  // namespace xpto::blot
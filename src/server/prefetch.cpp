@@ -0,0 +1,252 @@
+#include "prefetch.hpp"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "auto.hpp"
+#include "blot/assembly.hpp"
+#include "blot/ccj.hpp"
+#include "blot/include_index.hpp"
+#include "json_helpers.hpp"
+#include "logger.hpp"
+#include "store.hpp"
+
+namespace xpto::blot {
+
+// Guesses made per suggestion, and files remembered as recently used.
+constexpr size_t k_max_candidates = 8;
+constexpr size_t k_max_recent = 8;
+
+static bool is_source_like(const fs::path& p) {
+  static constexpr std::array<std::string_view, 10> k_extensions{
+    ".c", ".cc", ".cpp", ".cxx", ".c++", ".h", ".hh", ".hpp", ".hxx", ".ipp"};
+  auto ext = p.extension().string();
+  return std::ranges::find(k_extensions, ext) != k_extensions.end();
+}
+
+static bool is_within(const fs::path& p, const fs::path& root) {
+  auto rel = p.lexically_relative(root);
+  return !rel.empty() && *rel.begin() != "..";
+}
+
+prefetcher::prefetcher(session_store& store, prefetch_options opts)
+: store_{store}, opts_{opts} {}
+
+prefetcher::~prefetcher() = default;
+
+prefetcher::pause_guard::pause_guard(prefetcher* p) : p_{p} {
+  if (!p_) return;
+  std::lock_guard lk{p_->mutex_};
+  ++p_->interactive_;
+  p_->job_stop_.request_stop();
+}
+
+prefetcher::pause_guard::~pause_guard() {
+  if (!p_) return;
+  std::lock_guard lk{p_->mutex_};
+  if (--p_->interactive_ == 0) p_->cv_.notify_all();
+}
+
+void prefetcher::suggest(
+    std::shared_ptr<project> proj, const fs::path& project_root,
+    const fs::path& file, const annotation_options& aopts) {
+  if (!enabled()) return;
+  auto files = candidates_(*proj, project_root, file);
+
+  std::lock_guard lk{mutex_};
+  std::erase(recent_, file);
+  recent_.push_front(file);
+  if (recent_.size() > k_max_recent) recent_.pop_back();
+
+  queue_.clear();
+  for (auto& f : files) queue_.push_back({proj, std::move(f), aopts});
+  LOG_DEBUG("prefetch: {} guesses after {}", queue_.size(), file.string());
+
+  if (!worker_.joinable())
+    worker_ = std::jthread{[this](std::stop_token stop) { run_(stop); }};
+  cv_.notify_all();
+}
+
+std::vector<fs::path> prefetcher::candidates_(
+    project& proj, const fs::path& project_root, const fs::path& file) {
+  std::vector<fs::path> out;
+  auto add = [&](const fs::path& p) {
+    if (out.size() >= k_max_candidates || p == file) return;
+    if (!is_within(p, project_root) || !is_source_like(p)) return;
+    if (std::ranges::find(out, p) != out.end()) return;
+    out.push_back(p);
+  };
+
+  // Its source or header counterpart, then the rest of the directory.
+  std::vector<fs::path> siblings;
+  std::error_code ec{};
+  for (const auto& de : fs::directory_iterator{file.parent_path(), ec}) {
+    if (de.is_regular_file(ec)) siblings.push_back(de.path());
+  }
+  std::ranges::sort(siblings);
+  for (const auto& p : siblings)
+    if (p.stem() == file.stem()) add(p);
+
+  for (const auto& tu : proj.index().includers(file)) add(tu);
+  for (const auto& inc : proj.index().included_files(file)) add(inc);
+  for (const auto& p : siblings) add(p);
+
+  std::lock_guard lk{mutex_};
+  for (const auto& p : recent_) add(p);
+  return out;
+}
+
+void prefetcher::run_(const std::stop_token& stop) {
+#ifdef __linux__
+  // Per thread on Linux.  Compilers spawned from here inherit it.
+  ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+  std::stop_callback on_stop{stop, [this] {
+                               std::lock_guard lk{mutex_};
+                               job_stop_.request_stop();
+                             }};
+
+  std::unique_lock lk{mutex_};
+  for (;;) {
+    if (!cv_.wait(lk, stop, [this] {
+          return !queue_.empty() && interactive_ == 0;
+        }))
+      return;
+    auto j = std::move(queue_.front());
+    queue_.pop_front();
+    if (store_.cache.stats().bytes > opts_.memory) {
+      LOG_DEBUG("prefetch: over memory budget, dropping guesses");
+      queue_.clear();
+      continue;
+    }
+    job_stop_ = std::stop_source{};
+    auto job_token = job_stop_.get_token();
+    busy_ = true;
+    lk.unlock();
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool done{true};
+    try {
+      done = warm_(j, job_token);
+    } catch (std::exception& e) {
+      LOG_DEBUG("prefetch: {} failed: {}", j.file.string(), e.what());
+    }
+    auto elapsed = std::chrono::steady_clock::now() - t0;
+
+    lk.lock();
+    busy_ = false;
+    if (done) {
+      ++warmed_;
+    } else {
+      ++preempted_;
+      queue_.push_front(std::move(j));
+    }
+    // Rest long enough for the time spent to be our share.
+    auto rest = elapsed * (100 - opts_.cpu_percent) / opts_.cpu_percent;
+    cv_.wait_for(lk, stop, rest, [] { return false; });
+  }
+}
+
+bool prefetcher::warm_(const job& j, const std::stop_token& stop) {
+  auto& cache = store_.cache;
+  infer_options iopts{};
+  iopts.stop = stop;
+  // One scan thread, so that resting for `cpu_percent` of wall time
+  // keeps to that share of one core.
+  iopts.jobs = 1;
+
+  auto infer_work = [&](const auto&) {
+    std::optional<compile_command> c{};
+    auto found = infer_all(*j.proj, j.file, k_includer_candidates, iopts);
+    if (stop.stop_requested()) throw flight_cancelled{"prefetch preempted"};
+    if (!found.empty()) c = std::move(found.front().command);
+    return c;
+  };
+  std::optional<compile_command> cmd{};
+  try {
+    cmd = store_.infer_flights.run(
+        infer_flight_key(j.file, iopts.backend), nullptr, infer_work, nullptr,
+        stop);
+  } catch (flight_cancelled&) {
+    // Ours, or some session's that went away.
+    return false;
+  }
+  if (!cmd) return true;
+
+  auto akey = assembly_key(*cmd);
+  std::pair<token_t, result_cache::ptr<compilation_result>> compiled{};
+  if (auto hit = cache.assembly_for(akey)) {
+    compiled = std::move(*hit);
+  } else {
+    auto compile_work = [&](const auto&) {
+      auto tok = next_token();
+      auto since = store_.watch.generation();
+      auto t0 = std::chrono::steady_clock::now();
+      ++store_.metrics.compiles_running;
+      AUTO(--store_.metrics.compiles_running);
+      result_cache::ptr<compilation_result> cr{};
+      try {
+        cr = std::make_shared<const compilation_result>(
+            get_asm(*cmd, {}, nullptr, stop));
+      } catch (compilation_cancelled& e) {
+        // Requests that joined us compile it themselves.
+        throw flight_cancelled{e.what()};
+      }
+      j.proj->record_compile_time(
+          cmd->file,
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - t0));
+      cache.put_inference(tok, *cmd);
+      cache.put_assembly(tok, akey, cr);
+      store_.watch.track(tok, dependencies(*j.proj, *cmd), since);
+      LOG_DEBUG("prefetch: compiled {} as token={}", j.file.string(), tok);
+      return std::pair{tok, cr};
+    };
+    try {
+      compiled =
+          store_.asm_flights.run(akey, nullptr, compile_work, nullptr, stop);
+    } catch (flight_cancelled&) {
+      return false;
+    }
+  }
+  if (stop.stop_requested()) return false;
+
+  const auto& [tok, cr] = compiled;
+  std::optional<fs::path> target{cmd->file};
+  std::string asm_digest;
+  if (!cache.assembly(tok, &asm_digest)) return true;  // evicted already
+  auto nkey = annotation_key(asm_digest, j.aopts, target);
+  if (!cache.annotation_for(nkey)) {
+    store_.annotate_flights.run(nkey, nullptr, [&](const auto&) {
+      auto res = std::make_shared<const std::string>(
+          json::serialize(annotate_to_json(cr->assembly, j.aopts, target)));
+      cache.put_annotation(tok, nkey, res);
+      return res;
+    });
+  }
+  return true;
+}
+
+prefetcher::counters prefetcher::stats() const {
+  std::lock_guard lk{mutex_};
+  return {
+    .warmed = warmed_,
+    .preempted = preempted_,
+    .queued = queue_.size(),
+    .busy = busy_};
+}
+
+}  // namespace xpto::blot
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+#include "blot/blot.hpp"
+#include "blot/project.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+struct session_store;
+
+struct prefetch_options {
+  // Share of one core prefetching may keep busy, in percent.  0 turns
+  // it off.
+  int cpu_percent{};
+  // No prefetching while cached results take more than this, in bytes.
+  size_t memory{};
+};
+
+// Guesses which files a client will look at after the one it just had
+// annotated, and infers, compiles and annotates them ahead of time into
+// a store's caches: the file's header or source counterpart, its
+// includers and includes in the project, its neighbours in the same
+// directory and the files looked at recently.
+//
+// Work happens one file at a time, in a thread of its own at the
+// lowest scheduling priority, which the compilers it runs inherit.  It
+// rests between files to stay within its CPU share, and doesn't start
+// while any interactive request is running.  One arriving abandons the
+// inference under way, if any, to retry the file later; a compilation
+// under way is left to finish, and joined if the request wants it too.
+class prefetcher {
+ public:
+  prefetcher(session_store& store, prefetch_options opts);
+  prefetcher(const prefetcher&) = delete;
+  prefetcher(prefetcher&&) = delete;
+  prefetcher& operator=(const prefetcher&) = delete;
+  prefetcher& operator=(prefetcher&&) = delete;
+  ~prefetcher();
+
+  // `file` was just annotated with `aopts`: forget earlier guesses and
+  // prefetch what's likely next.  Files outside `project_root` aren't
+  // considered.
+  void suggest(
+      std::shared_ptr<project> proj, const fs::path& project_root,
+      const fs::path& file, const annotation_options& aopts);
+
+  // Interactive requests hold one of these while they run.
+  class pause_guard {
+   public:
+    explicit pause_guard(prefetcher* p);
+    pause_guard(const pause_guard&) = delete;
+    pause_guard(pause_guard&&) = delete;
+    pause_guard& operator=(const pause_guard&) = delete;
+    pause_guard& operator=(pause_guard&&) = delete;
+    ~pause_guard();
+
+   private:
+    prefetcher* p_;
+  };
+  [[nodiscard]] pause_guard pause() {
+    return pause_guard{enabled() ? this : nullptr};
+  }
+
+  [[nodiscard]] bool enabled() const { return opts_.cpu_percent > 0; }
+
+  struct counters {
+    uint64_t warmed;     // files prefetched, or found cached already
+    uint64_t preempted;  // inferences abandoned for a request
+    size_t queued;
+    bool busy;
+  };
+  [[nodiscard]] counters stats() const;
+
+ private:
+  struct job {
+    std::shared_ptr<project> proj;
+    fs::path file;
+    annotation_options aopts;
+  };
+
+  void run_(const std::stop_token& stop);
+  // Fill the caches for `j`.  False if stopped before done.
+  bool warm_(const job& j, const std::stop_token& stop);
+  std::vector<fs::path> candidates_(
+      project& proj, const fs::path& project_root, const fs::path& file);
+
+  session_store& store_;
+  const prefetch_options opts_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable_any cv_;
+  std::deque<job> queue_;
+  std::deque<fs::path> recent_;
+  int interactive_{};  // requests running
+  bool busy_{};
+  std::stop_source job_stop_;
+  uint64_t warmed_{};
+  uint64_t preempted_{};
+  // Started by the first suggestion; last, so that it's joined first.
+  std::jthread worker_;
+};
+
+}  // namespace xpto::blot
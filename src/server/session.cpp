@@ -1,15 +1,25 @@
 #include "session.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <boost/json.hpp>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <type_traits>
+#include <utility>
 #include <variant>
+#include <vector>
 
+#include "blot/assembly.hpp"
 #include "blot/blot.hpp"
 #include "blot/ccj.hpp"
+#include "blot/include_index.hpp"
 #include "json_helpers.hpp"
 #include "linespan.hpp"
 #include "logger.hpp"
@@ -29,10 +39,23 @@ static long long duration_ms(clock_t::time_point t0) {
       .count();
 }
 
-static token_t next_token() {
-  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-  static std::atomic<int> counter{0};
-  return ++counter;
+// Inference running in the background for a blot/infer request, whose
+// handler waits for it until its budget runs out.
+struct infer_job {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool finished{};
+  bool detached{};  // the handler stopped waiting
+  std::optional<compile_command> cmd;
+  std::optional<std::string> error;
+};
+
+static json::object inference_to_json(const compile_command& cmd) {
+  json::object inf{};
+  inf["annotation_target"] = cmd.file.string();
+  inf["compilation_command"] = cmd.command;
+  inf["compilation_directory"] = cmd.directory.string();
+  return inf;
 }
 
 static annotation_options parse_aopts(const json::object* opts) {
@@ -51,43 +74,211 @@ static annotation_options parse_aopts(const json::object* opts) {
   return aopts;
 }
 
+// Unsaved contents of files, as in a request's "unsaved" param: an
+// array of {"file", "contents"} objects, with files relative to
+// `project_root` or absolute, but within it.
+static std::optional<error> parse_unsaved(
+    const json::object& params, const fs::path& project_root,
+    std::vector<file_overlay>& overlays) {
+  auto* unsaved = params.if_contains("unsaved");
+  if (!unsaved) return std::nullopt;
+  auto* arr = unsaved->if_array();
+  if (!arr) return error{-32602, "'unsaved' isn't an array"};
+  for (const auto& v : *arr) {
+    auto* o = v.if_object();
+    auto* file = o ? o->if_contains("file") : nullptr;
+    auto* contents = o ? o->if_contains("contents") : nullptr;
+    if (!file || !file->is_string() || !contents || !contents->is_string())
+      return error{-32602, "'unsaved' entries need 'file' and 'contents'"};
+    std::error_code ec{};
+    auto abs_file = fs::weakly_canonical(
+        project_root / std::string{file->get_string()}, ec);
+    if (ec || !abs_file.string().starts_with(project_root.string()))
+      return error{-32602, "path traversal denied"};
+    overlays.push_back({abs_file, std::string{contents->get_string()}});
+  }
+  return std::nullopt;
+}
+
 /// session members
 
-session::session(fs::path ccj_path, fs::path project_root)
-: ccj_path{std::move(ccj_path)}, project_root{std::move(project_root)} {}
+session::session(
+    std::shared_ptr<project> proj, fs::path project_root,
+    std::shared_ptr<session_store> store)
+: proj{std::move(proj)},
+  project_root{std::move(project_root)},
+  store{std::move(store)},
+  cache{this->store->cache} {
+  ++this->store->sessions;
+  metrics_id_ = this->store->metrics.add_session(bytes_sent_);
+}
+
+session::session(
+    const fs::path& ccj_path, fs::path project_root, size_t cache_budget)
+: session{
+    std::make_shared<project>(ccj_path), std::move(project_root),
+    std::make_shared<session_store>(cache_budget)} {}
+
+session::~session() {
+  stop_background_work();
+  for (auto tok : held_) cache.release(tok);
+  store->metrics.remove_session(metrics_id_);
+  --store->sessions;
+}
+
+void session::stop_background_work() {
+  // Stale results are no concern of ours anymore.
+  std::call_once(watch_once_, [] {});
+  if (watch_id_ >= 0) store->watch.unsubscribe(std::exchange(watch_id_, -1));
+  background_stop_.request_stop();
+  {
+    std::lock_guard lk{live_mutex_};
+    for (auto& [file, b] : live_) b.compiling.request_stop();
+  }
+  std::unique_lock lk{background_mutex_};
+  background_cv_.wait(lk, [this] { return background_jobs_ == 0; });
+}
 
-void session::reply_(const json::value& id, const jsonrpc_response_t& res) {
-  json::object msg = std::visit(
-      [&](auto&& x) {
+void session::hold_(token_t tok) {
+  {
+    std::lock_guard lk{held_mutex_};
+    if (held_.insert(tok).second) cache.retain(tok);
+  }
+  std::call_once(watch_once_, [this] {
+    watch_id_ = store->watch.subscribe(
+        [this](const invalidation& inv) { on_invalidated_(inv); });
+  });
+}
+
+void session::unhold_(token_t tok) {
+  std::lock_guard lk{held_mutex_};
+  if (held_.erase(tok)) cache.release(tok);
+}
+
+void session::on_invalidated_(const invalidation& inv) {
+  json::array tokens{};
+  {
+    std::lock_guard lk{held_mutex_};
+    for (auto tok : inv.tokens) {
+      if (held_.contains(tok)) tokens.emplace_back(tok);
+    }
+  }
+  if (tokens.empty()) return;
+
+  std::optional<json::object> view{};
+  if (recompile_on_change_) {
+    std::lock_guard lk{view_mutex_};
+    if (view_ && std::ranges::find(tokens, view_->at("token")) != tokens.end())
+      view = view_;
+  }
+  json::array files{};
+  for (const auto& f : inv.files) files.emplace_back(f.string());
+  json::object params{};
+  params["files"] = std::move(files);
+  params["tokens"] = std::move(tokens);
+  params["recompiling"] = view.has_value();
+  json::object msg{};
+  msg["jsonrpc"] = "2.0";
+  msg["method"] = "blot/invalidated";
+  msg["params"] = std::move(params);
+  send(msg);
+  if (!view) return;
+
+  // Compile and annotate again, as the client last asked, and send it
+  // the outcome as blot/updated.
+  {
+    std::lock_guard lk{background_mutex_};
+    ++background_jobs_;
+  }
+  std::thread{[this, params = std::move(*view)]() mutable {
+    auto busy = store->prefetch.pause();
+    auto quiet = [](std::string_view, std::string_view) {};
+    json::value tok = params.at("token");
+    json::object ap{};
+    ap["token"] = tok;
+    auto res = handle_grabasm(ap, quiet);
+    if (auto* compiled = std::get_if<json::object>(&res)) {
+      // Possibly someone else's compilation, under their token.
+      params["token"] = compiled->at("token");
+      res = handle_annotate(params, quiet);
+    }
+    if (!background_stop_.stop_requested()) {
+      std::string m =
+          R"({"jsonrpc":"2.0","method":"blot/updated","params":{"token":)";
+      m += json::serialize(tok);
+      m += ',';
+      m += outcome_text_(res);
+      m += "}}";
+      deliver_(m);
+    }
+    std::lock_guard lk{background_mutex_};
+    --background_jobs_;
+    background_cv_.notify_all();
+  }}.detach();
+}
+
+void session::send(const json::object& msg) {
+  deliver_(json::serialize(msg));
+}
+
+void session::deliver_(std::string_view text) {
+  bytes_sent_.fetch_add(text.size(), std::memory_order_relaxed);
+  send_raw(text);
+}
+
+std::string session::outcome_text_(const jsonrpc_response_t& res) {
+  // Whatever token our client gets, it may come back with.
+  const json::object* result = std::get_if<json::object>(&res);
+  if (auto* raw = std::get_if<raw_result>(&res)) result = &raw->extra;
+  if (result) {
+    if (auto* tok = result->if_contains("token"); tok && tok->is_int64())
+      hold_(tok->get_int64());
+  }
+  return std::visit(
+      [](const auto& x) {
         using t = std::decay_t<decltype(x)>;
         if constexpr (std::is_same_v<t, json::object>) {
-          json::object m{};
-          m["jsonrpc"] = "2.0";
-          m["id"] = id;
-          m["result"] = std::forward<decltype(x)>(x);
+          return R"("result":)" + json::serialize(x);
+        } else if constexpr (std::is_same_v<t, raw_result>) {
+          // Splice rather than parse and re-serialize: `body` can be
+          // tens of megabytes.
+          std::string m = R"("result":)";
+          m += json::serialize(x.extra);
+          std::string_view body = *x.body;
+          if (body.size() > 2) {
+            m.pop_back();
+            if (!x.extra.empty()) m += ',';
+            m += body.substr(1);
+          }
           return m;
         } else if constexpr (std::is_same_v<t, error>) {
           json::object err{};
           err["code"] = x.code;
           err["message"] = x.message;
           if (x.data) err["data"] = *x.data;
-          json::object m{};
-          m["jsonrpc"] = "2.0";
-          m["id"] = id;
-          m["error"] = std::move(err);
-          return m;
+          return R"("error":)" + json::serialize(err);
         } else {
           static_assert(!sizeof(t), "unhandled jsonrpc_response_t alternative");
         }
       },
       res);
-  send(msg);
+}
+
+std::string session::response_text_(
+    const json::value& id, const jsonrpc_response_t& res) {
+  std::string m = R"({"jsonrpc":"2.0","id":)";
+  m += json::serialize(id);
+  m += ',';
+  m += outcome_text_(res);
+  m += '}';
+  return m;
 }
 
 void session::send_progress_(
     const json::value& request_id, std::string_view phase,
-    std::string_view status, std::optional<long long> elapsed_ms) {
-  json::object params{};
+    std::string_view status, std::optional<long long> elapsed_ms,
+    json::object extra) {
+  json::object params{std::move(extra)};
   params["request_id"] = request_id;
   params["phase"] = phase;
   params["status"] = status;
@@ -102,46 +293,64 @@ void session::send_progress_(
 /// Handlers
 
 jsonrpc_response_t session::handle_initialize(
-    const json::object& /*params*/,
+    const json::object& params,
     std::invocable<
         std::string_view, std::string_view> auto&& /*send_progress*/) {
+  if (auto* r = params.if_contains("recompile_on_change"); r && r->is_bool())
+    recompile_on_change_ = r->get_bool();
+  if (auto* d = params.if_contains("debounce_ms")) {
+    auto* n = d->if_int64();
+    if (!n || *n < 0) return error{-32602, "invalid 'debounce_ms'"};
+    std::lock_guard lk{live_mutex_};
+    debounce_ = std::chrono::milliseconds{*n};
+  }
   json::object result{};
   json::object server_info{};
   server_info["name"] = "blot";
   server_info["version"] = "0.1";
   result["serverInfo"] = std::move(server_info);
-  result["ccj"] = ccj_path.string();
+  result["ccj"] = proj->ccj_path().string();
   result["project_root"] = project_root.string();
+  result["watching"] = store->watch.enabled();
   return result;
 }
 
 jsonrpc_response_t session::handle_infer(
-    const json::object& params,
+    const json::value& id, const json::object& params,
     std::invocable<std::string_view, std::string_view> auto&& send_progress) {
+  auto start = clock_t::now();
   token_t tok{};
   if (params.contains("token")) {
     tok = params.at("token").as_int64();
     std::optional<json::object> cached;
+    bool pending{};
     {
-      std::lock_guard lk{cache_mutex};
-      if (auto it = infer_cache_1.find(tok); it != infer_cache_1.end()) {
-        json::object result{};
-        result["token"] = tok;
-        result["cached"] = "token";
-        json::object inf{};
-        inf["annotation_target"] = it->second.cmd.file.string();
-        inf["compilation_command"] = it->second.cmd.command;
-        inf["compilation_directory"] = it->second.cmd.directory.string();
-        result["inference"] = std::move(inf);
-        cached = std::move(result);
-      }
+      // Finished inferences are cached before they stop being pending.
+      std::lock_guard lk{store->pending_mutex};
+      pending = store->infer_pending.contains(tok);
+    }
+    if (auto inferred = pending ? nullptr : cache.inference(tok)) {
+      json::object result{};
+      result["token"] = tok;
+      result["cached"] = "token";
+      result["inference"] = inference_to_json(*inferred);
+      cached = std::move(result);
     }
     if (cached) {
       LOG_DEBUG("infer cache hit: token={}", tok);
       send_progress("infer", "running");
       send_progress("infer", "cached", 0);
+      store->metrics.observe(phase::infer, true, clock_t::now() - start);
       return *cached;
     }
+    if (pending) {
+      LOG_DEBUG("infer still pending: token={}", tok);
+      json::object result{};
+      result["token"] = tok;
+      result["cached"] = false;
+      result["status"] = "pending";
+      return result;
+    }
     LOG_DEBUG("infer cache miss: token={} not found", tok);
     return error{-32602, "token not found in infer cache"};
   }
@@ -158,23 +367,130 @@ jsonrpc_response_t session::handle_infer(
   if (ec || !abs_file.string().starts_with(project_root.string()))
     return error{-32602, "path traversal denied"};
 
+  infer_options iopts{};
+  if (auto* b = params.if_contains("backend")) {
+    auto* name = b->if_string();
+    auto backend = name ? parse_infer_backend(*name) : std::nullopt;
+    if (!backend) return error{-32602, "unknown infer backend"};
+    iopts.backend = *backend;
+  }
+  std::optional<std::chrono::milliseconds> budget{};
+  if (auto* b = params.if_contains("budget_ms")) {
+    auto* n = b->if_int64();
+    if (!n || *n < 0) return error{-32602, "invalid 'budget_ms'"};
+    budget = std::chrono::milliseconds{*n};
+  }
+  iopts.stop = background_stop_.get_token();
+
   LOG_DEBUG("infer: token={}, file={}", tok, file_str);
   send_progress("infer", "running");
   auto t0 = clock_t::now();
 
+  // Let the index catch up with any edits, in the background.
+  proj->index().refresh_async();
+
+  // Of the includers found, annotate through the cheapest to compile.
+  // Requests for the same file share one search, and all get its
+  // "scanning" notifications.  If the session doing the search goes
+  // away, one of the others waiting for it starts over.
+  auto flight_key = infer_flight_key(abs_file, iopts.backend);
+  auto run = [this, id, flight_key, abs_file, iopts] {
+    auto relay = [this, id](const progress_note& n) {
+      send_progress_(id, n.phase, n.status, std::nullopt, n.extra);
+    };
+    auto work = [&](const auto& emit) {
+      auto opts = iopts;
+      opts.on_progress = [&emit](size_t scanned, size_t total) {
+        json::object extra{};
+        extra["scanned"] = scanned;
+        extra["total"] = total;
+        emit(progress_note{"infer", "scanning", std::move(extra)});
+      };
+      std::optional<compile_command> cmd{};
+      auto found = infer_all(*proj, abs_file, k_includer_candidates, opts);
+      if (opts.stop.stop_requested())
+        throw flight_cancelled{"inference cancelled"};
+      if (!found.empty()) cmd = std::move(found.front().command);
+      return cmd;
+    };
+    for (;;) {
+      try {
+        return store->infer_flights.run(
+            flight_key, relay, work, nullptr, iopts.stop);
+      } catch (flight_cancelled&) {
+        if (iopts.stop.stop_requested()) throw;
+      }
+    }
+  };
+
   std::optional<compile_command> cmd{};
-  try {
-    cmd = infer(ccj_path, abs_file);
-  } catch (std::exception& e) {
-    auto ms = duration_ms(t0);
+  std::optional<std::string> failure{};
+  if (!budget) {
+    try {
+      cmd = run();
+    } catch (std::exception& e) {
+      failure = e.what();
+    }
+  } else {
+    // Scan in a thread of its own, which reports back to the client by
+    // itself if we stop waiting for it.
+    auto job = std::make_shared<infer_job>();
+    {
+      std::lock_guard lk{background_mutex_};
+      ++background_jobs_;
+    }
+    std::thread{[this, job, run, id, tok, t0] {
+      std::optional<compile_command> cmd{};
+      std::optional<std::string> failure{};
+      try {
+        cmd = run();
+      } catch (std::exception& e) {
+        failure = e.what();
+      }
+      bool detached{};
+      {
+        std::lock_guard lk{job->mutex};
+        job->finished = true;
+        detached = job->detached;
+        if (!detached) {
+          job->cmd = std::move(cmd);
+          job->error = std::move(failure);
+        }
+        job->cv.notify_all();
+      }
+      if (detached) finish_background_infer_(id, tok, t0, cmd, failure);
+      std::lock_guard lk{background_mutex_};
+      --background_jobs_;
+      background_cv_.notify_all();
+    }}.detach();
+
+    std::unique_lock lk{job->mutex};
+    if (!job->cv.wait_for(lk, *budget, [&] { return job->finished; })) {
+      job->detached = true;
+      {
+        std::lock_guard plk{store->pending_mutex};
+        store->infer_pending.insert(tok);
+      }
+      LOG_DEBUG("infer: token={} over budget, continuing in background", tok);
+      json::object result{};
+      result["token"] = tok;
+      result["cached"] = false;
+      result["status"] = "pending";
+      return result;
+    }
+    cmd = std::move(job->cmd);
+    failure = std::move(job->error);
+  }
+
+  auto ms = duration_ms(t0);
+
+  if (failure) {
     send_progress("infer", "error", ms);
     json::object data{};
-    data["dribble"] = e.what();
+    data["dribble"] = *failure;
     return error{-32603, "infer() threw", std::move(data)};
   }
 
-  auto ms = duration_ms(t0);
-
   if (!cmd) {
     send_progress("infer", "error", ms);
     return error{-32602, "no CCJ entry found for file"};
@@ -182,99 +498,171 @@ jsonrpc_response_t session::handle_infer(
 
   send_progress("infer", "done", ms);
 
-  {
-    std::lock_guard lk{cache_mutex};
-    infer_cache_1[tok] = infer_entry{*cmd};
-    LOG_DEBUG("infer cache store: token={}, file={}", tok, cmd->file.string());
-  }
+  cache.put_inference(tok, *cmd);
+  LOG_DEBUG("infer cache store: token={}, file={}", tok, cmd->file.string());
 
   json::object result{};
   result["token"] = tok;
   result["cached"] = false;
-  json::object inf{};
-  inf["annotation_target"] = cmd->file.string();
-  inf["compilation_command"] = cmd->command;
-  inf["compilation_directory"] = cmd->directory.string();
-  result["inference"] = std::move(inf);
+  result["inference"] = inference_to_json(*cmd);
+  store->metrics.observe(phase::infer, false, clock_t::now() - start);
   return result;
 }
 
+void session::finish_background_infer_(
+    const json::value& id, token_t tok, clock_t::time_point t0,
+    const std::optional<compile_command>& cmd,
+    const std::optional<std::string>& failure) {
+  auto ms = duration_ms(t0);
+  if (cmd) cache.put_inference(tok, *cmd);
+  {
+    std::lock_guard lk{store->pending_mutex};
+    store->infer_pending.erase(tok);
+  }
+  // Cut short by the session going away: nobody's listening.
+  if (background_stop_.stop_requested()) return;
+
+  json::object extra{};
+  extra["token"] = tok;
+  if (cmd) {
+    LOG_DEBUG("infer: token={} done in background", tok);
+    extra["inference"] = inference_to_json(*cmd);
+    send_progress_(id, "infer", "done", ms, std::move(extra));
+  } else {
+    extra["message"] = failure ? *failure : "no CCJ entry found for file";
+    send_progress_(id, "infer", "error", ms, std::move(extra));
+  }
+}
+
 jsonrpc_response_t session::handle_grabasm(
     const json::object& params,
-    std::invocable<std::string_view, std::string_view> auto&& send_progress) {
+    std::invocable<std::string_view, std::string_view> auto&& send_progress,
+    const std::stop_token& stop) {
   LOG_DEBUG("grabasm ENTER in_flight={}", testing::inflight_frames().load());
+  auto start = clock_t::now();
 
-  // Phase 1: locked cache check
+  // Editor contents to compile instead of what's on disk.
+  std::vector<file_overlay> unsaved{};
+  if (auto e = parse_unsaved(params, project_root, unsaved)) return *e;
+
+  // Phase 1: cache check
   std::optional<json::object> cached;
   compile_command cmd;
   std::string cache_key;
   token_t tok{};
-  {
-    std::lock_guard lk{cache_mutex};
-    if (params.contains("token")) {
-      tok = params.at("token").as_int64();
-      if (auto it = asm_cache_1.find(tok); it != asm_cache_1.end()) {
-        LOG_DEBUG("grabasm cache hit (asm_cache_1): token={}", tok);
-        json::object result{};
-        result["token"] = tok;
-        result["cached"] = "token";
-        json::object cc{};
-        cc["compiler"] = it->second.result.invocation.compiler;
-        cc["compiler_version"] = it->second.result.invocation.compiler_version;
-        result["compilation_command"] = std::move(cc);
-        cached = std::move(result);
-      } else if (auto it2 = infer_cache_1.find(tok);
-                 it2 != infer_cache_1.end()) {
-        cmd = it2->second.cmd;
-      } else {
-        return error{-32602, "token not found in infer cache"};
+  if (params.contains("token")) {
+    tok = params.at("token").as_int64();
+    if (auto cr = unsaved.empty() ? cache.assembly(tok) : nullptr) {
+      LOG_DEBUG("grabasm cache hit (by token): token={}", tok);
+      json::object result{};
+      result["token"] = tok;
+      result["cached"] = "token";
+      json::object cc{};
+      cc["compiler"] = cr->invocation.compiler;
+      cc["compiler_version"] = cr->invocation.compiler_version;
+      result["compilation_command"] = std::move(cc);
+      cached = std::move(result);
+    } else if (auto inferred = cache.inference(tok)) {
+      cmd = *inferred;
+      if (!unsaved.empty()) {
+        // Not what `tok` compiles to: a token of its own.
+        tok = next_token();
+        cache.put_inference(tok, cmd);
       }
-    } else if (params.contains("inference")) {
-      auto& inf = params.at("inference").as_object();
-      cmd.command = std::string{inf.at("compilation_command").as_string()};
-      cmd.directory =
-          fs::path{std::string{inf.at("compilation_directory").as_string()}};
-      if (inf.contains("annotation_target"))
-        cmd.file =
-            fs::path{std::string{inf.at("annotation_target").as_string()}};
-      tok = next_token();
+    } else if (std::lock_guard lk{store->pending_mutex};
+               store->infer_pending.contains(tok)) {
+      return error{-32602, "inference still pending"};
     } else {
-      return error{-32602, "missing 'inference' or 'token'"};
+      return error{-32602, "token not found in infer cache"};
     }
+  } else if (params.contains("inference")) {
+    auto& inf = params.at("inference").as_object();
+    cmd.command = std::string{inf.at("compilation_command").as_string()};
+    cmd.directory =
+        fs::path{std::string{inf.at("compilation_directory").as_string()}};
+    if (inf.contains("annotation_target"))
+      cmd.file =
+          fs::path{std::string{inf.at("annotation_target").as_string()}};
+    tok = next_token();
+  } else {
+    return error{-32602, "missing 'inference' or 'token'"};
+  }
 
-    if (!cached) {
-      cache_key = cmd.command + '\0' + cmd.directory.string();
-      if (auto it = asm_cache_2.find(cache_key); it != asm_cache_2.end()) {
-        int cached_tok{it->second.first};
-        LOG_DEBUG("grabasm cache hit (asm_cache_2): tok={} -> cached_tok={}", tok, cached_tok);
-        const auto& cr = it->second.second.result;
-        json::object result{};
-        result["token"] = cached_tok;
-        result["cached"] = "other";
-        json::object cc{};
-        cc["compiler"] = cr.invocation.compiler;
-        cc["compiler_version"] = cr.invocation.compiler_version;
-        result["compilation_command"] = std::move(cc);
-        cached = std::move(result);
-      }
+  if (!cached) {
+    cache_key = assembly_key(cmd, unsaved);
+    if (auto hit = cache.assembly_for(cache_key)) {
+      auto& [cached_tok, cr] = *hit;
+      LOG_DEBUG(
+          "grabasm cache hit (by command): tok={} -> cached_tok={}", tok,
+          cached_tok);
+      json::object result{};
+      result["token"] = cached_tok;
+      result["cached"] = "other";
+      json::object cc{};
+      cc["compiler"] = cr->invocation.compiler;
+      cc["compiler_version"] = cr->invocation.compiler_version;
+      result["compilation_command"] = std::move(cc);
+      cached = std::move(result);
     }
   }
 
   if (cached) {
     send_progress("grabasm", "running");
     send_progress("grabasm", "cached", 0);
+    store->metrics.observe(phase::grab_asm, true, clock_t::now() - start);
     return *cached;
   }
 
-  // Phase 2: compile outside lock
+  // Phase 2: compile
   send_progress("grabasm", "running");
   auto t0 = clock_t::now();
 
-  LOG_DEBUG("grabasm COMPILE start in_flight={}", testing::inflight_frames().load());
-
-  compilation_result cr{};
+  // Identical compilations already under way are joined, not repeated.
+  // Whoever runs one caches the result, under its own token.
+  bool joined{};
+  std::pair<token_t, result_cache::ptr<compilation_result>> compiled{};
+  auto work = [&](const auto&) {
+    LOG_DEBUG(
+        "grabasm COMPILE start in_flight={}",
+        testing::inflight_frames().load());
+    auto since = store->watch.generation();
+    auto* sb =
+        unsaved.empty() ? nullptr : &store->unsaved_sandbox(project_root);
+    result_cache::ptr<compilation_result> cr{};
+    ++store->metrics.compiles_running;
+    AUTO(--store->metrics.compiles_running);
+    try {
+      cr = std::make_shared<const compilation_result>(
+          get_asm(cmd, unsaved, sb, stop));
+    } catch (compilation_cancelled& e) {
+      throw flight_cancelled{e.what()};
+    }
+    auto ms = duration_ms(t0);
+    LOG_DEBUG(
+        "grabasm COMPILE end in_flight={} ms={}",
+        testing::inflight_frames().load(), ms);
+    if (!cmd.file.empty())
+      proj->record_compile_time(cmd.file, std::chrono::milliseconds{ms});
+    cache.put_assembly(tok, cache_key, cr);
+    store->watch.track(tok, dependencies(*proj, cmd), since);
+    LOG_DEBUG(
+        "grabasm cache store: token={}, dir={}", tok, cmd.directory.string());
+    return std::pair{tok, cr};
+  };
   try {
-    cr = get_asm(cmd);
+    // If whoever compiles stops, those who joined them take over.
+    for (;;) {
+      try {
+        compiled = store->asm_flights.run(
+            cache_key, nullptr, work, &joined, stop);
+        break;
+      } catch (flight_cancelled&) {
+        if (stop.stop_requested()) throw;
+      }
+    }
+  } catch (flight_cancelled&) {
+    send_progress("grabasm", "cancelled", duration_ms(t0));
+    return error{-32800, "compilation cancelled"};
   } catch (compilation_error& e) {
     auto ms = duration_ms(t0);
     send_progress("grabasm", "error", ms);
@@ -292,31 +680,31 @@ jsonrpc_response_t session::handle_grabasm(
   }
 
   auto ms = duration_ms(t0);
-  LOG_DEBUG("grabasm COMPILE end in_flight={} ms={}", testing::inflight_frames().load(), ms);
   send_progress("grabasm", "done", ms);
-
-  // Phase 3: locked insert
-  asm_entry entry{cr};
-  {
-    std::lock_guard lk{cache_mutex};
-    asm_cache_1[tok] = entry;
-    asm_cache_2[cache_key] = {tok, entry};
-    LOG_DEBUG("grabasm cache store: token={}, dir={}", tok, cmd.directory.string());
-  }
+  const auto& [compiled_tok, cr] = compiled;
+  if (joined)
+    LOG_DEBUG(
+        "grabasm joined compilation: tok={} -> compiled_tok={}", tok,
+        compiled_tok);
 
   json::object result{};
-  result["token"] = tok;
-  result["cached"] = false;
+  result["token"] = compiled_tok;
+  if (joined)
+    result["cached"] = "other";
+  else
+    result["cached"] = false;
   json::object cc{};
-  cc["compiler"] = cr.invocation.compiler;
-  cc["compiler_version"] = cr.invocation.compiler_version;
+  cc["compiler"] = cr->invocation.compiler;
+  cc["compiler_version"] = cr->invocation.compiler_version;
   result["compilation_command"] = std::move(cc);
+  store->metrics.observe(phase::grab_asm, false, clock_t::now() - start);
   return result;
 }
 
 jsonrpc_response_t session::handle_annotate(
     const json::object& params,
     std::invocable<std::string_view, std::string_view> auto&& send_progress) {
+  auto start = clock_t::now();
   const json::object* opts_ptr{nullptr};
   if (params.contains("options")) {
     opts_ptr = params.at("options").if_object();
@@ -326,46 +714,79 @@ jsonrpc_response_t session::handle_annotate(
   if (!params.contains("token") && !params.contains("asm_blob"))
     return error{-32602, "missing 'token' or 'asm_blob'"};
 
-  std::string asm_blob;
+  // Either the request's own blob or a cached assembly, which is kept
+  // alive by `cached_asm` and not copied.
+  std::string_view asm_blob;
+  std::string asm_digest;
+  result_cache::ptr<compilation_result> cached_asm{};
   std::optional<fs::path> src_path{};
   token_t tok{};
 
   if (params.contains("token")) {
     tok = params.at("token").as_int64();
-    std::optional<json::object> cached;
-    {
-      std::lock_guard lk{cache_mutex};
-      if (auto it = annotate_cache_1.find(tok); it != annotate_cache_1.end()) {
-        json::object result{it->second.annotated};
-        result["token"] = tok;
-        result["cached"] = "token";
-        cached = std::move(result);
-      } else if (auto it2 = asm_cache_1.find(tok); it2 != asm_cache_1.end()) {
-        asm_blob = it2->second.result.assembly;
-        if (auto iit = infer_cache_1.find(tok); iit != infer_cache_1.end())
-          src_path = iit->second.cmd.file;
-      } else {
-        return error{-32602, "token not found in asm cache"};
-      }
-    }
-    if (cached) {
-      LOG_DEBUG("annotate cache hit: token={}", tok);
-      send_progress("annotate", "running");
-      send_progress("annotate", "cached", 0);
-      return *cached;
-    }
+    if (!(cached_asm = cache.assembly(tok, &asm_digest)))
+      return error{-32602, "token not found in asm cache"};
+    asm_blob = cached_asm->assembly;
+    // The token's own target, unless the assembly was found for another
+    // file's inference.
+    if (auto* t = params.if_contains("annotation_target");
+        t && t->is_string())
+      src_path = fs::path{std::string{t->get_string()}};
+    else if (auto inferred = cache.inference(tok))
+      src_path = inferred->file;
+    // What our client looks at now, to redo should it go stale.
+    json::object view{};
+    view["token"] = tok;
+    if (src_path) view["annotation_target"] = src_path->string();
+    if (opts_ptr) view["options"] = *opts_ptr;
+    std::lock_guard lk{view_mutex_};
+    view_ = std::move(view);
   } else {
-    asm_blob = std::string{params.at("asm_blob").as_string()};
-    tok = next_token();
+    asm_blob = params.at("asm_blob").as_string();
+    asm_digest = digest(asm_blob);
+  }
+
+  // Whatever the client looks at next is likely to be nearby.
+  if (src_path) store->prefetch.suggest(proj, project_root, *src_path, aopts);
+
+  // Whoever asks, the same text annotated the same way is the same
+  // answer.  Token callers keep their token.
+  auto key = annotation_key(asm_digest, aopts, src_path);
+  if (auto hit = cache.annotation_for(key)) {
+    auto& [cached_tok, annotated] = *hit;
+    LOG_DEBUG(
+        "annotate cache hit: token={} -> cached_tok={}", tok, cached_tok);
+    raw_result result{annotated};
+    result.extra["token"] = cached_asm ? tok : cached_tok;
+    if (cached_asm && cached_tok == tok)
+      result.extra["cached"] = "token";
+    else
+      result.extra["cached"] = "other";
+    send_progress("annotate", "running");
+    send_progress("annotate", "cached", 0);
+    store->metrics.observe(phase::annotate, true, clock_t::now() - start);
+    return result;
   }
+  if (!cached_asm) tok = next_token();
 
-  // Phase 2: annotate outside lock
+  // Phase 2: annotate
   send_progress("annotate", "running");
   auto t0 = clock_t::now();
 
-  json::object annotated{};
+  // Identical annotations requested at once are only computed once.
+  bool joined{};
+  result_cache::ptr<std::string> annotated{};
   try {
-    annotated = annotate_to_json(asm_blob, aopts, src_path);
+    annotated = store->annotate_flights.run(
+        key, nullptr,
+        [&](const auto&) {
+          auto res = std::make_shared<const std::string>(
+              json::serialize(annotate_to_json(asm_blob, aopts, src_path)));
+          cache.put_annotation(tok, key, res);
+          LOG_DEBUG("annotate cache store: token={}", tok);
+          return res;
+        },
+        &joined);
   } catch (std::exception& e) {
     auto ms = duration_ms(t0);
     send_progress("annotate", "error", ms);
@@ -377,48 +798,262 @@ jsonrpc_response_t session::handle_annotate(
   auto ms = duration_ms(t0);
   send_progress("annotate", "done", ms);
 
-  // Phase 3: locked insert
-  {
-    std::lock_guard lk{cache_mutex};
-    annotate_cache_1[tok] = annotate_entry{annotated};
-    LOG_DEBUG("annotate cache store: token={}", tok);
-  }
+  raw_result result{annotated};
+  result.extra["token"] = tok;
+  if (joined)
+    result.extra["cached"] = "other";
+  else
+    result.extra["cached"] = false;
+  store->metrics.observe(phase::annotate, false, clock_t::now() - start);
+  return result;
+}
 
-  json::object result{std::move(annotated)};
-  result["token"] = tok;
-  result["cached"] = false;
+jsonrpc_response_t session::handle_pipeline(
+    const json::value& id, const json::object& params,
+    std::invocable<std::string_view, std::string_view> auto&& send_progress) {
+  if (!params.contains("file")) return error{-32602, "missing 'file'"};
+
+  // Results of the stages before the last, which is the reply.
+  auto partial = [&](std::string_view stage, const json::object& result) {
+    if (auto* tok = result.if_contains("token"); tok && tok->is_int64())
+      hold_(tok->get_int64());
+    json::object p{};
+    p["request_id"] = id;
+    p["stage"] = stage;
+    p["result"] = result;
+    json::object msg{};
+    msg["jsonrpc"] = "2.0";
+    msg["method"] = "blot/partial";
+    msg["params"] = std::move(p);
+    send(msg);
+  };
+  auto failed = [](std::string_view stage, error e) {
+    if (!e.data) e.data = json::object{};
+    (*e.data)["stage"] = stage;
+    return e;
+  };
+
+  json::object ip{};
+  ip["file"] = params.at("file");
+  if (auto* b = params.if_contains("backend")) ip["backend"] = *b;
+  auto inferred = handle_infer(id, ip, send_progress);
+  if (auto* e = std::get_if<error>(&inferred))
+    return failed("infer", std::move(*e));
+  const auto& inference = std::get<json::object>(inferred);
+  partial("infer", inference);
+
+  json::object ap{};
+  ap["token"] = inference.at("token");
+  if (auto* u = params.if_contains("unsaved")) ap["unsaved"] = *u;
+  auto compiled = handle_grabasm(ap, send_progress);
+  if (auto* e = std::get_if<error>(&compiled))
+    return failed("grab_asm", std::move(*e));
+  const auto& assembly = std::get<json::object>(compiled);
+  partial("grab_asm", assembly);
+
+  json::object anp{};
+  anp["token"] = assembly.at("token");
+  anp["annotation_target"] =
+      inference.at("inference").as_object().at("annotation_target");
+  if (auto* o = params.if_contains("options")) anp["options"] = *o;
+  auto annotated = handle_annotate(anp, send_progress);
+  if (auto* e = std::get_if<error>(&annotated))
+    return failed("annotate", std::move(*e));
+  return annotated;
+}
+
+jsonrpc_response_t session::handle_stats(const json::object& /*params*/) {
+  auto st = cache.stats();
+  json::object c{};
+  c["hits"] = st.hits;
+  c["misses"] = st.misses;
+  c["evictions"] = st.evictions;
+  c["bytes"] = st.bytes;
+  c["budget"] = st.budget;
+  c["entries"] = st.entries;
+  c["held"] = st.held;
+  json::object result{};
+  result["cache"] = std::move(c);
+  result["sessions"] = store->sessions.load();
+  auto pst = store->prefetch.stats();
+  json::object pf{};
+  pf["warmed"] = pst.warmed;
+  pf["preempted"] = pst.preempted;
+  pf["queued"] = pst.queued;
+  pf["busy"] = pst.busy;
+  result["prefetch"] = std::move(pf);
+  auto wst = store->watch.stats();
+  json::object w{};
+  w["directories"] = wst.directories;
+  w["tokens"] = wst.tokens;
+  w["invalidated"] = wst.invalidated;
+  result["watch"] = std::move(w);
   return result;
 }
 
-bool session::handle_frame(std::string_view text) {
-  json::value msg_val{};
-{
-  std::error_code jec{};
-  msg_val = json::parse(text, jec);
-  if (jec) {
-    LOG_WARN("Ignoring odd JSONRPC frame: {}", text);
-    return true;
+jsonrpc_response_t session::handle_did_(
+    std::string_view method, const json::object& params) {
+  auto* file = params.if_contains("file");
+  if (!file || !file->is_string()) return error{-32602, "missing 'file'"};
+  std::error_code ec{};
+  auto abs_file = fs::weakly_canonical(
+      project_root / std::string{file->get_string()}, ec);
+  if (ec || !abs_file.string().starts_with(project_root.string()))
+    return error{-32602, "path traversal denied"};
+  bool closing = method == "blot/didClose";
+  auto* text = params.if_contains("text");
+  if (!closing && (!text || !text->is_string()))
+    return error{-32602, "missing 'text'"};
+  auto* version = params.if_contains("version");
+  if (version && !version->is_int64())
+    return error{-32602, "invalid 'version'"};
+
+  token_t shown{};
+  {
+    std::lock_guard lk{live_mutex_};
+    auto it = live_.find(abs_file);
+    if (closing) {
+      if (it == live_.end()) return error{-32602, "buffer not open"};
+      it->second.compiling.request_stop();
+      shown = it->second.shown;
+      live_.erase(it);
+    } else {
+      if (method == "blot/didChange" && it == live_.end())
+        return error{-32602, "buffer not open"};
+      auto& b = live_[abs_file];
+      // Whatever's compiling is outdated already.
+      b.compiling.request_stop();
+      b.text = text->get_string();
+      b.version = version ? version->get_int64() : b.version + 1;
+      b.seq = ++live_changes_;
+      if (auto* o = params.if_contains("options")) b.options = *o;
+      // Opened, it's shown at once; changed, once changes pause.
+      b.due = clock_t::now();
+      if (method == "blot/didChange") b.due += debounce_;
+      b.dirty = true;
+      if (!std::exchange(live_started_, true)) {
+        {
+          std::lock_guard blk{background_mutex_};
+          ++background_jobs_;
+        }
+        std::thread{[this] {
+          live_loop_();
+          std::lock_guard blk{background_mutex_};
+          --background_jobs_;
+          background_cv_.notify_all();
+        }}.detach();
+      }
+    }
+    live_cv_.notify_all();
   }
+  if (shown) unhold_(shown);
+  return json::object{};
 }
 
-  auto* msg = msg_val.if_object();
-  if (!msg) {
-    LOG_WARN("Ignoring non object JSON value in JSONRPC frame: {}", text);
-    return true;
+void session::live_loop_() {
+  auto stop = background_stop_.get_token();
+  std::unique_lock lk{live_mutex_};
+  while (!stop.stop_requested()) {
+    // The buffer waiting longest, if any is.
+    auto next = std::ranges::min_element(live_, {}, [](const auto& kv) {
+      return kv.second.dirty ? kv.second.due : clock_t::time_point::max();
+    });
+    auto seen = live_changes_;
+    auto changed = [&] { return live_changes_ != seen; };
+    if (next == live_.end() || !next->second.dirty) {
+      live_cv_.wait(lk, stop, changed);
+      continue;
+    }
+    if (clock_t::now() < next->second.due) {
+      live_cv_.wait_until(lk, stop, next->second.due, changed);
+      continue;
+    }
+
+    auto file = next->first;
+    next->second.dirty = false;
+    next->second.compiling = std::stop_source{};
+    auto b = next->second;
+    lk.unlock();
+    auto res = live_compile_(file, b, b.compiling.get_token());
+    lk.lock();
+
+    auto it = live_.find(file);
+    if (it == live_.end()) continue;
+    if (!it->second.inference) it->second.inference = b.inference;
+    // Changed meanwhile: only its latest version is worth showing.
+    if (it->second.seq != b.seq || stop.stop_requested()) continue;
+    token_t tok{};
+    const json::object* result = std::get_if<json::object>(&res);
+    if (auto* raw = std::get_if<raw_result>(&res)) result = &raw->extra;
+    if (result) {
+      if (auto* t = result->if_contains("token"); t && t->is_int64())
+        tok = t->get_int64();
+    }
+    auto shown = std::exchange(it->second.shown, tok);
+    lk.unlock();
+
+    std::string m =
+        R"({"jsonrpc":"2.0","method":"blot/live","params":{"file":)";
+    m += json::serialize(json::value(file.string()));
+    m += R"(,"version":)";
+    m += std::to_string(b.version);
+    m += ',';
+    m += outcome_text_(res);
+    m += "}}";
+    deliver_(m);
+    // What the client showed before is no more.
+    if (shown && shown != tok) unhold_(shown);
+    lk.lock();
+  }
+}
+
+jsonrpc_response_t session::live_compile_(
+    const fs::path& file, live_buffer& b, const std::stop_token& cancel) {
+  auto busy = store->prefetch.pause();
+  auto quiet = [](std::string_view, std::string_view) {};
+  if (!b.inference) {
+    json::object ip{};
+    ip["file"] = file.string();
+    auto inferred = handle_infer(nullptr, ip, quiet);
+    auto* inf = std::get_if<json::object>(&inferred);
+    if (!inf) return inferred;
+    // Kept for as long as we are.
+    hold_(inf->at("token").as_int64());
+    b.inference = std::move(*inf);
   }
+  if (cancel.stop_requested()) return error{-32800, "compilation cancelled"};
+
+  json::object buf{};
+  buf["file"] = file.string();
+  buf["contents"] = b.text;
+  json::object ap{};
+  ap["token"] = b.inference->at("token");
+  ap["unsaved"] = json::array{std::move(buf)};
+  auto compiled = handle_grabasm(ap, quiet, cancel);
+  auto* assembly = std::get_if<json::object>(&compiled);
+  if (!assembly) return compiled;
 
+  json::object anp{};
+  anp["token"] = assembly->at("token");
+  anp["annotation_target"] =
+      b.inference->at("inference").as_object().at("annotation_target");
+  if (b.options) anp["options"] = *b.options;
+  return handle_annotate(anp, quiet);
+}
+
+bool session::handle_request_(const json::object& msg, std::string& response) {
   json::value id{nullptr};
-  if (msg->contains("id")) id = msg->at("id");
+  if (msg.contains("id")) id = msg.at("id");
 
-  if (!msg->contains("method")) {
-    reply_(id, error{-32600, "missing method"});
+  if (!msg.contains("method")) {
+    response = response_text_(id, error{-32600, "missing method"});
     return true;
   }
 
-  std::string method{msg->at("method").as_string()};
+  std::string method{msg.at("method").as_string()};
   const json::object* params_ptr{nullptr};
-  if (msg->contains("params")) {
-    params_ptr = msg->at("params").if_object();
+  if (msg.contains("params")) {
+    params_ptr = msg.at("params").if_object();
   }
   json::object empty_params{};
   const json::object& params = params_ptr ? *params_ptr : empty_params;
@@ -436,21 +1071,85 @@ bool session::handle_frame(std::string_view text) {
   while (n > prev && !testing::inflight_high_water().compare_exchange_weak(prev, n)) {}
   AUTO(--testing::inflight_frames());
 
+  // Prefetching gives way to requests.
+  auto busy = store->prefetch.pause();
+
+  jsonrpc_response_t res{};
+  bool keep_going{true};
   if (method == "initialize") {
-    reply_(id, handle_initialize(params, sp));
+    res = handle_initialize(params, sp);
   } else if (method == "blot/infer") {
-    reply_(id, handle_infer(params, sp));
+    res = handle_infer(id, params, sp);
   } else if (method == "blot/grab_asm") {
-    reply_(id, handle_grabasm(params, sp));
+    res = handle_grabasm(params, sp);
   } else if (method == "blot/annotate") {
-    reply_(id, handle_annotate(params, sp));
+    res = handle_annotate(params, sp);
+  } else if (method == "blot/pipeline") {
+    res = handle_pipeline(id, params, sp);
+  } else if (method == "blot/stats") {
+    res = handle_stats(params);
+  } else if (
+      method == "blot/didOpen" || method == "blot/didChange" ||
+      method == "blot/didClose") {
+    res = handle_did_(method, params);
   } else if (method == "shutdown") {
-    reply_(id, json::object{});
-    return false;
+    res = json::object{};
+    keep_going = false;
   } else {
-    reply_(id, error{-32601, "Method not found"});
+    res = error{-32601, "Method not found"};
   }
-  return true;
+  response = response_text_(id, res);
+  return keep_going;
+}
+
+bool session::handle_frame(std::string_view text) {
+  json::value msg_val{};
+{
+  std::error_code jec{};
+  msg_val = json::parse(text, jec);
+  if (jec) {
+    LOG_WARN("Ignoring odd JSONRPC frame: {}", text);
+    return true;
+  }
+}
+
+  if (auto* batch = msg_val.if_array()) {
+    // Handled in order, and answered in one go, notifications aside.
+    if (batch->empty()) {
+      deliver_(response_text_(nullptr, error{-32600, "empty batch"}));
+      return true;
+    }
+    bool keep_going{true};
+    std::string responses{"["};
+    for (const auto& v : *batch) {
+      std::string response;
+      auto* msg = v.if_object();
+      if (msg)
+        keep_going = handle_request_(*msg, response);
+      else
+        response = response_text_(nullptr, error{-32600, "invalid request"});
+      if (!msg || msg->contains("id")) {
+        if (responses.size() > 1) responses += ',';
+        responses += response;
+      }
+      if (!keep_going) break;
+    }
+    responses += ']';
+    if (responses.size() > 2) deliver_(responses);
+    return keep_going;
+  }
+
+  auto* msg = msg_val.if_object();
+  if (!msg) {
+    LOG_WARN("Ignoring non object JSON value in JSONRPC frame: {}", text);
+    return true;
+  }
+
+  std::string response;
+  bool keep_going = handle_request_(*msg, response);
+  // Notifications aren't answered.
+  if (msg->contains("id")) deliver_(response);
+  return keep_going;
 }
 
 }  // namespace xpto::blot
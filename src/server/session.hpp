@@ -1,18 +1,27 @@
 #pragma once
 
+#include <atomic>
 #include <boost/json.hpp>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <stop_token>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <variant>
 
 #include "blot/assembly.hpp"
+#include "blot/project.hpp"
+#include "cache.hpp"
+#include "store.hpp"
 
 namespace json = boost::json;
 
@@ -20,71 +29,158 @@ namespace xpto::blot {
 
 namespace fs = std::filesystem;
 
-using token_t = int64_t;
+// How long edits of a buffer must pause for it to be compiled, unless
+// a client says otherwise.
+constexpr std::chrono::milliseconds k_default_debounce{200};
 
 struct error {
   int code;
   std::string message;
   std::optional<json::object> data{};
 };
-using jsonrpc_response_t = std::variant<json::object, error>;
-
-struct infer_entry {
-  compile_command cmd;
-};
-
-struct asm_entry {
-  compilation_result result;
-};
-
-struct annotate_entry {
-  json::object annotated;
+// A result some of whose members are already serialized, in `body`,
+// a JSON object.  Sent as is, after `extra`'s.
+struct raw_result {
+  result_cache::ptr<std::string> body;
+  json::object extra{};
 };
+using jsonrpc_response_t = std::variant<json::object, error, raw_result>;
 
 class session {
-  fs::path ccj_path;
+  std::shared_ptr<project> proj;
   fs::path project_root;
-  mutable std::mutex cache_mutex;
-  // FIXME: all four caches are unbounded — no eviction or capacity cap.
-  // Long-running sessions or projects with many TUs will grow without limit.
-  std::unordered_map<token_t, infer_entry> infer_cache_1;
-  std::unordered_map<token_t, asm_entry> asm_cache_1;
-  std::unordered_map<std::string, std::pair<int, asm_entry>> asm_cache_2;
-  // No annotate_cache_2: callers reuse the token returned by a grab_asm
-  // "other" hit to get a token-cache hit here.  A content-keyed cache would
-  // also need to account for annotation_options, complicating the key.
-  std::unordered_map<token_t, annotate_entry> annotate_cache_1;
-
-  void reply_(const json::value& id, const jsonrpc_response_t& res);
+  // Results and computations under way, possibly shared with other
+  // sessions.
+  std::shared_ptr<session_store> store;
+  result_cache& cache;
+
+  // Tokens handed out to our client, held in `cache` until we end.
+  std::mutex held_mutex_;
+  std::unordered_set<token_t> held_;
+
+  // Scans that may outlive the request that started them.
+  std::stop_source background_stop_;
+  std::mutex background_mutex_;
+  std::condition_variable background_cv_;
+  int background_jobs_{};
+
+  // Told by `store->watch` when results go stale, once we've handed
+  // some out.  If our client asked, we then redo the annotation it saw
+  // last, as given by these blot/annotate params.
+  std::once_flag watch_once_;
+  int watch_id_{-1};
+  std::atomic<bool> recompile_on_change_{false};
+  std::mutex view_mutex_;
+  std::optional<json::object> view_;
+
+  // Buffers our client edits, by file, as last sent by blot/didOpen or
+  // blot/didChange.  Each change is compiled and annotated once none
+  // followed for `debounce_`, by a thread of ours started with the
+  // first, and the outcome sent as blot/live.  One arriving stops the
+  // compilation of the version before.
+  struct live_buffer {
+    std::string text;
+    int64_t version{};
+    uint64_t seq{};  // of the change, among all
+    std::optional<json::value> options;
+    std::chrono::steady_clock::time_point due;
+    bool dirty{};  // changed since last compiled
+    std::stop_source compiling;
+    std::optional<json::object> inference;
+    token_t shown{};  // of the outcome last sent
+  };
+  std::mutex live_mutex_;
+  std::condition_variable_any live_cv_;
+  std::map<fs::path, live_buffer> live_;
+  uint64_t live_changes_{};
+  bool live_started_{};
+  std::chrono::milliseconds debounce_{k_default_debounce};
+
+  // Bytes sent to our client, reported in `store->metrics` under
+  // `metrics_id_`.
+  std::atomic<uint64_t> bytes_sent_{0};
+  int metrics_id_{};
+
+  // `send_raw()`, counting the bytes.
+  void deliver_(std::string_view text);
+  void hold_(token_t tok);
+  void unhold_(token_t tok);
+  void on_invalidated_(const invalidation& inv);
+  // `"result":...` or `"error":...`, holding any token in it.
+  std::string outcome_text_(const jsonrpc_response_t& res);
+  std::string response_text_(
+      const json::value& id, const jsonrpc_response_t& res);
+  // Handle one JSONRPC request, false if it was "shutdown".
+  bool handle_request_(const json::object& msg, std::string& response);
   void send_progress_(
       const json::value& id, std::string_view phase, std::string_view status,
-      std::optional<long long> elapsed_ms = std::nullopt);
+      std::optional<long long> elapsed_ms = std::nullopt,
+      json::object extra = {});
 
   jsonrpc_response_t handle_initialize(
       const json::object& params,
       std::invocable<std::string_view, std::string_view> auto&& send_progress);
   jsonrpc_response_t handle_infer(
-      const json::object& params,
+      const json::value& id, const json::object& params,
       std::invocable<std::string_view, std::string_view> auto&& send_progress);
+  // Cache and announce the outcome of an inference that outlived its
+  // request's budget.
+  void finish_background_infer_(
+      const json::value& id, token_t tok,
+      std::chrono::steady_clock::time_point t0,
+      const std::optional<compile_command>& cmd,
+      const std::optional<std::string>& failure);
+  // Compilations stop once `stop` is requested, with a -32800 error.
   jsonrpc_response_t handle_grabasm(
       const json::object& params,
-      std::invocable<std::string_view, std::string_view> auto&& send_progress);
+      std::invocable<std::string_view, std::string_view> auto&& send_progress,
+      const std::stop_token& stop = {});
   jsonrpc_response_t handle_annotate(
       const json::object& params,
       std::invocable<std::string_view, std::string_view> auto&& send_progress);
+  // Infer, grab_asm and annotate in one go, sending the results of the
+  // first two as blot/partial notifications.
+  jsonrpc_response_t handle_pipeline(
+      const json::value& id, const json::object& params,
+      std::invocable<std::string_view, std::string_view> auto&& send_progress);
+  jsonrpc_response_t handle_stats(const json::object& params);
+  // blot/didOpen, blot/didChange and blot/didClose.
+  jsonrpc_response_t handle_did_(
+      std::string_view method, const json::object& params);
+  void live_loop_();
+  // Infer, unless done already, compile and annotate `b`'s text.
+  jsonrpc_response_t live_compile_(
+      const fs::path& file, live_buffer& b, const std::stop_token& cancel);
 
  public:
   session(const session&) = delete;
   session(session&&) = delete;
   session& operator=(const session&) = delete;
   session& operator=(session&&) = delete;
-  virtual ~session() = default;
-
-  session(fs::path ccj_path, fs::path project_root);
-
-  virtual void send(const json::object& msg) = 0;
+  virtual ~session();
+
+  // `proj` and `store` are normally shared by all sessions of a server.
+  session(
+      std::shared_ptr<project> proj, fs::path project_root,
+      std::shared_ptr<session_store> store);
+  // A session of its own, whose cached results take up to
+  // `cache_budget` bytes.
+  session(
+      const fs::path& ccj_path, fs::path project_root,
+      size_t cache_budget = k_default_cache_budget);
+
+  // May be called concurrently, from threads other than the one
+  // handling frames.  `send_raw()` gets a serialized message.
+  virtual void send(const json::object& msg);
+  virtual void send_raw(std::string_view text) = 0;
 
   bool handle_frame(std::string_view text);
+
+ protected:
+  // Stop background scans and wait for them to wind down.  `send()` may
+  // be called meanwhile, so subclasses whose `send()` uses their own
+  // members must call this first thing in their destructor.
+  void stop_background_work();
 };
 
 namespace testing {
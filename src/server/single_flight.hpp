@@ -0,0 +1,140 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace xpto::blot {
+
+// Thrown out of shared work cut short because the session doing it
+// went away, and at callers that stopped waiting for it.  Requests of
+// other sessions waiting for it try again.
+struct flight_cancelled : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Coalesces concurrent computations of the same thing.  The first
+// caller of `run()` for some key does the work; callers arriving while
+// it's at it wait for it and get the same value, or the same exception.
+// Those can stop waiting with a stop token, but the work goes on.
+//
+// The work reports progress through an `emit(const Event&)` callback.
+// Every caller's `listener` sees all of it: events emitted before it
+// joined are replayed, in order, then live ones follow.  Listeners are
+// called from the thread doing the work, one at a time.
+template <typename Key, typename Value, typename Event>
+class single_flight {
+ public:
+  using listener_t = std::function<void(const Event&)>;
+  using emit_t = std::function<void(const Event&)>;
+
+  // `work` is called as `work(emit)` and returns a Value.  Sets
+  // `*joined`, if given, to whether someone else did the work.  If so,
+  // throws `flight_cancelled` once `stop` is requested, if before the
+  // work is done.
+  template <typename F>
+  Value run(
+      const Key& key, listener_t listener, F&& work, bool* joined = nullptr,
+      const std::stop_token& stop = {}) {
+    std::shared_ptr<flight> f;
+    std::promise<Value> promise;
+    bool leader{};
+    std::optional<typename std::list<listener_t>::iterator> mine;
+    {
+      std::lock_guard lk{mutex_};
+      auto& slot = flights_[key];
+      if (!slot) {
+        slot = std::make_shared<flight>();
+        slot->result = promise.get_future().share();
+        leader = true;
+      } else {
+        ++waiting_;
+      }
+      f = slot;
+    }
+    {
+      std::lock_guard lk{f->mutex};
+      if (listener) {
+        for (const auto& e : f->history) listener(e);
+        mine = f->listeners.insert(f->listeners.end(), std::move(listener));
+      }
+    }
+    if (joined) *joined = !leader;
+
+    if (leader) {
+      emit_t emit = [&f](const Event& e) {
+        std::lock_guard lk{f->mutex};
+        f->history.push_back(e);
+        for (const auto& l : f->listeners) l(e);
+      };
+      try {
+        promise.set_value(std::forward<F>(work)(emit));
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+      {
+        std::lock_guard lk{f->mutex};
+        f->done = true;
+      }
+      f->done_cv.notify_all();
+      std::lock_guard lk{mutex_};
+      flights_.erase(key);
+    } else {
+      struct leave {
+        single_flight& sf;
+        ~leave() {
+          std::lock_guard lk{sf.mutex_};
+          --sf.waiting_;
+        }
+      } l{*this};
+      std::unique_lock lk{f->mutex};
+      if (!f->done_cv.wait(lk, stop, [&f] { return f->done; })) {
+        // Whatever `listener` refers to may not outlive this.
+        if (mine) f->listeners.erase(*mine);
+        throw flight_cancelled{"stopped waiting"};
+      }
+      lk.unlock();
+      return f->result.get();
+    }
+    return f->result.get();
+  }
+
+  // Number of computations under way.
+  [[nodiscard]] size_t in_flight() const {
+    std::lock_guard lk{mutex_};
+    return flights_.size();
+  }
+
+  // Number of callers waiting for computations others are doing.
+  [[nodiscard]] size_t waiting() const {
+    std::lock_guard lk{mutex_};
+    return waiting_;
+  }
+
+ private:
+  struct flight {
+    std::mutex mutex;
+    std::vector<Event> history;
+    std::list<listener_t> listeners;
+    std::shared_future<Value> result;
+    bool done{};  // `result` is ready
+    std::condition_variable_any done_cv;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<Key, std::shared_ptr<flight>> flights_;
+  size_t waiting_{};
+};
+
+}  // namespace xpto::blot
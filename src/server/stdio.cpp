@@ -14,10 +14,16 @@
 #include <boost/json.hpp>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 
+#include "blot/include_index.hpp"
+#include "blot/project.hpp"
 #include "logger.hpp"
 #include "session.hpp"
+#include "store.hpp"
 
 namespace json = boost::json;
 namespace net = boost::asio;
@@ -27,20 +33,30 @@ namespace xpto::blot {
 namespace fs = std::filesystem;
 
 struct stdio_session : session {
-  stdio_session(const fs::path& ccj_path, const fs::path& project_root)
-      : session{ccj_path, project_root} {}
+  stdio_session(
+      std::shared_ptr<project> proj, const fs::path& project_root,
+      std::shared_ptr<session_store> store)
+      : session{std::move(proj), project_root, std::move(store)} {}
+  stdio_session(const stdio_session&) = delete;
+  stdio_session(stdio_session&&) = delete;
+  stdio_session& operator=(const stdio_session&) = delete;
+  stdio_session& operator=(stdio_session&&) = delete;
+  ~stdio_session() override { stop_background_work(); }
 
-  void send(const json::object& msg) override {
-    auto text = json::serialize(msg);
+  void send_raw(std::string_view text) override {
+    std::lock_guard lk{write_mutex};
     std::cout << "Content-Length: " << text.size() << "\r\n\r\n" << text;
     std::cout.flush();
   }
+
+ private:
+  std::mutex write_mutex;
 };
 
 static net::awaitable<void> stdio_loop(
-    net::posix::stream_descriptor* input, fs::path ccj_path,
-    fs::path project_root) {
-  stdio_session sess{ccj_path, project_root};
+    net::posix::stream_descriptor* input, std::shared_ptr<project> proj,
+    fs::path project_root, std::shared_ptr<session_store> store) {
+  stdio_session sess{std::move(proj), project_root, std::move(store)};
   net::streambuf buf;
   try {
     for (;;) {
@@ -81,12 +97,21 @@ static net::awaitable<void> stdio_loop(
 
 void run_stdio_server(
     net::io_context& ioc, const fs::path& ccj_path,
-    const fs::path& project_root) {
+    const fs::path& project_root, size_t cache_budget,
+    const prefetch_options& prefetch) {
   LOG_INFO("blot --stdio: project root: {}", project_root.string());
   LOG_INFO("blot --stdio: ccj          : {}", ccj_path.string());
 
+  auto proj = std::make_shared<project>(ccj_path);
+  proj->index().refresh_async();
+
+  auto store = std::make_shared<session_store>(cache_budget, prefetch);
+
   net::posix::stream_descriptor input{ioc, ::dup(STDIN_FILENO)};
-  net::co_spawn(ioc, stdio_loop(&input, ccj_path, project_root), net::detached);
+  net::co_spawn(
+      ioc,
+      stdio_loop(&input, std::move(proj), project_root, std::move(store)),
+      net::detached);
 }
 
 }  // namespace xpto::blot
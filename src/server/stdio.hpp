@@ -1,16 +1,23 @@
 #pragma once
 
 #include <boost/asio/io_context.hpp>
+#include <cstddef>
 #include <filesystem>
 
+#include "cache.hpp"
+#include "prefetch.hpp"
+
 namespace xpto::blot {
 
 // Start the JSONRPC stdio server.  Reads Content-Length-framed messages from
 // stdin and writes responses to stdout.  Blocks until the client sends
 // "shutdown" or stdin reaches EOF.  ccj_path must point to a valid
-// compile_commands.json file.
+// compile_commands.json file.  Results are cached within `cache_budget`
+// bytes, and prefetched as told by `prefetch`.
 void run_stdio_server(
     boost::asio::io_context& ioc, const std::filesystem::path& ccj_path,
-    const std::filesystem::path& project_root);
+    const std::filesystem::path& project_root,
+    std::size_t cache_budget = k_default_cache_budget,
+    const prefetch_options& prefetch = {});
 
 }  // namespace xpto::blot
@@ -0,0 +1,55 @@
+#include "store.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace xpto::blot {
+
+token_t next_token() {
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+  static std::atomic<int> counter{0};
+  return ++counter;
+}
+
+std::string infer_flight_key(const fs::path& file, infer_backend backend) {
+  return file.string() + '\0' + std::to_string(static_cast<int>(backend));
+}
+
+std::string assembly_key(
+    const compile_command& cmd, std::span<const file_overlay> overlays) {
+  auto key = cmd.command + '\0' + cmd.directory.string();
+  for (const auto& o : overlays) {
+    key += '\0' + o.file.string() + '\0';
+    key += digest(o.contents);
+  }
+  return key;
+}
+
+std::string annotation_key(
+    std::string_view asm_digest, const annotation_options& aopts,
+    const std::optional<fs::path>& target) {
+  // The options boiled down to a bitmask.
+  unsigned mask{};
+  unsigned bit{1};
+  for (bool b :
+       {aopts.preserve_directives, aopts.preserve_comments,
+        aopts.preserve_library_functions, aopts.preserve_unused_labels,
+        aopts.demangle}) {
+    if (b) mask |= bit;
+    bit <<= 1;
+  }
+  return fmt::format(
+      "{}:{:x}:{}", asm_digest, mask, target ? target->string() : "");
+}
+
+sandbox& session_store::unsaved_sandbox(const fs::path& project_root) {
+  std::lock_guard lk{sandbox_mutex};
+  if (!sandbox_ptr) sandbox_ptr = std::make_unique<sandbox>(project_root);
+  return *sandbox_ptr;
+}
+
+}  // namespace xpto::blot
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <boost/json.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "blot/assembly.hpp"
+#include "blot/blot.hpp"
+#include "blot/ccj.hpp"
+#include "blot/compile_command.hpp"
+#include "blot/sandbox.hpp"
+#include "cache.hpp"
+#include "metrics.hpp"
+#include "prefetch.hpp"
+#include "single_flight.hpp"
+#include "watch.hpp"
+
+namespace xpto::blot {
+
+namespace json = boost::json;
+namespace fs = std::filesystem;
+
+// How many includers of a header an inference weighs against each
+// other.
+constexpr size_t k_includer_candidates = 4;
+
+// A fresh token, unique in the process.
+token_t next_token();
+
+// Keys of computations and cached results.  An inference is identified
+// by its file and backend, an assembly by the command and directory it
+// was compiled with, and any unsaved files compiled instead of those
+// on disk, and an annotation by what was annotated, as the `digest()`
+// of its text, for which source file, and how.  Contents clients send
+// go in as SHA-256 digests.
+std::string infer_flight_key(const fs::path& file, infer_backend backend);
+std::string assembly_key(
+    const compile_command& cmd, std::span<const file_overlay> overlays = {});
+std::string annotation_key(
+    std::string_view asm_digest, const annotation_options& aopts,
+    const std::optional<fs::path>& target);
+
+// Progress of a computation shared by several requests, relayed to
+// each as a blot/progress notification.
+struct progress_note {
+  std::string phase;
+  std::string status;
+  json::object extra{};
+};
+
+// What the sessions of one server share: results by token, and the
+// computations under way that identical requests join.  Tokens are
+// handed out process-wide, so one session's are good in any other
+// sharing its store -- a second browser tab, or a reconnecting one.
+// Each session holds the tokens it handed out until it ends, which
+// keeps them in the cache longer than nobody's.
+struct session_store {
+  explicit session_store(
+      size_t cache_budget = k_default_cache_budget,
+      prefetch_options prefetch_opts = {})
+      : cache{cache_budget}, watch{cache}, prefetch{*this, prefetch_opts} {}
+
+  result_cache cache;
+  single_flight<std::string, std::optional<compile_command>, progress_note>
+      infer_flights;
+  single_flight<
+      std::string, std::pair<token_t, result_cache::ptr<compilation_result>>,
+      progress_note>
+      asm_flights;
+  single_flight<std::string, result_cache::ptr<std::string>, progress_note>
+      annotate_flights;
+
+  // Tokens of inferences still running after their budget ran out.
+  std::mutex pending_mutex;
+  std::unordered_set<token_t> infer_pending;
+
+  std::atomic<int> sessions{0};
+
+  // Drops results whose sources changed, and tells sessions.
+  file_watch watch;
+
+  // The project's source files as last listed, and the watched tree's
+  // generation then.
+  std::mutex files_mutex;
+  std::optional<std::pair<uint64_t, std::vector<std::string>>> source_files;
+
+  // Where compilers other than clang are shown unsaved files under
+  // `project_root`, made with the first that asks.
+  sandbox& unsaved_sandbox(const fs::path& project_root);
+  std::mutex sandbox_mutex;
+  std::unique_ptr<sandbox> sandbox_ptr;
+
+  // Latencies, compilers running, and bytes sent, for /api/metrics.
+  server_metrics metrics;
+
+  // Last, so that it stops before the rest goes away.
+  prefetcher prefetch;
+};
+
+}  // namespace xpto::blot
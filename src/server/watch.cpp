@@ -0,0 +1,316 @@
+#include "watch.hpp"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+#include <utility>
+
+#include "blot/include_index.hpp"
+#include "logger.hpp"
+
+namespace xpto::blot {
+
+// Events are acted upon once none came for this long, or this long
+// after the first, whichever comes first.
+constexpr auto k_quiet = std::chrono::milliseconds{50};
+constexpr auto k_max_delay = std::chrono::seconds{1};
+// How often the watcher thread checks whether it should stop.
+constexpr int k_poll_ms = 200;
+// Past this many watched directories, no more are watched.
+constexpr size_t k_max_directories = 8192;
+// Changes remembered for `track()`, beyond those of the last batch.
+constexpr size_t k_max_remembered = 4096;
+
+#ifdef __linux__
+// Directories holding dependencies: files written, or replaced.
+constexpr uint32_t k_content_mask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR;
+// Directories of a watched tree: entries coming and going.
+constexpr uint32_t k_tree_mask =
+    IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR;
+#endif
+
+std::vector<fs::path> dependencies(project& proj, const compile_command& cmd) {
+  if (cmd.file.empty()) return {};
+  auto tu = fs::absolute(cmd.directory / cmd.file).lexically_normal();
+  auto deps = proj.index().included_files(tu);
+  if (std::ranges::find(deps, tu) == deps.end()) deps.push_back(tu);
+  return deps;
+}
+
+file_watch::file_watch(result_cache& cache) : cache_{cache} {
+#ifdef __linux__
+  fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0)
+    LOG_WARN(
+        "Not watching files for changes: {}",
+        std::system_category().message(errno));
+#endif
+}
+
+file_watch::~file_watch() {
+  if (worker_.joinable()) {
+    worker_.request_stop();
+    worker_.join();
+  }
+#ifdef __linux__
+  if (fd_ >= 0) ::close(fd_);
+#endif
+}
+
+uint64_t file_watch::generation() const {
+  std::lock_guard lk{mutex_};
+  return generation_;
+}
+
+bool file_watch::add_watch_(const fs::path& dir, uint32_t mask) {
+#ifdef __linux__
+  if (!enabled()) return false;
+  auto& have = masks_[dir.string()];
+  if ((have & mask) == mask) return true;
+  if (have == 0 && dirs_.size() >= k_max_directories) {
+    masks_.erase(dir.string());
+    LOG_WARN("Watching too many directories, not {}", dir.string());
+    return false;
+  }
+  int wd = ::inotify_add_watch(fd_, dir.c_str(), mask | IN_MASK_ADD);
+  if (wd < 0) {
+    if (have == 0) masks_.erase(dir.string());
+    LOG_DEBUG("watch: can't watch {}", dir.string());
+    return false;
+  }
+  have |= mask;
+  dirs_[wd] = dir;
+  if (!worker_.joinable())
+    worker_ = std::jthread{[this](std::stop_token stop) { run_(stop); }};
+  return true;
+#else
+  (void)dir;
+  (void)mask;
+  return false;
+#endif
+}
+
+void file_watch::track(
+    token_t tok, const std::vector<fs::path>& files, uint64_t since) {
+  std::vector<fs::path> stale;
+  {
+    std::lock_guard lk{mutex_};
+    if (forgotten_ > since) {
+      // Whatever changed then, it may have been one of these.
+      stale = files;
+    } else {
+      for (const auto& f : files) {
+        auto it = changed_at_.find(f.string());
+        if (it != changed_at_.end() && it->second > since) stale.push_back(f);
+      }
+    }
+    if (stale.empty()) {
+      auto& deps = dependencies_[tok];
+      for (const auto& d : deps) dependents_[d].erase(tok);
+      deps.clear();
+      for (const auto& f : files) {
+        deps.push_back(f.string());
+        dependents_[f.string()].insert(tok);
+#ifdef __linux__
+        add_watch_(f.parent_path(), k_content_mask);
+#endif
+      }
+    }
+  }
+  // Compiled from files older than those on disk already.
+  if (!stale.empty()) invalidate_(std::move(stale), {tok});
+}
+
+void file_watch::changed(const std::vector<fs::path>& files) {
+  std::vector<fs::path> relevant;
+  std::vector<token_t> tokens;
+  {
+    std::lock_guard lk{mutex_};
+    ++generation_;
+    if (changed_at_.size() > k_max_remembered) {
+      changed_at_.clear();
+      forgotten_ = generation_ - 1;
+    }
+    for (const auto& f : files) {
+      changed_at_[f.string()] = generation_;
+      auto it = dependents_.find(f.string());
+      if (it == dependents_.end()) continue;
+      relevant.push_back(f);
+      for (auto tok : it->second) {
+        if (std::ranges::find(tokens, tok) == tokens.end())
+          tokens.push_back(tok);
+      }
+    }
+    // Forgotten until compiled again.
+    for (auto tok : tokens) {
+      auto node = dependencies_.extract(tok);
+      if (!node) continue;
+      for (const auto& d : node.mapped()) {
+        auto it = dependents_.find(d);
+        it->second.erase(tok);
+        if (it->second.empty()) dependents_.erase(it);
+      }
+    }
+  }
+  invalidate_(std::move(relevant), std::move(tokens));
+}
+
+void file_watch::invalidate_(
+    std::vector<fs::path> files, std::vector<token_t> tokens) {
+  if (tokens.empty()) return;
+  size_t n{};
+  for (auto tok : tokens) n += cache_.invalidate(tok) ? 1 : 0;
+  LOG_INFO(
+      "watch: {} changed, {} cached assemblies invalidated",
+      files.front().string(), n);
+  {
+    std::lock_guard lk{mutex_};
+    invalidated_ += n;
+  }
+  invalidation inv{std::move(files), std::move(tokens)};
+  std::lock_guard lk{listeners_mutex_};
+  for (const auto& [id, l] : listeners_) l(inv);
+}
+
+int file_watch::subscribe(listener on_invalidated) {
+  std::lock_guard lk{listeners_mutex_};
+  listeners_.emplace(next_listener_, std::move(on_invalidated));
+  return next_listener_++;
+}
+
+void file_watch::unsubscribe(int id) {
+  std::lock_guard lk{listeners_mutex_};
+  listeners_.erase(id);
+}
+
+void file_watch::watch_tree(const fs::path& root) {
+  std::lock_guard lk{mutex_};
+  tree_ = root;
+  tree_complete_ = true;
+  add_tree_(root);
+#ifdef __linux__
+  // Not the repository, but its index: `git ls-files` reads it.
+  std::error_code ec{};
+  if (fs::is_directory(root / ".git", ec) &&
+      !add_watch_(root / ".git", k_tree_mask))
+    tree_complete_ = false;
+#endif
+}
+
+void file_watch::add_tree_(const fs::path& dir) {
+#ifdef __linux__
+  if (!add_watch_(dir, k_tree_mask)) {
+    tree_complete_ = false;
+    return;
+  }
+  std::error_code ec{};
+  fs::recursive_directory_iterator it{
+    dir, fs::directory_options::skip_permission_denied, ec};
+  for (; !ec && it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+    if (!it->is_directory(ec) || it->is_symlink(ec)) continue;
+    if (it->path().filename().string().starts_with('.')) {
+      it.disable_recursion_pending();
+      continue;
+    }
+    if (!add_watch_(it->path(), k_tree_mask)) tree_complete_ = false;
+  }
+  if (ec) tree_complete_ = false;
+#else
+  (void)dir;
+  tree_complete_ = false;
+#endif
+}
+
+std::optional<uint64_t> file_watch::tree_generation() const {
+  std::lock_guard lk{mutex_};
+  if (!tree_ || !tree_complete_) return std::nullopt;
+  return tree_generation_;
+}
+
+void file_watch::run_(const std::stop_token& stop) {
+#ifdef __linux__
+  using clock = std::chrono::steady_clock;
+  alignas(inotify_event) std::array<char, 16 * 1024> buf{};
+  std::vector<fs::path> pending;
+  clock::time_point first{};
+  clock::time_point last{};
+
+  while (!stop.stop_requested()) {
+    auto now = clock::now();
+    if (!pending.empty() &&
+        (now - last >= k_quiet || now - first >= k_max_delay)) {
+      changed(std::exchange(pending, {}));
+      continue;
+    }
+    pollfd pfd{.fd = fd_, .events = POLLIN, .revents = 0};
+    int timeout =
+        pending.empty() ? k_poll_ms : static_cast<int>(k_quiet.count());
+    if (::poll(&pfd, 1, timeout) <= 0) continue;
+
+    for (;;) {
+      auto len = ::read(fd_, buf.data(), buf.size());
+      if (len <= 0) break;
+      std::lock_guard lk{mutex_};
+      for (ptrdiff_t off = 0; off < len;) {
+        inotify_event ev{};
+        std::memcpy(&ev, buf.data() + off, sizeof ev);
+        const char* name = buf.data() + off + sizeof ev;
+        off += static_cast<ptrdiff_t>(sizeof ev + ev.len);
+
+        if (ev.mask & IN_Q_OVERFLOW) {
+          // Lost track: anything may have changed.
+          LOG_WARN("watch: events lost, invalidating all");
+          for (const auto& [f, toks] : dependents_) pending.emplace_back(f);
+          ++tree_generation_;
+          continue;
+        }
+        auto it = dirs_.find(ev.wd);
+        if (it == dirs_.end()) continue;
+        if (ev.mask & IN_IGNORED) {
+          // Gone, or unwatched.
+          masks_.erase(it->second.string());
+          dirs_.erase(it);
+          continue;
+        }
+        if (ev.len == 0) continue;
+        auto path = it->second / name;
+
+        if (masks_[it->second.string()] & IN_CREATE) {
+          ++tree_generation_;
+          if ((ev.mask & IN_ISDIR) && (ev.mask & (IN_CREATE | IN_MOVED_TO)) &&
+              !path.filename().string().starts_with('.') &&
+              it->second.filename() != ".git")
+            add_tree_(path);
+        }
+        if (!(ev.mask & IN_ISDIR)) {
+          if (pending.empty()) first = clock::now();
+          pending.push_back(std::move(path));
+        }
+      }
+      last = clock::now();
+    }
+  }
+#else
+  (void)stop;
+#endif
+}
+
+file_watch::counters file_watch::stats() const {
+  std::lock_guard lk{mutex_};
+  return {
+    .directories = dirs_.size(),
+    .tokens = dependencies_.size(),
+    .invalidated = invalidated_};
+}
+
+}  // namespace xpto::blot
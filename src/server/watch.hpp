@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "blot/compile_command.hpp"
+#include "blot/project.hpp"
+#include "cache.hpp"
+
+namespace xpto::blot {
+
+namespace fs = std::filesystem;
+
+// Files a compilation of `cmd` read, as far as `proj`'s include index
+// knows: its main file, and whatever that includes.  Absolute and
+// lexically normal.  Just the main file if the index hasn't scanned it
+// yet.
+std::vector<fs::path> dependencies(project& proj, const compile_command& cmd);
+
+// Cached results gone stale because files they were built from changed.
+struct invalidation {
+  std::vector<fs::path> files;  // what changed
+  std::vector<token_t> tokens;  // whose assemblies were dropped
+};
+
+// Watches the files cached assemblies were compiled from, and drops
+// those assemblies, with their annotations, from a cache as soon as any
+// changes on disk.  Inferences stay: a dropped token can be compiled
+// again.  Listeners, normally sessions, then hear which tokens went.
+//
+// Optionally also watches a project's directory tree for files coming
+// and going, so that listings of it can be kept until it changes.
+//
+// Uses inotify, on directories rather than files, so that editors
+// saving by renaming a new file over the old one are noticed too.
+// Events are gathered until things are quiet for a moment, so that a
+// save is one invalidation, not several.  A thread reading them starts
+// with the first watch.  Elsewhere than on Linux, or if inotify can't
+// be had, nothing is watched: see `enabled()`.
+class file_watch {
+ public:
+  explicit file_watch(result_cache& cache);
+  file_watch(const file_watch&) = delete;
+  file_watch(file_watch&&) = delete;
+  file_watch& operator=(const file_watch&) = delete;
+  file_watch& operator=(file_watch&&) = delete;
+  ~file_watch();
+
+  [[nodiscard]] bool enabled() const { return fd_ >= 0; }
+
+  // Count of changes seen so far, to pass to `track()`.
+  [[nodiscard]] uint64_t generation() const;
+
+  // `tok`'s assembly was compiled from `files`, which were read after
+  // `generation()` returned `since`.  If any changed since, it's
+  // invalidated right away.
+  void track(token_t tok, const std::vector<fs::path>& files, uint64_t since);
+
+  // Act as if `files` just changed: invalidate whatever was built from
+  // them, and tell listeners.  What the watcher thread calls.
+  void changed(const std::vector<fs::path>& files);
+
+  // `on_invalidated` is called from the watcher thread, or whichever
+  // calls `changed()` or `track()`.  Once `unsubscribe()` returns it
+  // isn't anymore, nor is any call of it under way.
+  using listener = std::function<void(const invalidation&)>;
+  int subscribe(listener on_invalidated);
+  void unsubscribe(int id);
+
+  // Watch the directories under `root` for files appearing or going
+  // away.  Hidden directories are left out.
+  void watch_tree(const fs::path& root);
+  // Bumped when that happens.  Null if the tree isn't watched, and
+  // listings of it can't be trusted.
+  [[nodiscard]] std::optional<uint64_t> tree_generation() const;
+
+  struct counters {
+    size_t directories;  // watched
+    size_t tokens;       // tracked
+    uint64_t invalidated;
+  };
+  [[nodiscard]] counters stats() const;
+
+ private:
+  void run_(const std::stop_token& stop);
+  // Watch `dir` for `mask` events.  Under `mutex_`.
+  bool add_watch_(const fs::path& dir, uint32_t mask);
+  void add_tree_(const fs::path& dir);
+  void invalidate_(std::vector<fs::path> files, std::vector<token_t> tokens);
+
+  result_cache& cache_;
+  int fd_{-1};
+
+  mutable std::mutex mutex_;
+  std::unordered_map<int, fs::path> dirs_;  // by watch descriptor
+  std::unordered_map<std::string, uint32_t> masks_;  // by directory
+  std::unordered_map<std::string, std::unordered_set<token_t>> dependents_;
+  std::unordered_map<token_t, std::vector<std::string>> dependencies_;
+  // When files last changed, in `generation_`s, but for those that
+  // changed up to `forgotten_`, if no later.
+  std::unordered_map<std::string, uint64_t> changed_at_;
+  uint64_t forgotten_{};
+  uint64_t generation_{};
+  std::optional<fs::path> tree_;
+  uint64_t tree_generation_{};
+  bool tree_complete_{};
+  uint64_t invalidated_{};
+
+  std::mutex listeners_mutex_;
+  std::map<int, listener> listeners_;
+  int next_listener_{};
+
+  // Started by the first watch; last, so that it's joined first.
+  std::jthread worker_;
+};
+
+}  // namespace xpto::blot
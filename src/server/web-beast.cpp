@@ -17,9 +17,13 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 
+#include "blot/include_index.hpp"
+#include "blot/project.hpp"
 #include "logger.hpp"
 #include "session.hpp"
+#include "store.hpp"
 #include "web-dispatch.hpp"
 #include "web.hpp"
 
@@ -41,17 +45,23 @@ struct ws_session : session {
   std::mutex write_mutex;
   std::atomic<bool> shutdown_requested{false};
 
-  ws_session(stream_t ws, fs::path ccj_path, fs::path project_root)
-      : session{std::move(ccj_path), std::move(project_root)},
+  ws_session(
+      stream_t ws, std::shared_ptr<project> proj, fs::path project_root,
+      std::shared_ptr<session_store> store)
+      : session{std::move(proj), std::move(project_root), std::move(store)},
         ws{std::move(ws)} {
     this->ws.text(true);
   }
+  ws_session(const ws_session&) = delete;
+  ws_session(ws_session&&) = delete;
+  ws_session& operator=(const ws_session&) = delete;
+  ws_session& operator=(ws_session&&) = delete;
+  ~ws_session() override { stop_background_work(); }
 
-  void send(const json::object& msg) override {
-    auto text = json::serialize(msg);  // serialize before lock
+  void send_raw(std::string_view text) override {
     std::lock_guard lk{write_mutex};
     beast::error_code ec{};
-    ws.write(net::buffer(text), ec);
+    ws.write(net::buffer(text.data(), text.size()), ec);
     if (ec) LOG_INFO("ws_send error: {}", ec.message());
   }
 
@@ -92,7 +102,8 @@ net::awaitable<void> run_session(std::unique_ptr<ws_session> sess) {
 /// Connection handler
 
 net::awaitable<void> handle_connection(
-    tcp::socket socket, fs::path ccj_path, fs::path project_root) {
+    tcp::socket socket, std::shared_ptr<project> proj, fs::path project_root,
+    std::shared_ptr<session_store> store) {
   beast::tcp_stream stream{std::move(socket)};
   beast::flat_buffer buffer;
   for (;;) {
@@ -104,13 +115,13 @@ net::awaitable<void> handle_connection(
       websocket::stream<beast::tcp_stream> ws{std::move(stream)};
       co_await ws.async_accept(req, net::use_awaitable);
       LOG_INFO("ws session started");
-      auto sess =
-          std::make_unique<ws_session>(std::move(ws), ccj_path, project_root);
+      auto sess = std::make_unique<ws_session>(
+          std::move(ws), proj, project_root, store);
       co_await run_session(std::move(sess));
       co_return;
     }
 
-    response_t res = dispatch(req, ccj_path, project_root);
+    response_t res = dispatch(req, *proj, project_root, *store);
     LOG_INFO("→ {}", static_cast<unsigned>(res.result_int()));
     co_await http::async_write(stream, res, net::use_awaitable);
     if (!req.keep_alive()) break;
@@ -122,7 +133,8 @@ net::awaitable<void> handle_connection(
 /// Server loop
 
 net::awaitable<void> accept_loop(
-    tcp::acceptor acceptor, fs::path ccj_path, fs::path project_root) {
+    tcp::acceptor acceptor, std::shared_ptr<project> proj,
+    fs::path project_root, std::shared_ptr<session_store> store) {
   for (;;) {
     tcp::socket socket = co_await acceptor.async_accept(net::use_awaitable);
     boost::system::error_code ec;
@@ -132,22 +144,36 @@ net::awaitable<void> accept_loop(
         ec ? 0 : remote.port());
     net::co_spawn(
         acceptor.get_executor(),
-        handle_connection(std::move(socket), ccj_path, project_root),
+        handle_connection(
+            std::move(socket), proj, project_root, store),
         net::detached);
   }
 }
 
 int run_web_server(
     const net::any_io_executor& ex, const fs::path& ccj_path,
-    const fs::path& project_root, int port) {
+    const fs::path& project_root, int port, size_t cache_budget,
+    const prefetch_options& prefetch) {
   tcp::acceptor acceptor{
     ex, tcp::endpoint{tcp::v4(), static_cast<unsigned short>(port)}};
   acceptor.set_option(net::socket_base::reuse_address{true});
 
   int bound_port = static_cast<int>(acceptor.local_endpoint().port());
 
+  // One project model for the whole server, shared by every
+  // connection.  Its include index gets built in the background.
+  auto proj = std::make_shared<project>(ccj_path);
+  proj->index().refresh_async();
+  // Likewise results, so that tabs and reconnects reuse them.
+  auto store = std::make_shared<session_store>(cache_budget, prefetch);
+  // Whose file listings hold until files come or go.
+  store->watch.watch_tree(project_root);
+
   net::co_spawn(
-      ex, accept_loop(std::move(acceptor), ccj_path, project_root),
+      ex,
+      accept_loop(
+          std::move(acceptor), std::move(proj), project_root,
+          std::move(store)),
       net::detached);
   return bound_port;
 }
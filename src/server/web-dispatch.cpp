@@ -4,6 +4,11 @@
 #include <fstream>
 #include <web-config.hpp>
 
+#include "blot/project.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "store.hpp"
+
 namespace beast = boost::beast;
 namespace http = beast::http;
 namespace json = boost::json;
@@ -112,8 +117,8 @@ std::vector<std::string> list_source_files(const fs::path& root) {
 }
 
 response_t dispatch(
-    const request_t& req, const fs::path& ccj_path,
-    const fs::path& project_root) {
+    const request_t& req, project& proj, const fs::path& project_root,
+    session_store& store) {
   const auto version = req.version();
   const bool keep_alive = req.keep_alive();
   const auto target = std::string(req.target());
@@ -151,30 +156,46 @@ response_t dispatch(
   }
 
   if (req.method() == http::verb::get && target == "/api/status") {
-    // FIXME: reads and fully parses the entire compile_commands.json on every
-    // poll just to get the array length.  Cache the count (or the parsed
-    // value) and invalidate on file modification time change.
-    std::error_code ec;
-    auto entries = json::parse(
-        [&]() -> std::string {
-          std::ifstream f{ccj_path.string()};
-          return {std::istreambuf_iterator<char>{f}, {}};
-        }(),
-        ec);
+    // Only re-parses the ccj if it changed since the last poll.
+    size_t tu_count{};
+    try {
+      tu_count = proj.database()->size();
+    } catch (std::exception& e) {
+      LOG_WARN("/api/status: {}", e.what());
+    }
     json::object obj;
-    obj["ccj"] = ccj_path.string();
+    obj["ccj"] = proj.ccj_path().string();
     obj["project_root"] = project_root.string();
-    obj["tu_count"] = ec ? 0 : static_cast<int>(entries.as_array().size());
+    obj["tu_count"] = tu_count;
     return make_json_response(http::status::ok, obj, version, keep_alive);
   }
 
+  if (req.method() == http::verb::get && target == "/api/metrics") {
+    response_t res{http::status::ok, version};
+    res.set(http::field::content_type, "text/plain; version=0.0.4");
+    res.keep_alive(keep_alive);
+    res.body() = render_metrics(store);
+    res.prepare_payload();
+    return res;
+  }
+
   if (req.method() == http::verb::get && target == "/api/files") {
-    // FIXME: list_source_files() either forks git or walks the directory tree
-    // on every request with no caching.  Cache the result and invalidate on
-    // a directory-level mtime/inotify change.
-    auto srcs = list_source_files(project_root);
+    // list_source_files() forks git or walks the tree, so its result is
+    // kept until files come or go, if the tree is watched.
+    auto gen = store.watch.tree_generation();
+    std::optional<std::vector<std::string>> srcs{};
+    {
+      std::lock_guard lk{store.files_mutex};
+      if (gen && store.source_files && store.source_files->first == *gen)
+        srcs = store.source_files->second;
+    }
+    if (!srcs) {
+      srcs = list_source_files(project_root);
+      std::lock_guard lk{store.files_mutex};
+      if (gen) store.source_files.emplace(*gen, *srcs);
+    }
     json::object obj;
-    json::array arr(srcs.begin(), srcs.end());
+    json::array arr(srcs->begin(), srcs->end());
     obj["files"] = arr;
     return make_json_response(http::status::ok, obj, version, keep_alive);
   }
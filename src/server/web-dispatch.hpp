@@ -3,11 +3,14 @@
 #include <boost/beast/http.hpp>
 #include <filesystem>
 
+#include "blot/project.hpp"
+#include "store.hpp"
+
 namespace xpto::blot {
 using request_t = boost::beast::http::request<boost::beast::http::string_body>;
 using response_t =
     boost::beast::http::response<boost::beast::http::string_body>;
 response_t dispatch(
-    const request_t& req, const std::filesystem::path& ccj_path,
-    const std::filesystem::path& project_root);
+    const request_t& req, project& proj,
+    const std::filesystem::path& project_root, session_store& store);
 }  // namespace xpto::blot
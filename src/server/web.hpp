@@ -2,15 +2,23 @@
 
 #include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/io_context.hpp>
+#include <cstddef>
 #include <filesystem>
 
+#include "cache.hpp"
+#include "prefetch.hpp"
+
 namespace xpto::blot {
 
 // Set up the HTTP server: bind to port, co_spawn the accept loop.
 // Returns the actual bound port (useful when port=0 for auto-assignment).
+// WebSocket sessions share cached results, within `cache_budget` bytes,
+// and a prefetcher filling them as told by `prefetch`.
 int run_web_server(
     const boost::asio::any_io_executor& ex,
     const std::filesystem::path& ccj_path,
-    const std::filesystem::path& project_root, int port);
+    const std::filesystem::path& project_root, int port,
+    std::size_t cache_budget = k_default_cache_budget,
+    const prefetch_options& prefetch = {});
 
 }  // namespace xpto::blot
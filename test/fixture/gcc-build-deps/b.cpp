@@ -0,0 +1 @@
+#include "h.hpp"
@@ -0,0 +1,4 @@
+#pragma once
+#ifdef WANT
+#include "needle.hpp"
+#endif
@@ -0,0 +1 @@
+#include "needle.hpp"
@@ -0,0 +1,4 @@
+#pragma once
+
+// Leads nowhere, but decides what includers include after it.
+#define HAVE_X 1
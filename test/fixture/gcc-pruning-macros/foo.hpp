@@ -0,0 +1,6 @@
+#pragma once
+
+// Leads to needle-a.hpp unless the includer says otherwise.
+#ifndef FOO_LITE
+#include "needle-a.hpp"
+#endif
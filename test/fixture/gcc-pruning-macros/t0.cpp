@@ -0,0 +1,3 @@
+#define FOO_LITE
+#include "foo.hpp"
+#include "config.hpp"
@@ -0,0 +1,4 @@
+#include "config.hpp"
+#ifdef HAVE_X
+#include "needle-b.hpp"
+#endif
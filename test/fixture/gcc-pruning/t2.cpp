@@ -0,0 +1,2 @@
+#include "common.hpp"
+#include "needle.hpp"
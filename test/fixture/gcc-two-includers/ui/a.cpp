@@ -0,0 +1 @@
+#include "../net/foo.hpp"
@@ -4,10 +4,12 @@
 #include <filesystem>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "blot/assembly.hpp"
 #include "blot/blot.hpp"
 #include "blot/ccj.hpp"
+#include "blot/sandbox.hpp"
 #include "fixture.hpp"
 
 namespace fs = std::filesystem;
@@ -311,3 +313,77 @@ TEST_CASE("api_gcc_header_woes") {
   CHECK(!found_fixture_throwf);
   CHECK(!found_double_it);
 }
+
+TEST_CASE("api_clang_unsaved") {
+  auto fixture = fixture_dir("clang-demangle");
+  fs::current_path(fixture);
+
+  auto cmd = xpto::blot::infer("compile_commands.json", "source.cpp");
+  REQUIRE(cmd.has_value());
+  std::ifstream in{fixture / "source.cpp"};
+  std::string on_disk{std::istreambuf_iterator<char>{in}, {}};
+  std::vector<xpto::blot::file_overlay> unsaved{
+    {fixture / "source.cpp", on_disk + "\nint unsaved_fn() { return 7; }\n"}};
+
+  auto c_result = xpto::blot::get_asm(*cmd, unsaved);
+  CHECK(c_result.assembly.find("unsaved_fn") != std::string::npos);
+  CHECK(on_disk.find("unsaved_fn") == std::string::npos);
+
+  // Still annotated as the file on disk.
+  auto a_result = xpto::blot::annotate(
+      c_result.assembly, {}, fixture / "source.cpp");
+  bool found{};
+  for (auto& l : xpto::blot::apply_demanglings(a_result))
+    found = found || is_label_with(l, "unsaved_fn");
+  CHECK(found);
+
+  // GCC can't be lied to like that, not without a sandbox.
+  fs::current_path(fixture_dir("gcc-minimal"));
+  auto gcc_cmd = xpto::blot::infer("compile_commands.json", "source.cpp");
+  REQUIRE(gcc_cmd.has_value());
+  CHECK_THROWS_AS(
+      xpto::blot::get_asm(*gcc_cmd, unsaved), std::runtime_error);
+}
+
+TEST_CASE("api_sandbox_unsaved") {
+  auto fixture = fixture_dir("gcc-minimal");
+  fs::current_path(fixture);
+  xpto::blot::sandbox sb{fixture};
+  if (!sb.available()) {
+    MESSAGE("skipped: no user namespaces or overlayfs here");
+    return;
+  }
+
+  auto cmd = xpto::blot::infer("compile_commands.json", "source.cpp");
+  REQUIRE(cmd.has_value());
+  std::ifstream in{fixture / "source.cpp"};
+  std::string on_disk{std::istreambuf_iterator<char>{in}, {}};
+  auto compile = [&](const std::string& extra) {
+    std::vector<xpto::blot::file_overlay> unsaved{
+      {fixture / "source.cpp", on_disk + extra}};
+    return xpto::blot::get_asm(*cmd, unsaved, &sb).assembly;
+  };
+
+  // Same sandbox, updated in place.
+  auto first = compile("\nint unsaved_one() { return 1; }\n");
+  CHECK(first.find("unsaved_one") != std::string::npos);
+  auto second = compile("\nint unsaved_two() { return 2; }\n");
+  CHECK(second.find("unsaved_two") != std::string::npos);
+  CHECK(second.find("unsaved_one") == std::string::npos);
+
+  // Nothing reached the disk.
+  std::ifstream again{fixture / "source.cpp"};
+  CHECK(std::string{std::istreambuf_iterator<char>{again}, {}} == on_disk);
+
+  // A compiler it can't find costs only that run.
+  CHECK_THROWS_AS(
+      sb.run({}, "blot-no-such-compiler", {}, fixture), std::runtime_error);
+  CHECK(sb.available());
+  auto third = compile("\nint unsaved_three() { return 3; }\n");
+  CHECK(third.find("unsaved_three") != std::string::npos);
+
+  // Files elsewhere aren't for it.
+  std::vector<xpto::blot::file_overlay> outside{
+    {fixture_dir("clang-demangle") / "source.cpp", "int x;"}};
+  CHECK_THROWS_AS(sb.run(outside, "true", {}, fixture), std::runtime_error);
+}
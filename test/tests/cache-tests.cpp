@@ -0,0 +1,363 @@
+#include <doctest/doctest.h>
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <boost/json.hpp>
+#include <chrono>
+#include <filesystem>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "single_flight.hpp"
+#include "watch.hpp"
+
+namespace json = boost::json;
+
+namespace xpto::blot::tests {
+
+static compilation_result make_assembly(size_t bytes) {
+  compilation_result res{};
+  res.assembly.assign(bytes, 'x');
+  res.invocation.compiler = "c++";
+  return res;
+}
+
+static compile_command make_inference(const std::string& file) {
+  return {.directory = "/src", .command = "c++ -c " + file, .file = file};
+}
+
+TEST_CASE("cache_footprint") {
+  CHECK(footprint(make_assembly(10000)) > 10000);
+  CHECK(footprint(make_assembly(10000)) < 10000 + 1024);
+
+  json::object obj{};
+  obj["assembly"] = json::array{std::string(5000, 'a'), std::string(5000, 'b')};
+  CHECK(footprint(obj) > 10000);
+  CHECK(footprint(json::value{obj}) > footprint(obj));
+}
+
+TEST_CASE("cache_hits_and_misses") {
+  result_cache cache{};
+  cache.put_inference(1, make_inference("a.cpp"));
+  CHECK(cache.inference(1)->file == "a.cpp");
+  CHECK(!cache.assembly(1));
+  CHECK(!cache.inference(2));
+
+  auto st = cache.stats();
+  CHECK(st.hits == 1);
+  CHECK(st.misses == 2);
+  CHECK(st.evictions == 0);
+  CHECK(st.entries == 1);
+  CHECK(st.bytes >= footprint(make_inference("a.cpp")));
+
+  auto& inferences = st.by_kind[static_cast<size_t>(result_kind::inference)];
+  auto& assemblies = st.by_kind[static_cast<size_t>(result_kind::assembly)];
+  CHECK(inferences.hits == 1);
+  CHECK(inferences.misses == 1);
+  CHECK(assemblies.hits == 0);
+  CHECK(assemblies.misses == 1);
+}
+
+TEST_CASE("cache_evicts_least_recently_used") {
+  result_cache cache{250000};
+  cache.put_assembly(1, "one", make_assembly(100000));
+  cache.put_assembly(2, "two", make_assembly(100000));
+  CHECK(cache.assembly(1));  // 2 is now least recently used
+
+  cache.put_assembly(3, "three", make_assembly(100000));
+  CHECK(cache.assembly(1));
+  CHECK(!cache.assembly(2));
+  CHECK(cache.assembly(3));
+  CHECK(!cache.assembly_for("two"));
+  CHECK(cache.assembly_for("three")->first == 3);
+
+  auto st = cache.stats();
+  CHECK(st.evictions == 1);
+  CHECK(st.by_kind[static_cast<size_t>(result_kind::assembly)].evictions == 1);
+  CHECK(st.by_kind[static_cast<size_t>(result_kind::inference)].evictions == 0);
+  CHECK(st.bytes <= st.budget);
+}
+
+TEST_CASE("cache_evicts_token_chains_whole") {
+  result_cache cache{250000};
+  cache.put_inference(1, make_inference("a.cpp"));
+  cache.put_assembly(1, "one", make_assembly(100000));
+  cache.put_annotation(1, "ann", std::string(1000, 'a'));
+  cache.put_assembly(2, "two", make_assembly(100000));
+
+  // Evicting 1 drops its inference too, not just the assembly, so it
+  // can't be annotated for the wrong file later.
+  cache.put_assembly(3, "three", make_assembly(100000));
+  CHECK(!cache.inference(1));
+  CHECK(!cache.assembly(1));
+  CHECK(!cache.annotation_for("ann"));
+  CHECK(!cache.assembly_for("one"));
+  CHECK(cache.assembly(2));
+}
+
+TEST_CASE("cache_keeps_latest_entry_over_budget") {
+  result_cache cache{1000};
+  cache.put_assembly(1, "one", make_assembly(5000));
+  CHECK(cache.assembly(1));
+  cache.put_assembly(2, "two", make_assembly(5000));
+  CHECK(!cache.assembly(1));
+  CHECK(cache.assembly(2));
+  CHECK(cache.stats().entries == 1);
+}
+
+TEST_CASE("cache_evicts_held_tokens_last") {
+  result_cache cache{250000};
+  cache.retain(1);
+  cache.put_assembly(1, "one", make_assembly(100000));
+  cache.put_assembly(2, "two", make_assembly(100000));
+  CHECK(cache.assembly(2));  // 1 is least recently used, but held
+
+  cache.put_assembly(3, "three", make_assembly(100000));
+  CHECK(!cache.assembly(2));
+  CHECK(cache.stats().entries == 2);
+  CHECK(cache.stats().held == 1);
+
+  cache.release(1);
+  CHECK(cache.stats().held == 0);
+  cache.put_assembly(4, "four", make_assembly(100000));
+  CHECK(!cache.assembly(1));
+  CHECK(cache.assembly(3));
+}
+
+TEST_CASE("cache_command_index_follows_latest_assembly") {
+  result_cache cache{};
+  cache.put_assembly(1, "same", make_assembly(10));
+  cache.put_assembly(2, "same", make_assembly(20));
+  CHECK(cache.assembly_for("same")->first == 2);
+  cache.put_assembly(2, "other", make_assembly(20));
+  CHECK(!cache.assembly_for("same"));
+  CHECK(cache.assembly_for("other")->first == 2);
+}
+
+TEST_CASE("cache_annotations_by_key") {
+  result_cache cache{};
+  cache.put_assembly(1, "one", make_assembly(1000));
+  cache.put_annotation(1, "plain", R"({"demangled":false})");
+  cache.put_annotation(1, "demangled", R"({"demangled":true})");
+  cache.put_annotation(2, "blob", "{}");
+
+  auto hit = cache.annotation_for("plain");
+  REQUIRE(hit);
+  CHECK(hit->first == 1);
+  CHECK(*hit->second == R"({"demangled":false})");
+  CHECK(*cache.annotation_for("demangled")->second == R"({"demangled":true})");
+  CHECK(cache.annotation_for("blob")->first == 2);
+  CHECK(!cache.annotation_for("other"));
+  CHECK(cache.stats().entries == 2);
+}
+
+TEST_CASE("cache_invalidate_keeps_inference") {
+  result_cache cache{};
+  cache.put_inference(1, make_inference("a.cpp"));
+  cache.put_assembly(1, "one", make_assembly(1000));
+  cache.put_annotation(1, "ann", "{}");
+  cache.put_assembly(2, "two", make_assembly(1000));
+  auto bytes = cache.stats().bytes;
+
+  CHECK(cache.invalidate(1));
+  CHECK(!cache.invalidate(1));
+  CHECK(cache.inference(1));
+  CHECK(!cache.assembly(1));
+  CHECK(!cache.assembly_for("one"));
+  CHECK(!cache.annotation_for("ann"));
+  CHECK(cache.stats().bytes < bytes - 1000);
+
+  // Nothing would be left of 2.
+  CHECK(cache.invalidate(2));
+  CHECK(cache.stats().entries == 1);
+}
+
+TEST_CASE("cache_hits_share_values") {
+  result_cache cache{};
+  cache.put_assembly(1, "one", make_assembly(100000));
+  auto a = cache.assembly(1);
+  auto b = cache.assembly(1);
+  CHECK(a.get() == b.get());
+
+  // Still usable once evicted.
+  result_cache small{1000};
+  small.put_assembly(1, "one", make_assembly(5000));
+  auto kept = small.assembly(1);
+  small.put_assembly(2, "two", make_assembly(5000));
+  CHECK(!small.assembly(1));
+  CHECK(kept->assembly.size() == 5000);
+}
+
+TEST_CASE("cache_concurrent_stress") {
+  // Readers and writers hammering a cache small enough to evict all the
+  // time.  Mostly a job for sanitizers.
+  result_cache cache{20 * 1024};
+  std::vector<std::jthread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&cache, t] {
+      for (int i = 0; i < 2000; ++i) {
+        token_t tok = (i * 7 + t) % 64;
+        if (i % 10 == 0) {
+          cache.put_assembly(
+              tok, fmt::format("key{}", tok % 16), make_assembly(1000));
+        } else if (auto a = cache.assembly(tok)) {
+          CHECK(a->assembly.size() == 1000);
+        }
+        if (auto hit = cache.assembly_for(fmt::format("key{}", i % 16)))
+          CHECK(hit->second->assembly.size() == 1000);
+      }
+    });
+  }
+  threads.clear();
+  auto st = cache.stats();
+  CHECK(st.evictions > 0);
+  CHECK(st.entries > 0);
+}
+
+TEST_CASE("single_flight_coalesces") {
+  single_flight<std::string, int, std::string> flights;
+  std::atomic<int> runs{0};
+  std::atomic<bool> started{false};
+  std::vector<std::string> leader_saw;
+  std::vector<std::string> follower_saw;
+
+  std::jthread leader{[&] {
+    auto v = flights.run(
+        "key", [&](const std::string& e) { leader_saw.push_back(e); },
+        [&](const auto& emit) {
+          ++runs;
+          emit("first");
+          started = true;
+          std::this_thread::sleep_for(std::chrono::milliseconds{100});
+          emit("second");
+          return 42;
+        });
+    CHECK(v == 42);
+  }};
+  while (!started) std::this_thread::yield();
+
+  bool joined{};
+  auto v = flights.run(
+      "key", [&](const std::string& e) { follower_saw.push_back(e); },
+      [&](const auto&) {
+        ++runs;
+        return 0;
+      },
+      &joined);
+  leader.join();
+
+  CHECK(v == 42);
+  CHECK(joined);
+  CHECK(runs == 1);
+  // Joining late doesn't lose progress.
+  CHECK(follower_saw == std::vector<std::string>{"first", "second"});
+  CHECK(leader_saw == follower_saw);
+  CHECK(flights.in_flight() == 0);
+
+  // Failures are shared too, and don't stick.
+  CHECK_THROWS_AS(
+      flights.run(
+          "key", nullptr,
+          [](const auto&) -> int { throw std::runtime_error{"oops"}; }),
+      std::runtime_error);
+  CHECK(flights.run("key", nullptr, [](const auto&) { return 7; }) == 7);
+}
+
+TEST_CASE("single_flight_waiters_stop") {
+  // A caller waiting for someone else's work can give up on it, and the
+  // work goes on regardless, without telling it about progress anymore.
+  single_flight<std::string, int, std::string> flights;
+  std::atomic<bool> started{false};
+  std::atomic<bool> finish{false};
+  std::jthread leader{[&] {
+    auto v = flights.run("key", nullptr, [&](const auto& emit) {
+      started = true;
+      while (!finish) std::this_thread::yield();
+      emit(std::string{"late"});
+      return 42;
+    });
+    CHECK(v == 42);
+  }};
+  while (!started) std::this_thread::yield();
+
+  std::stop_source stop;
+  std::jthread stopper{[&] {
+    while (flights.waiting() == 0) std::this_thread::yield();
+    stop.request_stop();
+  }};
+  bool joined{};
+  std::atomic<int> heard{0};
+  CHECK_THROWS_AS(
+      flights.run(
+          "key", [&](const std::string&) { ++heard; },
+          [](const auto&) { return 0; }, &joined, stop.get_token()),
+      flight_cancelled);
+  CHECK(joined);
+  CHECK(flights.waiting() == 0);
+  CHECK(flights.in_flight() == 1);
+  finish = true;
+  leader.join();
+  CHECK(heard == 0);
+}
+
+TEST_CASE("watch_forgets_conservatively") {
+  // Changes too many to remember still make assemblies compiled before
+  // them stale, should they be tracked only afterwards.
+  result_cache cache{};
+  file_watch watch{cache};
+  cache.put_assembly(1, "one", make_assembly(10));
+  auto since = watch.generation();
+
+  std::vector<fs::path> checkout;
+  for (int i = 0; i < 5000; ++i)
+    checkout.emplace_back(fmt::format("/no/such/dir/file{}.cpp", i));
+  watch.changed(checkout);
+  watch.changed({"/no/such/dir/other.cpp"});
+
+  watch.track(1, {"/no/such/dir/source.cpp"}, since);
+  CHECK(!cache.assembly(1));
+  CHECK(watch.stats().invalidated == 1);
+}
+
+TEST_CASE("cache_throughput_benchmark" * doctest::skip()) {
+  // Not a test: run with --no-skip to see lookups scale with threads.
+  constexpr token_t k_tokens = 1024;
+  result_cache cache{};
+  for (token_t tok = 0; tok < k_tokens; ++tok) {
+    cache.put_inference(tok, make_inference("a.cpp"));
+    cache.put_assembly(tok, fmt::format("key{}", tok), make_assembly(4096));
+  }
+
+  for (unsigned n : {1U, 2U, 4U, 8U, 16U}) {
+    constexpr int k_ops = 200000;
+    std::atomic<bool> go{false};
+    std::vector<std::jthread> threads;
+    for (unsigned t = 0; t < n; ++t) {
+      threads.emplace_back([&, t] {
+        while (!go) std::this_thread::yield();
+        for (int i = 0; i < k_ops; ++i) {
+          auto tok = static_cast<token_t>((i * 31 + t * 7) % k_tokens);
+          // One store in a hundred, the rest lookups.
+          if (i % 100 == 0)
+            cache.put_inference(tok, make_inference("b.cpp"));
+          else
+            (void)cache.assembly(tok);
+        }
+      });
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    go = true;
+    threads.clear();
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+    MESSAGE(fmt::format(
+        "{:2} threads: {:.1f} Mops/s", n,
+        n * k_ops / secs.count() / 1e6));
+  }
+}
+
+}  // namespace xpto::blot::tests
@@ -1,4 +1,10 @@
+#pragma once
+
+#include <stdlib.h>
+
 #include <filesystem>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 
 namespace xpto::blot::tests {
@@ -12,4 +18,29 @@ inline fs::path fixture_dir(std::string_view name) {
 inline fs::path fixture_ccj(std::string_view name) {
   return fixture_dir(name) / "compile_commands.json";
 }
+
+// A directory of a test's own, for files it changes, removed with it.
+// Starts out empty, or as a copy of fixture `name`.
+class scratch_dir {
+ public:
+  explicit scratch_dir(std::string_view name = {}) {
+    auto tmpl = (fs::temp_directory_path() / "blot-test-XXXXXX").string();
+    if (!::mkdtemp(tmpl.data()))
+      throw std::runtime_error{"Can't create " + tmpl};
+    path_ = tmpl;
+    if (!name.empty())
+      fs::copy(fixture_dir(name), path_, fs::copy_options::recursive);
+  }
+  scratch_dir(const scratch_dir&) = delete;
+  scratch_dir& operator=(const scratch_dir&) = delete;
+  ~scratch_dir() {
+    std::error_code ec{};
+    fs::remove_all(path_, ec);
+  }
+
+  [[nodiscard]] const fs::path& path() const { return path_; }
+
+ private:
+  fs::path path_;
+};
 }
@@ -122,6 +122,40 @@ static net::awaitable<void> ws_send(
   co_await ws->send(req);
 }
 
+TEST_CASE_FIXTURE(http_fixture, "server_http_metrics") {
+  run_ioc_test(ioc, [&]() -> net::awaitable<void> {
+    auto ws = co_await connect_ws(http_server.port);
+    co_await ws_send(ws.get(), 1, "blot/infer", {{"file", "source.cpp"}});
+    auto infer_resp = co_await ws->recv_response();
+    REQUIRE(!infer_resp.contains("error"));
+    auto tok = infer_resp.at("result").as_object().at("token").as_int64();
+    co_await ws_send(ws.get(), 2, "blot/grab_asm", {{"token", tok}});
+    REQUIRE(!(co_await ws->recv_response()).contains("error"));
+    co_await ws_send(ws.get(), 3, "blot/grab_asm", {{"token", tok}});
+    REQUIRE(!(co_await ws->recv_response()).contains("error"));
+
+    auto client = connect_http(http_server.port);
+    auto resp = co_await client->get("/api/metrics");
+    REQUIRE(resp.status == 200);
+    auto has = [&](std::string_view line) {
+      return resp.body.find(line) != std::string::npos;
+    };
+    CHECK(has("# TYPE blot_phase_duration_seconds histogram\n"));
+    CHECK(has(
+        "blot_phase_duration_seconds_count"
+        "{phase=\"grab_asm\",cached=\"false\"} 1\n"));
+    CHECK(has(
+        "blot_phase_duration_seconds_count"
+        "{phase=\"grab_asm\",cached=\"true\"} 1\n"));
+    CHECK(has(
+        "blot_phase_duration_seconds_bucket"
+        "{phase=\"infer\",cached=\"false\",le=\"+Inf\"} 1\n"));
+    CHECK(has("blot_cache_hits_total{cache=\"assembly\"} "));
+    CHECK(has("blot_compiles_running 0\n"));
+    CHECK(has("blot_session_sent_bytes_total{session=\"1\"} "));
+  }());
+}
+
 TEST_CASE_FIXTURE(http_fixture, "server_ws_concurrent_grab_asm") {
   testing::inflight_high_water() = 0;
   run_ioc_test(ioc, [&]() -> net::awaitable<void> {
@@ -1,12 +1,24 @@
 #include <doctest/doctest.h>
+#include <fmt/format.h>
+#include <fmt/std.h>
 
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
 
 #include "blot/ccj.hpp"
+#include "blot/include_index.hpp"
+#include "blot/project.hpp"
+#include "depfile.hpp"
 #include "fixture.hpp"
+#include "scan_cache.hpp"
 
 namespace fs = std::filesystem;
 using xpto::blot::tests::fixture_dir;
+using xpto::blot::tests::scratch_dir;
 
 TEST_CASE("infer-basic") {
   // Test that infer finds the expected includer
@@ -87,3 +99,455 @@ TEST_CASE("infer-deep-inner-by-relative-path") {
   REQUIRE(result.has_value());
   CHECK(result->file.filename() == "source-2.cpp");
 }
+
+TEST_CASE("infer-parallel-matches-sequential") {
+  // However many workers scan the database, the lowest-index includer
+  // wins, exactly as in a one-at-a-time scan.
+  fs::path fixture = fixture_dir("gcc-deep-hierarchy");
+
+  for (unsigned jobs : {1U, 2U, 8U}) {
+    CAPTURE(jobs);
+    auto outer = xpto::blot::infer(
+        fixture / "compile_commands.json", fixture / "header.hpp",
+        {.jobs = jobs});
+    REQUIRE(outer.has_value());
+    CHECK(outer->file.filename() == "source-1.cpp");
+
+    auto inner = xpto::blot::infer(
+        fixture / "compile_commands.json", fixture / "inner" / "header.hpp",
+        {.jobs = jobs});
+    REQUIRE(inner.has_value());
+    CHECK(inner->file.filename() == "source-2.cpp");
+  }
+}
+
+TEST_CASE("infer-include-index") {
+  // Once refreshed, the index answers header lookups by itself, and
+  // infer() takes its word for it, while it holds.  The index is saved
+  // next to the database, so work on a copy of the fixture.
+  scratch_dir scratch{"gcc-deep-hierarchy"};
+  const auto& fixture = scratch.path();
+  std::ofstream{fixture / "compile_commands.json"} << fmt::format(
+      R"([{{"directory":"{0}","file":"source-1.cpp",)"
+      R"("arguments":["/usr/bin/c++","-c","source-1.cpp"]}},)"
+      R"({{"directory":"{0}","file":"source-2.cpp",)"
+      R"("arguments":["/usr/bin/c++","-c","source-2.cpp"]}}])",
+      fixture.string());
+  xpto::blot::project proj{fixture / "compile_commands.json"};
+  auto& index = proj.index();
+  index.refresh();
+  CHECK(index.complete());
+  CHECK(fs::exists(index.storage_path()));
+
+  auto inner = index.includers(fixture / "inner" / "header.hpp");
+  REQUIRE(inner.size() == 1);
+  CHECK(inner[0].filename() == "source-2.cpp");
+  CHECK(index.includers(fixture / "source-1.cpp").size() == 1);
+  CHECK(index.includers(fixture / "no-such-header.hpp").empty());
+
+  auto result = xpto::blot::infer(proj, fixture / "header.hpp");
+  REQUIRE(result.has_value());
+  CHECK(result->file.filename() == "source-1.cpp");
+
+  // A second index over the same database starts from the saved file.
+  xpto::blot::project reloaded{fixture / "compile_commands.json"};
+  reloaded.index().refresh();
+  CHECK(reloaded.index().includers(fixture / "inner" / "header.hpp") == inner);
+
+  // Once source-1.cpp stops including header.hpp, the index still says
+  // it does, until refreshed, but infer() doesn't believe it.
+  CHECK(index.fresh(fixture / "source-1.cpp"));
+  auto source1 = fixture / "source-1.cpp";
+  auto before = fs::last_write_time(source1);
+  std::ofstream{source1} << "int use_outer() { return 1; }\n";
+  fs::last_write_time(source1, before + std::chrono::seconds{1});
+  CHECK_FALSE(index.fresh(source1));
+  CHECK(index.includers(fixture / "header.hpp").size() == 1);
+  CHECK_FALSE(xpto::blot::infer(proj, fixture / "header.hpp").has_value());
+}
+
+TEST_CASE("infer-shares-file-cache") {
+  // Every scan over a project goes through one caching filesystem, so
+  // TUs probing the same compiler and header directories don't stat
+  // them again, and a later infer() doesn't either.
+  fs::path fixture = fixture_dir("gcc-deep-hierarchy");
+  xpto::blot::project proj{fixture / "compile_commands.json"};
+  auto& vfs = *proj.caches().fs;
+
+  auto first = xpto::blot::infer(proj, fixture / "inner" / "header.hpp");
+  REQUIRE(first.has_value());
+  auto after_first = vfs.stats();
+  CHECK(after_first.misses > 0);
+  CHECK(after_first.hits > 0);
+
+  auto second = xpto::blot::infer(proj, fixture / "inner" / "header.hpp");
+  REQUIRE(second.has_value());
+  CHECK(second->file == first->file);
+  CHECK(vfs.stats().hits > after_first.hits);
+  CHECK(vfs.changes() == 0);
+}
+
+TEST_CASE("project-database") {
+  // The snapshot resolves paths, pre-splits commands and indexes
+  // entries by source file.
+  fs::path fixture = fixture_dir("gcc-deep-hierarchy");
+  xpto::blot::project proj{fixture / "compile_commands.json"};
+  auto db = proj.database();
+  REQUIRE(db->size() == 2);
+  CHECK(db->at(1).file.filename() == "source-2.cpp");
+  CHECK(db->at(1).file.is_absolute());
+  CHECK(db->at(1).arguments.back() == "source-2.cpp");
+  CHECK(db->find(db->at(1).file) == 1);
+  CHECK(!db->find(fixture / "header.hpp"));
+
+  // Unchanged file, same snapshot.
+  CHECK(proj.database() == db);
+}
+
+TEST_CASE("project-database-lazy") {
+  // Entries are indexed up front but parsed on demand.  Escaped paths
+  // are decoded, members come in any order, and a malformed entry only
+  // comes back empty.
+  scratch_dir scratch{};
+  const auto& dir = scratch.path();
+  std::ofstream{dir / "compile_commands.json"} << R"([
+    {"file": "a.cpp", "output": {"nested": ["}", "]"]},
+     "arguments": ["c++", "-c", "a.cpp"], "directory": "."},
+    {"directory": "sub\/dir", "command": "c++ -c \"b c.cpp\"",
+     "file": "b c.cpp"},
+    {"directory": ".", "file": "bad.cpp", "command": 42},
+    {"file": "no-directory.cpp", "command": "c++ -c no-directory.cpp"}
+  ])";
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  auto db = proj.database();
+  REQUIRE(db->size() == 3);
+  CHECK(db->file(0) == dir / "a.cpp");
+  CHECK(db->file(1) == dir / "sub" / "dir" / "b c.cpp");
+  CHECK(db->find(dir / "sub" / "dir" / "b c.cpp") == 1);
+  CHECK(
+      db->at(1).arguments ==
+      std::vector<std::string>{"c++", "-c", "b c.cpp"});
+  CHECK(db->at(0).command == "c++ -c a.cpp");
+  CHECK(db->at(2).arguments.empty());
+  CHECK(&db->at(0) == &db->at(0));
+}
+
+TEST_CASE("tokenize-command") {
+  using xpto::blot::tokenize_command;
+  CHECK(
+      tokenize_command(R"(g++ -DX="a b" 'c d' e\ f  -c x.cpp)") ==
+      std::vector<std::string>{"g++", "-DX=a b", "c d", "e f", "-c", "x.cpp"});
+}
+
+TEST_CASE("infer-backends-agree") {
+  // Both backends pick the same includer for every header of the
+  // fixtures that compile cleanly.
+  using xpto::blot::infer_backend;
+  for (const char* name :
+       {"gcc-deep-hierarchy", "gcc-deep-hierarchy-2", "gcc-header-woes"}) {
+    fs::path fixture = fixture_dir(name);
+    xpto::blot::project proj{fixture / "compile_commands.json"};
+    for (const auto& e : fs::recursive_directory_iterator(fixture)) {
+      if (e.path().extension() != ".hpp") continue;
+      CAPTURE(e.path());
+      auto pre = xpto::blot::infer(
+          proj, e.path(), {.backend = infer_backend::preprocess});
+      auto dep = xpto::blot::infer(
+          proj, e.path(), {.backend = infer_backend::dependency_scan});
+      REQUIRE(pre.has_value());
+      REQUIRE(dep.has_value());
+      CHECK(pre->file == dep->file);
+    }
+  }
+}
+
+TEST_CASE("make-prerequisites") {
+  using xpto::blot::make_prerequisites;
+  CHECK(
+      make_prerequisites("a.o b.o: a.c \\\n  dir/with\\ space.h x$$y.h\n"
+                         "a.h:\n") ==
+      std::vector<std::string>{"a.c", "dir/with space.h", "x$y.h"});
+}
+
+namespace {
+
+// In `dir`, a project of `n_tus` TUs, all including the same
+// `n_headers` headers plus some of the standard library, and one header
+// included only by the last TU, which is the worst case for infer().
+void make_synthetic_project(
+    const fs::path& dir, size_t n_tus, size_t n_headers) {
+  fs::create_directories(dir / "include");
+  for (size_t h = 0; h < n_headers; ++h) {
+    std::ofstream f{dir / "include" / fmt::format("h{}.hpp", h)};
+    f << "#pragma once\n#include <vector>\n#include <string>\n";
+    if (h) f << fmt::format("#include \"h{}.hpp\"\n", h - 1);
+    for (int i = 0; i < 50; ++i)
+      f << fmt::format(
+          "inline int h{}_f{}(int x) {{ return x + {}; }}\n", h, i, i);
+  }
+  std::ofstream{dir / "include" / "needle.hpp"} << "#pragma once\n";
+  std::ofstream ccj{dir / "compile_commands.json"};
+  ccj << "[";
+  for (size_t t = 0; t < n_tus; ++t) {
+    auto tu = fmt::format("tu{}.cpp", t);
+    std::ofstream f{dir / tu};
+    f << fmt::format("#include \"h{}.hpp\"\n", n_headers - 1);
+    if (t + 1 == n_tus) f << "#include \"needle.hpp\"\n";
+    f << "#include <map>\nint main() {}\n";
+    ccj << (t ? "," : "")
+        << fmt::format(
+               R"({{"directory":"{}","file":"{}","arguments":)"
+               R"(["/usr/bin/c++","-std=c++23","-Iinclude","-c","{}"]}})",
+               dir.string(), tu, tu);
+  }
+  ccj << "]";
+}
+
+}  // namespace
+
+TEST_CASE("infer-backends-benchmark" * doctest::skip()) {
+  // Not a test: run with --no-skip to compare backends, cold and warm.
+  using xpto::blot::infer_backend;
+  auto time = [](auto&& fn) {
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - t0)
+        .count();
+  };
+  std::vector<std::pair<fs::path, fs::path>> cases;
+  for (const char* name :
+       {"gcc-deep-hierarchy", "gcc-deep-hierarchy-2", "gcc-header-woes"}) {
+    auto dir = fixture_dir(name);
+    cases.emplace_back(dir, dir / "header.hpp");
+  }
+  cases.back().second = cases.back().first / "header1.hpp";
+  scratch_dir scratch{};
+  const auto& synthetic = scratch.path();
+  make_synthetic_project(synthetic, 200, 20);
+  cases.emplace_back(synthetic, synthetic / "include" / "needle.hpp");
+
+  for (const auto& [dir, header] : cases) {
+    for (auto backend :
+         {infer_backend::preprocess, infer_backend::dependency_scan}) {
+      xpto::blot::project proj{dir / "compile_commands.json"};
+      auto run = [&] {
+        auto res = xpto::blot::infer(proj, header, {.backend = backend});
+        CHECK(res.has_value());
+      };
+      auto cold = time(run);
+      auto warm = time(run);
+      MESSAGE(fmt::format(
+          "{} {}: cold {} ms, warm {} ms", dir.filename(),
+          backend == infer_backend::preprocess ? "preprocess"
+                                               : "dependency-scan",
+          cold, warm));
+    }
+  }
+}
+
+namespace {
+
+// Date the sources of a copy of the gcc-build-deps fixture an hour
+// ago.  It has two TUs, only b.cpp really including h.hpp, both built
+// with -MD.
+void age_build_deps_project(const fs::path& dir) {
+  auto past = fs::file_time_type::clock::now() - std::chrono::hours{1};
+  for (const char* f : {"a.cpp", "b.cpp", "h.hpp"})
+    fs::last_write_time(dir / f, past);
+}
+
+}  // namespace
+
+TEST_CASE("infer-build-deps") {
+  // Fresh dependency files are believed, even when they lie; stale ones
+  // are ignored in favour of preprocessing.
+  using xpto::blot::infer_backend;
+  scratch_dir scratch{"gcc-build-deps"};
+  const auto& dir = scratch.path();
+  age_build_deps_project(dir);
+  std::ofstream{dir / "a.d"} << "a.o: a.cpp \\\n  h.hpp\n";
+  std::ofstream{dir / "b.d"} << "b.o: b.cpp h.hpp\n";
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  auto header = dir / "h.hpp";
+
+  auto res =
+      xpto::blot::infer(proj, header, {.backend = infer_backend::build_deps});
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "a.cpp");
+  res = xpto::blot::infer(proj, header, {.backend = infer_backend::preprocess});
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "b.cpp");
+
+  fs::last_write_time(
+      header, fs::file_time_type::clock::now() + std::chrono::hours{1});
+  res =
+      xpto::blot::infer(proj, header, {.backend = infer_backend::build_deps});
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "b.cpp");
+}
+
+TEST_CASE("infer-build-deps-ninja-log") {
+  // Same, from a hand-made version 4 .ninja_deps log.
+  using xpto::blot::infer_backend;
+  scratch_dir scratch{"gcc-build-deps"};
+  const auto& dir = scratch.path();
+  age_build_deps_project(dir);
+  std::string log{"# ninjadeps\n"};
+  auto put = [&](uint32_t v) { log.append(reinterpret_cast<char*>(&v), 4); };
+  put(4);
+  std::vector<std::string> nodes{"a.o", "a.cpp", "h.hpp"};
+  for (uint32_t id = 0; id < nodes.size(); ++id) {
+    auto name = nodes[id];
+    name.resize((name.size() + 3) / 4 * 4, '\0');
+    put(static_cast<uint32_t>(name.size() + 4));
+    log += name;
+    put(~id);
+  }
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  put(0x80000000U | 20U);
+  put(0);
+  put(static_cast<uint32_t>(now));
+  put(static_cast<uint32_t>(static_cast<uint64_t>(now) >> 32));
+  put(1);
+  put(2);
+  std::ofstream{dir / ".ninja_deps", std::ios::binary} << log;
+
+  auto parsed = xpto::blot::read_ninja_deps(dir / ".ninja_deps");
+  REQUIRE(parsed);
+  REQUIRE(parsed->by_output.contains((dir / "a.o").string()));
+  const auto& rec = parsed->by_output.at((dir / "a.o").string());
+  CHECK(rec.mtime == now);
+  REQUIRE(rec.deps.size() == 2);
+  CHECK(parsed->nodes[rec.deps[1]] == (dir / "h.hpp").string());
+
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  auto res = xpto::blot::infer(
+      proj, dir / "h.hpp", {.backend = infer_backend::build_deps});
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "a.cpp");
+}
+
+TEST_CASE("infer-ranking") {
+  // Two TUs include net/foo.hpp: ui/a.cpp, first in database order, and
+  // net/foo.cpp, which is named like the header and sits next to it, so
+  // ranking tries it first.  A previous result outranks both.
+  auto dir = fixture_dir("gcc-two-includers");
+  auto header = dir / "net" / "foo.hpp";
+
+  xpto::blot::project ranked{dir / "compile_commands.json"};
+  auto res = xpto::blot::infer(ranked, header);
+  REQUIRE(res.has_value());
+  CHECK(res->file == dir / "net" / "foo.cpp");
+
+  xpto::blot::project unranked{dir / "compile_commands.json"};
+  res = xpto::blot::infer(unranked, header, {.rank = false});
+  REQUIRE(res.has_value());
+  CHECK(res->file == dir / "ui" / "a.cpp");
+  res = xpto::blot::infer(unranked, header);
+  REQUIRE(res.has_value());
+  CHECK(res->file == dir / "ui" / "a.cpp");
+}
+
+TEST_CASE("infer-all-cheapest-first") {
+  // Both includers are found, and the one that compiled faster last
+  // time comes first, though ranking prefers the other.
+  auto dir = fixture_dir("gcc-two-includers");
+  auto header = dir / "net" / "foo.hpp";
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  proj.record_compile_time(
+      dir / "net" / "foo.cpp", std::chrono::milliseconds{5000});
+  proj.record_compile_time(dir / "ui" / "a.cpp", std::chrono::milliseconds{20});
+
+  auto all = xpto::blot::infer_all(proj, header, 4);
+  REQUIRE(all.size() == 2);
+  CHECK(all[0].command.file == dir / "ui" / "a.cpp");
+  CHECK(all[0].estimated_cost == std::chrono::milliseconds{20});
+  CHECK(all[1].command.file == dir / "net" / "foo.cpp");
+  CHECK(all[1].source_bytes > 0);
+
+  auto one = xpto::blot::infer_all(proj, header, 1);
+  REQUIRE(one.size() == 1);
+  CHECK(one[0].command.file == dir / "net" / "foo.cpp");
+}
+
+TEST_CASE("infer-all-stops-after-first-includer") {
+  // Only the first of ten TUs includes the header.  Asking for more
+  // includers than it has scans a couple more TUs, not all of them.
+  auto dir = fixture_dir("gcc-one-includer");
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  size_t scanned{};
+  xpto::blot::infer_options opts{
+    .jobs = 1, .rank = false, .on_progress = [&](size_t n, size_t) {
+      scanned = n;
+    }};
+  auto all = xpto::blot::infer_all(proj, dir / "needle.hpp", 4, opts);
+  REQUIRE(all.size() == 1);
+  CHECK(all[0].command.file.filename() == "t0.cpp");
+  CHECK(scanned > 0);
+  CHECK(scanned <= 3);
+}
+
+TEST_CASE("infer-prunes-clean-user-headers") {
+  // Every TU includes common.hpp, which includes deep.hpp, and only the
+  // last one includes needle.hpp.  Once explored, both user headers are
+  // remembered as not leading to the needle, until one of them changes.
+  // The test edits deep.hpp, so it works on a copy of the fixture.
+  scratch_dir scratch{"gcc-pruning"};
+  const auto& dir = scratch.path();
+  auto needle = dir / "needle.hpp";
+
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  xpto::blot::infer_options opts{.jobs = 1, .rank = false};
+  auto res = xpto::blot::infer(proj, needle, opts);
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "t2.cpp");
+  {
+    // All three TUs are preprocessed alike, so they share one memo.
+    auto memo = proj.caches().pruning_memo_for(
+        needle.string(), proj.database()->at(0));
+    CHECK(memo->clean.contains((dir / "common.hpp").string()));
+    CHECK(memo->clean.contains((dir / "deep.hpp").string()));
+  }
+
+  std::ofstream{dir / "deep.hpp"} << "#pragma once\n#include \"needle.hpp\"\n";
+  res = xpto::blot::infer(proj, needle, opts);
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "t0.cpp");
+}
+
+TEST_CASE("infer-prunes-per-macros") {
+  // t0.cpp defines FOO_LITE, so foo.hpp doesn't lead to needle-a.hpp
+  // there, but does from t1.cpp.  And config.hpp leads nowhere, but
+  // makes t2.cpp include needle-b.hpp.  Neither header is pruned.
+  fs::path fixture = fixture_dir("gcc-pruning-macros");
+  xpto::blot::project proj{fixture / "compile_commands.json"};
+  xpto::blot::infer_options opts{.jobs = 1, .rank = false};
+
+  auto a = xpto::blot::infer(proj, fixture / "needle-a.hpp", opts);
+  REQUIRE(a.has_value());
+  CHECK(a->file.filename() == "t1.cpp");
+  auto b = xpto::blot::infer(proj, fixture / "needle-b.hpp", opts);
+  REQUIRE(b.has_value());
+  CHECK(b->file.filename() == "t2.cpp");
+
+  auto memo = proj.caches().pruning_memo_for(
+      (fixture / "needle-b.hpp").string(), proj.database()->at(0));
+  CHECK_FALSE(memo->clean.contains((fixture / "config.hpp").string()));
+  CHECK_FALSE(memo->clean.contains((fixture / "foo.hpp").string()));
+}
+
+TEST_CASE("infer-prunes-per-flags") {
+  // common.hpp includes needle.hpp only if WANT is defined, as it is
+  // for t1.cpp, not t0.cpp.  Explored from t0.cpp, it leads nowhere,
+  // but that mustn't prune it from t1.cpp.
+  auto dir = fixture_dir("gcc-conditional-include");
+
+  xpto::blot::project proj{dir / "compile_commands.json"};
+  auto res = xpto::blot::infer(
+      proj, dir / "needle.hpp", {.jobs = 1, .rank = false});
+  REQUIRE(res.has_value());
+  CHECK(res->file.filename() == "t1.cpp");
+}
@@ -1,16 +1,24 @@
 #include <doctest/doctest.h>
 
 #include <boost/json.hpp>
+#include <chrono>
 #include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include "fixture.hpp"
 #include "session.hpp"
+#include "store.hpp"
 
 namespace json = boost::json;
 namespace fs = std::filesystem;
@@ -33,8 +41,24 @@ struct jsonrpc_error : std::runtime_error {
 struct mock_session : session {
   mock_session(const fs::path& ccj, const fs::path& root)
       : session{ccj, root} {}
-
-  void send(const json::object& msg) override { outbox.push_back(msg); }
+  mock_session(
+      std::shared_ptr<project> proj, const fs::path& root,
+      std::shared_ptr<session_store> store)
+      : session{std::move(proj), root, std::move(store)} {}
+  mock_session(const mock_session&) = delete;
+  mock_session(mock_session&&) = delete;
+  mock_session& operator=(const mock_session&) = delete;
+  mock_session& operator=(mock_session&&) = delete;
+  ~mock_session() override { stop_background_work(); }
+
+  void send_raw(std::string_view text) override {
+    auto msg = json::parse(text);
+    std::lock_guard lk{outbox_mutex_};
+    if (msg.is_array())
+      batches_.push_back(std::move(msg.as_array()));
+    else
+      outbox.push_back(std::move(msg.as_object()));
+  }
 
   // Serialize and dispatch a JSONRPC request; return the result object.
   // Throws jsonrpc_error if the response contains an "error" field.
@@ -46,6 +70,7 @@ struct mock_session : session {
     req["params"] = std::move(params);
     handle_frame(json::serialize(req));
 
+    std::lock_guard lk{outbox_mutex_};
     while (!outbox.empty()) {
       auto msg = outbox.front();
       outbox.pop_front();
@@ -60,14 +85,55 @@ struct mock_session : session {
     throw std::runtime_error{"call(): no response in outbox"};
   }
 
+  // Dispatch a JSONRPC notification, which gets no response.
+  void notify(std::string_view method, json::object params = {}) {
+    json::object req{};
+    req["jsonrpc"] = "2.0";
+    req["method"] = method;
+    req["params"] = std::move(params);
+    handle_frame(json::serialize(req));
+  }
+
+  // Dispatch a JSONRPC batch; return the array of responses, if any.
+  std::optional<json::array> call_batch(const json::array& batch) {
+    handle_frame(json::serialize(batch));
+    std::lock_guard lk{outbox_mutex_};
+    if (batches_.empty()) return std::nullopt;
+    auto res = std::move(batches_.back());
+    batches_.clear();
+    return res;
+  }
+
   std::vector<json::object> pop_notifications() {
+    std::lock_guard lk{outbox_mutex_};
     return std::move(notifications_);
   }
 
+  // Wait for a notification sent from a background thread, returning
+  // the params of the first one satisfying `pred`.
+  json::object wait_notification(
+      const std::function<bool(const json::object&)>& pred) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::minutes{1};
+    while (std::chrono::steady_clock::now() < deadline) {
+      {
+        std::lock_guard lk{outbox_mutex_};
+        for (; !outbox.empty(); outbox.pop_front())
+          notifications_.push_back(std::move(outbox.front()));
+        for (const auto& n : notifications_)
+          if (pred(n.at("params").as_object()))
+            return n.at("params").as_object();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    throw std::runtime_error{"wait_notification(): timed out"};
+  }
+
  private:
   int next_id_{1};
+  std::mutex outbox_mutex_;
   std::vector<json::object> notifications_;
   std::deque<json::object> outbox;
+  std::vector<json::array> batches_;
 };
 
 static std::tuple<int64_t, int64_t, int64_t> run_pipeline(mock_session& sess) {
@@ -207,6 +273,251 @@ TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_infer_unknown_file") {
   CHECK(caught);
 }
 
+TEST_CASE("server_infer_budget") {
+  // A project never indexed: the header's includer takes a scan to
+  // find, longer than a budget of nothing.
+  scratch_dir scratch{"gcc-includes"};
+  const auto& root = scratch.path();
+  fs::remove(root / ".blot-include-index.json");
+  json::object entry{};
+  entry["directory"] = root.string();
+  entry["command"] =
+      "/usr/bin/c++ -std=c++23 -g -O0 -I ./just-an-include-dir "
+      "-o source.o -c source.cpp";
+  entry["file"] = "source.cpp";
+  std::ofstream{root / "compile_commands.json"}
+      << json::serialize(json::array{entry});
+  mock_session sess{root / "compile_commands.json", root};
+  sess.call("initialize");
+
+  json::object ip{};
+  ip["file"] = "header.hpp";
+  ip["budget_ms"] = 0;
+  auto res = sess.call("blot/infer", ip);
+  auto tok = res.at("token").as_int64();
+  REQUIRE(res.contains("status"));
+  CHECK(res.at("status").as_string() == "pending");
+  CHECK(res.at("cached").as_bool() == false);
+  auto last = sess.wait_notification([](const json::object& p) {
+    auto status = p.at("status").as_string();
+    return status == "done" || status == "error";
+  });
+  CHECK(last.at("status").as_string() == "done");
+  CHECK(last.at("token").as_int64() == tok);
+  CHECK(last.contains("inference"));
+
+  json::object tp{};
+  tp["token"] = tok;
+  auto again = sess.call("blot/infer", tp);
+  CHECK(std::string{again.at("cached").as_string()} == "token");
+  auto target = again.at("inference").as_object().at("annotation_target");
+  CHECK(fs::path{std::string{target.as_string()}}.filename() == "source.cpp");
+
+  json::object bad{};
+  bad["file"] = "header.hpp";
+  bad["budget_ms"] = "soon";
+  CHECK_RPC_ERROR(sess, "blot/infer", bad, -32602);
+}
+
+TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_pipeline") {
+  sess.call("initialize");
+  json::object p{};
+  p["file"] = "source.cpp";
+  auto res = sess.call("blot/pipeline", p);
+  CHECK(res.at("assembly").as_array().size() > 0);
+  CHECK(res.contains("line_mappings"));
+
+  std::vector<std::string> stages;
+  for (auto& n : sess.pop_notifications()) {
+    if (n.at("method").as_string() != "blot/partial") continue;
+    auto& params = n.at("params").as_object();
+    stages.emplace_back(params.at("stage").as_string());
+    CHECK(params.at("result").as_object().contains("token"));
+  }
+  CHECK(stages == std::vector<std::string>{"infer", "grab_asm"});
+
+  p["file"] = "no_such_file.cpp";
+  bool caught = false;
+  try {
+    sess.call("blot/pipeline", p);
+  } catch (const jsonrpc_error& e) {
+    CHECK((e.code == -32602 || e.code == -32603));
+    caught = true;
+  }
+  CHECK(caught);
+}
+
+TEST_CASE("server_prefetch") {
+  auto root = fixture_dir("gcc-includes");
+  fs::current_path(root);
+  auto proj = std::make_shared<project>(root / "compile_commands.json");
+  auto store = std::make_shared<session_store>(
+      k_default_cache_budget,
+      prefetch_options{.cpu_percent = 100, .memory = size_t{1} << 30});
+  mock_session sess{proj, root, store};
+  sess.call("initialize");
+
+  json::object p{};
+  p["file"] = "source.cpp";
+  CHECK(sess.call("blot/pipeline", p).at("cached").as_bool() == false);
+
+  // Its header is next door, and included.
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::minutes{1};
+  for (;;) {
+    auto st = store->prefetch.stats();
+    if (st.warmed > 0 && st.queued == 0 && !st.busy) break;
+    REQUIRE(std::chrono::steady_clock::now() < deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+  p["file"] = "header.hpp";
+  CHECK(sess.call("blot/pipeline", p).at("cached").is_string());
+}
+
+TEST_CASE("server_pipeline_unsaved") {
+  auto root = fixture_dir("clang-demangle");
+  fs::current_path(root);
+  mock_session sess{root / "compile_commands.json", root};
+  sess.call("initialize");
+
+  json::object p{};
+  p["file"] = "source.cpp";
+  auto saved = sess.call("blot/pipeline", p);
+
+  json::object buf{};
+  buf["file"] = "source.cpp";
+  buf["contents"] = "int unsaved_fn() { return 7; }\n";
+  p["unsaved"] = json::array{buf};
+  auto unsaved = sess.call("blot/pipeline", p);
+  CHECK(unsaved.at("token") != saved.at("token"));
+  bool found{};
+  for (const auto& line : unsaved.at("assembly").as_array())
+    found = found || line.as_string().find("unsaved_fn") != json::string::npos;
+  CHECK(found);
+
+  // Same contents, same assembly.
+  CHECK(sess.call("blot/pipeline", p).at("cached").is_string());
+
+  buf["file"] = "../gcc-minimal/source.cpp";
+  p["unsaved"] = json::array{buf};
+  CHECK_RPC_ERROR(sess, "blot/pipeline", p, -32602);
+}
+
+TEST_CASE("server_live_changes") {
+  auto root = fixture_dir("clang-demangle");
+  fs::current_path(root);
+  mock_session sess{root / "compile_commands.json", root};
+  json::object init{};
+  init["debounce_ms"] = 100;
+  sess.call("initialize", init);
+
+  auto buffer = [](int version, const std::string& fn) {
+    json::object p{};
+    p["file"] = "source.cpp";
+    p["version"] = version;
+    p["text"] = "int " + fn + "() { return 0; }\n";
+    return p;
+  };
+  sess.notify("blot/didOpen", buffer(1, "live_one"));
+  // Typed in a hurry: only the last of these is compiled.
+  sess.notify("blot/didChange", buffer(2, "live_two"));
+  sess.notify("blot/didChange", buffer(3, "live_three"));
+
+  auto live = sess.wait_notification([](const json::object& n) {
+    return n.contains("version") && n.at("version").as_int64() == 3;
+  });
+  REQUIRE(live.contains("result"));
+  CHECK(live.at("file").as_string() == (root / "source.cpp").string());
+  bool found{};
+  for (const auto& line :
+       live.at("result").as_object().at("assembly").as_array())
+    found = found || line.as_string().find("live_three") != json::string::npos;
+  CHECK(found);
+  for (const auto& n : sess.pop_notifications()) {
+    // Notifications aren't answered.
+    REQUIRE(n.contains("method"));
+    if (n.at("method").as_string() == "blot/live")
+      CHECK(n.at("params").as_object().at("version").as_int64() != 2);
+  }
+
+  auto unopened = buffer(1, "other");
+  unopened["file"] = "other.cpp";
+  CHECK_RPC_ERROR(sess, "blot/didChange", unopened, -32602);
+  json::object close{};
+  close["file"] = "source.cpp";
+  CHECK(sess.call("blot/didClose", close).empty());
+  CHECK_RPC_ERROR(sess, "blot/didChange", buffer(4, "other"), -32602);
+}
+
+TEST_CASE("server_watch_recompiles") {
+  // A copy of a fixture, to edit.
+  auto root = fs::temp_directory_path() / "blot-watch-tests";
+  fs::remove_all(root);
+  fs::copy(fixture_dir("gcc-minimal"), root, fs::copy_options::recursive);
+  fs::current_path(root);
+  auto proj = std::make_shared<project>(root / "compile_commands.json");
+  auto store = std::make_shared<session_store>();
+  {
+    mock_session sess{proj, root, store};
+    json::object init{};
+    init["recompile_on_change"] = true;
+    sess.call("initialize", init);
+    json::object p{};
+    p["file"] = "source.cpp";
+    auto tok = sess.call("blot/pipeline", p).at("token");
+
+    {
+      std::ofstream out{root / "source.cpp", std::ios::app};
+      out << "int answer() { return 42; }\n";
+    }
+    // Where files can't be watched, say it ourselves.
+    if (!store->watch.enabled()) store->watch.changed({root / "source.cpp"});
+
+    auto inv = sess.wait_notification(
+        [](const json::object& n) { return n.contains("tokens"); });
+    CHECK(inv.at("tokens").as_array() == json::array{tok});
+    CHECK(inv.at("recompiling").as_bool());
+    auto upd = sess.wait_notification(
+        [](const json::object& n) { return n.contains("token"); });
+    REQUIRE(upd.contains("result"));
+    bool found{};
+    for (const auto& line :
+         upd.at("result").as_object().at("assembly").as_array())
+      found = found || line.as_string().find("answer") != json::string::npos;
+    CHECK(found);
+    CHECK(store->watch.stats().invalidated == 1);
+  }
+  fs::current_path(fs::temp_directory_path());
+  fs::remove_all(root);
+}
+
+TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_batch") {
+  auto request = [](int id, std::string_view method) {
+    json::object req{};
+    req["jsonrpc"] = "2.0";
+    req["id"] = id;
+    req["method"] = method;
+    return req;
+  };
+  json::object notification{};
+  notification["jsonrpc"] = "2.0";
+  notification["method"] = "blot/stats";
+
+  json::array batch{
+    request(1, "initialize"), notification, request(2, "blot/stats"),
+    request(3, "no/such_method")};
+  auto res = sess.call_batch(batch);
+  REQUIRE(res);
+  REQUIRE(res->size() == 3);
+  auto response = [&](size_t i) { return res->at(i).as_object(); };
+  CHECK(response(0).at("id").as_int64() == 1);
+  CHECK(response(0).contains("result"));
+  CHECK(response(1).at("id").as_int64() == 2);
+  CHECK(response(2).at("error").as_object().at("code").as_int64() == -32601);
+
+  // Nothing to answer for a batch of notifications.
+  CHECK(!sess.call_batch(json::array{notification}));
+}
+
 TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_annotate_options") {
   sess.call("initialize");
 
@@ -305,6 +616,36 @@ TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_annotate_token") {
   CHECK(std::string{res.at("cached").as_string()} == "token");
 }
 
+TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_annotate_options") {
+  auto [infer_tok, asm_tok, ann_tok] = run_pipeline(sess);
+
+  auto annotate = [&](bool demangle) {
+    json::object p{};
+    p["token"] = asm_tok;
+    json::object opts{};
+    opts["demangle"] = demangle;
+    p["options"] = std::move(opts);
+    return sess.call("blot/annotate", p);
+  };
+  // run_pipeline() annotated without demangling.
+  CHECK(annotate(true).at("cached").as_bool() == false);
+  CHECK(std::string{annotate(false).at("cached").as_string()} == "token");
+  CHECK(std::string{annotate(true).at("cached").as_string()} == "token");
+}
+
+TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_annotate_blob") {
+  sess.call("initialize");
+  json::object p{};
+  p["asm_blob"] = "main:\n\tret\n";
+  auto first = sess.call("blot/annotate", p);
+  CHECK(first.at("cached").as_bool() == false);
+
+  auto again = sess.call("blot/annotate", p);
+  CHECK(std::string{again.at("cached").as_string()} == "other");
+  CHECK(again.at("token") == first.at("token"));
+  CHECK(again.at("assembly") == first.at("assembly"));
+}
+
 TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_infer_token") {
   auto [infer_tok, asm_tok, ann_tok] = run_pipeline(sess);
 
@@ -331,6 +672,37 @@ TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_is_session_scoped") {
   CHECK_RPC_ERROR(sess2, "blot/infer", p, -32602);
 }
 
+TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_shared_across_sessions") {
+  auto proj = std::make_shared<project>(ccj);
+  auto store = std::make_shared<session_store>();
+  int64_t asm_tok{};
+  {
+    mock_session sess1{proj, root, store};
+    auto [it, at, ant] = run_pipeline(sess1);
+    asm_tok = at;
+    CHECK(sess1.call("blot/stats").at("sessions").as_int64() == 1);
+    CHECK(store->cache.stats().held == 1);  // one token all along
+  }
+  CHECK(store->cache.stats().held == 0);
+
+  // Like a reconnect: the old session's tokens are still good.
+  mock_session sess2{proj, root, store};
+  sess2.call("initialize");
+  json::object p{};
+  p["token"] = asm_tok;
+  auto res = sess2.call("blot/grab_asm", p);
+  CHECK(std::string{res.at("cached").as_string()} == "token");
+
+  // And a fresh inference compiles to what's cached already.
+  json::object ip{};
+  ip["file"] = "source.cpp";
+  json::object ap{};
+  ap["token"] = sess2.call("blot/infer", ip).at("token");
+  res = sess2.call("blot/grab_asm", ap);
+  CHECK(std::string{res.at("cached").as_string()} == "other");
+  CHECK(res.at("token").as_int64() == asm_tok);
+}
+
 TEST_CASE_FIXTURE(gcc_minimal_fixture, "server_cache_other_inference") {
   sess.call("initialize");
 